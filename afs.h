@@ -0,0 +1,79 @@
+// afs.h - On-disk format of the Algebra file system (AFS), shared by the
+// kernel and the host tools in tools/
+//
+// A disk is an array of AFS_BLOCK_SIZE blocks:
+//
+//     0                  left for a boot sector
+//     1                  superblock
+//     inode_bitmap       one block, one bit per inode
+//     block_bitmap ...   one bit per block, set while the block is in use
+//     inode_table ...    AfsInode records, inode n at byte n * 64
+//     data_start ...     file data, directory entries and pointer blocks
+//
+// Metadata blocks are marked used in the block bitmap, as are the bits past
+// block_count, so allocators never need to range-check a free bit. Inode 0
+// is reserved so that 0 can mean "none" in block pointers and entries.
+// Every field is little-endian.
+#ifndef AFS_H
+#define AFS_H
+
+#define AFS_MAGIC 0x31534641            // "AFS1"
+#define AFS_VERSION 1
+#define AFS_BLOCK_SIZE 1024
+#define AFS_SECTORS_PER_BLOCK (AFS_BLOCK_SIZE / 512)
+#define AFS_SUPER_BLOCK 1
+#define AFS_ROOT_INODE 1
+#define AFS_MAX_INODES (AFS_BLOCK_SIZE * 8)
+#define AFS_INODES_PER_BLOCK (AFS_BLOCK_SIZE / sizeof(AfsInode))
+#define AFS_DIRENTS_PER_BLOCK (AFS_BLOCK_SIZE / sizeof(AfsDirent))
+#define AFS_PTRS_PER_BLOCK (AFS_BLOCK_SIZE / 4)
+#define AFS_DIRECT 10
+#define AFS_NAME_MAX 32                 // Including the terminating NUL
+
+#define AFS_TYPE_FREE 0
+#define AFS_TYPE_FILE 1
+#define AFS_TYPE_DIR 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t inode_count;
+    uint32_t inode_bitmap;
+    uint32_t block_bitmap;
+    uint32_t block_bitmap_blocks;
+    uint32_t inode_table;
+    uint32_t inode_table_blocks;
+    uint32_t data_start;
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+} AfsSuper;
+
+// Blocks 0 .. AFS_DIRECT-1 of a file are mapped directly, the next
+// AFS_PTRS_PER_BLOCK through the indirect block and the rest through the
+// double indirect one, which with 1 KB blocks allows files of 64 MB
+typedef struct {
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t size;                      // Bytes; a multiple of the entry size for directories
+    uint32_t parent;                    // Inode of the containing directory
+    uint32_t direct[AFS_DIRECT];
+    uint32_t indirect;
+    uint32_t double_indirect;
+    uint32_t spare;
+} AfsInode;
+
+// Directories hold these back to back; inode 0 marks a free slot
+typedef struct {
+    uint32_t inode;
+    uint8_t type;
+    uint8_t reserved[27];
+    char name[AFS_NAME_MAX];
+} AfsDirent;
+
+_Static_assert(sizeof(AfsSuper) <= AFS_BLOCK_SIZE, "AFS superblock must fit a block");
+_Static_assert(sizeof(AfsInode) == 64, "AFS inodes are 64 bytes");
+_Static_assert(sizeof(AfsDirent) == 64, "AFS directory entries are 64 bytes");
+
+#endif
@@ -3,19 +3,24 @@
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
 #define WHITE_ON_BLACK 0x0F
-#define MAX_FILES 128
 #define MAX_FILENAME 32
 #define MAX_FILESIZE 4096
-#define MAX_DIRS 64
+#define MAX_DIRS 1024
 #define MAX_PATH 256
 
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
+typedef short int16_t;
 typedef unsigned int uint32_t;
 typedef int int32_t;
+typedef unsigned long long uint64_t;
+typedef long long int64_t;
+
+#include "afs.h"
 
 static uint16_t* vga = (uint16_t*)VGA_MEMORY;
 static int cursor_x = 0, cursor_y = 0;
+static uint8_t console_muted = 0;  // Drop output (used while benchmarking)
 static char input_buffer[256];
 static int input_pos = 0;
 static char current_dir[MAX_PATH] = "/";
@@ -26,25 +31,65 @@ static char history[MAX_HISTORY][256];
 static int history_count = 0;
 static int history_index = -1;
 
-// Scroll buffer
+// Running totals for the shell, reported by stat and systeminfo
+typedef struct {
+    uint32_t commands;                  // Commands run since boot
+} ShellStats;
+
+static ShellStats shell_stats;
+
+// Scroll buffer: a ring of lines, the oldest at scroll_head. Adding a line
+// only writes one row, so the depth costs memory but no time.
+#ifndef MAX_SCROLL_LINES
 #define MAX_SCROLL_LINES 500
+#endif
 static uint16_t scroll_buffer[MAX_SCROLL_LINES * 80];
+static int scroll_head = 0;
 static int scroll_line_count = 0;
 static int scroll_offset = 0;  // Current display offset from latest lines
 
 // File system structures
+
+// File data is a chain of extents from the kernel heap (see file_append).
+// Every file has its own chain, but the buffers the extents point into are
+// reference counted so that copies share them (see file_copy). A shared
+// buffer is never written again; appending to either copy starts a new
+// extent, so nothing is ever copied.
+typedef struct {
+    uint32_t refs;
+    char bytes[];
+} ExtentBuffer;
+
+typedef struct Extent {
+    struct Extent* next;
+    uint32_t offset;        // File offset of data[0]
+    uint32_t capacity;
+    uint32_t used;
+    char* data;             // ExtentBuffer bytes, or a file in a boot module
+} Extent;
+
+// Files and directories form a tree: each entry knows its parent and its
+// siblings, and each directory the first and last of its children
 typedef struct {
     char name[MAX_FILENAME];
-    char path[MAX_PATH];
-    char data[MAX_FILESIZE];
+    int32_t dir;            // Parent directory
+    int32_t prev, next;     // Siblings in the parent's file list
+    Extent* head;           // 0 until the first write
+    Extent* tail;
     uint32_t size;
-    uint8_t is_dir;
+    uint32_t inode;         // AFS inode holding the data, 0 for files in memory
+    int32_t hash_next;      // Next file in its hash chain, or in the free list
     uint8_t used;
 } File;
 
 typedef struct {
     char name[MAX_FILENAME];
-    char path[MAX_PATH];
+    int32_t parent;         // -1 for the root
+    int32_t prev, next;     // Siblings in the parent's directory list
+    int32_t first_dir, last_dir;
+    int32_t first_file, last_file;
+    uint32_t inode;         // AFS inode for directories on disk, else 0
+    int32_t hash_next;
     uint8_t used;
 } Directory;
 
@@ -57,7 +102,8 @@ typedef struct {
     uint8_t used;
 } WiFiNetwork;
 
-static File files[MAX_FILES];
+static File* files;                     // max_files slots, see tables_init
+static uint32_t max_files;
 static Directory dirs[MAX_DIRS];
 static WiFiNetwork wifi_networks[MAX_WIFI_NETWORKS];
 static int wifi_networks_count = 0;
@@ -129,38 +175,97 @@ void clear_screen();
 void scroll_page_up();
 void scroll_page_down();
 void display_scroll_buffer();
+uint8_t inb(uint16_t port);
+void outb(uint16_t port, uint8_t val);
+
+// The console is drawn in a shadow buffer in RAM and copied to VGA memory,
+// which is slow uncached MMIO, a row at a time by console_flush. Row 0 is
+// fixed; rows 1 and down are a ring starting at console_top, so scrolling
+// moves the offset instead of the text.
+static uint16_t console[VGA_HEIGHT * VGA_WIDTH];
+static int console_top = 0;
+static uint32_t console_dirty = 0;      // Bit per screen row
+#define CONSOLE_ALL_DIRTY ((1u << VGA_HEIGHT) - 1)
+
+// Screen row y in the shadow buffer
+uint16_t* console_row(int y) {
+    if (y == 0) return console;
+    y += console_top;
+    if (y >= VGA_HEIGHT) y -= VGA_HEIGHT - 1;
+    return &console[y * VGA_WIDTH];
+}
+
+void console_put(int x, int y, uint16_t cell) {
+    console_row(y)[x] = cell;
+    console_dirty |= 1u << y;
+}
+
+// Hardware text cursor, set through the CRTC index/data ports
+#define CRTC_INDEX 0x3D4
+#define CRTC_DATA 0x3D5
+static int cursor_shown = -1;           // Position last given to the CRTC
+
+void cursor_enable() {
+    outb(CRTC_INDEX, 0x0A);             // Cursor start scanline
+    outb(CRTC_DATA, (inb(CRTC_DATA) & 0xC0) | 14);
+    outb(CRTC_INDEX, 0x0B);             // Cursor end scanline
+    outb(CRTC_DATA, (inb(CRTC_DATA) & 0xE0) | 15);
+}
+
+// Move the hardware cursor to cursor_x, cursor_y
+void cursor_update() {
+    int pos = cursor_y * VGA_WIDTH + cursor_x;
+    if (pos == cursor_shown) return;
+    outb(CRTC_INDEX, 0x0F);
+    outb(CRTC_DATA, pos & 0xFF);
+    outb(CRTC_INDEX, 0x0E);
+    outb(CRTC_DATA, (pos >> 8) & 0xFF);
+    cursor_shown = pos;
+}
+
+// Copy the changed rows to the screen and place the cursor
+void console_flush() {
+    if (scroll_offset) return;
+    for (int y = 0; console_dirty && y < VGA_HEIGHT; y++) {
+        if (!(console_dirty & (1u << y))) continue;
+        uint16_t* src = console_row(y);
+        uint16_t* dst = vga + y * VGA_WIDTH;
+        uint32_t dwords = VGA_WIDTH / 2;
+        asm volatile("rep movsl" : "+S"(src), "+D"(dst), "+c"(dwords) : : "memory");
+    }
+    console_dirty = 0;
+    cursor_update();
+}
+
+// Line n of the scroll history, 0 being the oldest
+uint16_t* scroll_line(int n) {
+    n += scroll_head;
+    if (n >= MAX_SCROLL_LINES) n -= MAX_SCROLL_LINES;
+    return &scroll_buffer[n * VGA_WIDTH];
+}
 
 // VGA functions
 void scroll_up() {
-    // Save current top line to scroll buffer
+    // Save current top line to scroll buffer, overwriting the oldest when full
+    uint16_t* line;
     if (scroll_line_count < MAX_SCROLL_LINES) {
-        for (int x = 0; x < VGA_WIDTH; x++) {
-            scroll_buffer[scroll_line_count * VGA_WIDTH + x] = vga[1 * VGA_WIDTH + x];
-        }
-        scroll_line_count++;
+        line = scroll_line(scroll_line_count++);
     } else {
-        // Rotate buffer: shift lines up
-        for (int y = 0; y < MAX_SCROLL_LINES - 1; y++) {
-            for (int x = 0; x < VGA_WIDTH; x++) {
-                scroll_buffer[y * VGA_WIDTH + x] = scroll_buffer[(y + 1) * VGA_WIDTH + x];
-            }
-        }
-        // Save current top visible line to end
-        for (int x = 0; x < VGA_WIDTH; x++) {
-            scroll_buffer[(MAX_SCROLL_LINES - 1) * VGA_WIDTH + x] = vga[1 * VGA_WIDTH + x];
-        }
+        line = scroll_line(0);
+        if (++scroll_head == MAX_SCROLL_LINES) scroll_head = 0;
     }
-    
-    // Shift all lines up by 1 (starting from line 1, keep line 0 blank)
-    for (int y = 1; y < VGA_HEIGHT - 1; y++) {
-        for (int x = 0; x < VGA_WIDTH; x++) {
-            vga[y * VGA_WIDTH + x] = vga[(y + 1) * VGA_WIDTH + x];
-        }
+    uint16_t* top = console_row(1);
+    for (int x = 0; x < VGA_WIDTH; x++) {
+        line[x] = top[x];
     }
-    // Clear bottom line
+    
+    // Lines 1 and down move up by 1 (line 0 stays blank); the old top line
+    // becomes the cleared bottom line
     for (int x = 0; x < VGA_WIDTH; x++) {
-        vga[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = (WHITE_ON_BLACK << 8) | ' ';
+        top[x] = (WHITE_ON_BLACK << 8) | ' ';
     }
+    if (++console_top == VGA_HEIGHT - 1) console_top = 0;
+    console_dirty = CONSOLE_ALL_DIRTY & ~1u;
 }
 
 void scroll_page_up() {
@@ -182,19 +287,17 @@ void scroll_page_down() {
 void display_scroll_buffer() {
     // Show a page from scroll history starting at scroll_offset
     if (scroll_offset == 0) {
-        return; // Show latest - no need to redraw
+        console_dirty = CONSOLE_ALL_DIRTY;   // Back to the live screen
+        console_flush();
+        return;
     }
     int start_line = scroll_line_count - scroll_offset - VGA_HEIGHT;
     if (start_line < 0) start_line = 0;
     
     for (int y = 0; y < VGA_HEIGHT; y++) {
+        uint16_t* line = start_line + y < scroll_line_count ? scroll_line(start_line + y) : 0;
         for (int x = 0; x < VGA_WIDTH; x++) {
-            int buf_idx = (start_line + y) * VGA_WIDTH + x;
-            if (start_line + y < scroll_line_count) {
-                vga[y * VGA_WIDTH + x] = scroll_buffer[buf_idx];
-            } else {
-                vga[y * VGA_WIDTH + x] = (WHITE_ON_BLACK << 8) | ' ';
-            }
+            vga[y * VGA_WIDTH + x] = line ? line[x] : (WHITE_ON_BLACK << 8) | ' ';
         }
     }
 }
@@ -202,19 +305,26 @@ void display_scroll_buffer() {
 
 void clear_screen() {
     for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++)
-        vga[i] = (WHITE_ON_BLACK << 8) | ' ';
+        console[i] = (WHITE_ON_BLACK << 8) | ' ';
+    console_top = 0;
+    console_dirty = CONSOLE_ALL_DIRTY;
     cursor_x = 0;
     cursor_y = 1; // Start at line 1, keep line 0 blank
 }
 
 void putchar(char c) {
+    if (console_muted) return;
+    if (scroll_offset) {
+        scroll_offset = 0;                  // Output returns to the live screen
+        console_dirty = CONSOLE_ALL_DIRTY;
+    }
     if (c == '\n') {
         cursor_x = 0;
         cursor_y++;
     } else if (c == '\b') {
         if (cursor_x > 0) cursor_x--;
     } else {
-        vga[cursor_y * VGA_WIDTH + cursor_x] = (WHITE_ON_BLACK << 8) | c;
+        console_put(cursor_x, cursor_y, (WHITE_ON_BLACK << 8) | c);
         cursor_x++;
         if (cursor_x >= VGA_WIDTH) {
             cursor_x = 0;
@@ -229,10 +339,20 @@ void putchar(char c) {
 }
 
 void print(const char* str) {
+    if (console_muted) return;
     while (*str) putchar(*str++);
+    console_flush();
+}
+
+// Print len characters of str, which need not be terminated
+void print_n(const char* str, uint32_t len) {
+    if (console_muted) return;
+    while (len--) putchar(*str++);
+    console_flush();
 }
 
 void print_num(int32_t num) {
+    if (console_muted) return;
     if (num == 0) { putchar('0'); return; }
     if (num < 0) { putchar('-'); num = -num; }
     char buf[12];
@@ -242,6 +362,7 @@ void print_num(int32_t num) {
         num /= 10;
     }
     while (i > 0) putchar(buf[--i]);
+    console_flush();
 }
 
 // Keyboard handling with proper interrupt support
@@ -255,6 +376,382 @@ void outb(uint16_t port, uint8_t val) {
     asm volatile("outb %0, %1" : : "a"(val), "Nd"(port));
 }
 
+uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Enable the x87 FPU and, when the CPU has it, SSE. CR0.EM is cleared so
+// FPU instructions execute instead of trapping, CR0.MP and CR0.NE select
+// native error reporting, and CR4.OSFXSR/OSXMMEXCPT allow SSE.
+//
+// CR0.TS stays clear: there is only one context, so FPU state never needs
+// saving. If tasks are added, a task switch should set TS instead of
+// saving anything; the first FPU instruction of the next task then raises
+// #NM, whose handler fxsaves the previous owner's state, fxrstors the new
+// one's and clears TS. Tasks that never touch the FPU pay nothing.
+static uint8_t fpu_sse2 = 0;
+
+void fpu_init() {
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 &= ~((1u << 2) | (1u << 3));    // EM, TS
+    cr0 |= (1u << 1) | (1u << 5);       // MP, NE
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+    asm volatile("fninit");
+
+    if (edx & (1u << 25)) {
+        uint32_t cr4;
+        asm volatile("mov %%cr4, %0" : "=r"(cr4));
+        cr4 |= (1u << 9) | (1u << 10);  // OSFXSR, OSXMMEXCPT
+        asm volatile("mov %0, %%cr4" : : "r"(cr4));
+        uint32_t mxcsr = 0x1F80;        // Exceptions masked, round to nearest
+        asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+        fpu_sse2 = (edx >> 26) & 1;
+    }
+}
+
+
+// Multiboot information passed by the boot loader in EBX
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+#define MULTIBOOT_INFO_MEMORY (1u << 0)
+#define MULTIBOOT_INFO_MODS (1u << 3)
+#define MULTIBOOT_INFO_MEM_MAP (1u << 6)
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+typedef struct {
+    uint32_t flags;
+    uint32_t mem_lower, mem_upper;      // KB below 1 MB and above 1 MB
+    uint32_t boot_device;
+    uint32_t cmdline;
+    uint32_t mods_count, mods_addr;
+    uint32_t syms[4];
+    uint32_t mmap_length, mmap_addr;
+} __attribute__((packed)) MultibootInfo;
+
+typedef struct {
+    uint32_t size;                      // Of the rest of the entry
+    uint64_t addr, len;
+    uint32_t type;
+} __attribute__((packed)) MultibootMmapEntry;
+
+typedef struct {
+    uint32_t mod_start, mod_end;
+    uint32_t string;                    // Command line the module was loaded with
+    uint32_t reserved;
+} MultibootModule;
+
+// Boot modules, copied out of boot loader memory by pmm_init; their frames
+// stay reserved, since preloaded files point into them
+#define MAX_BOOT_MODULES 8
+
+typedef struct {
+    uint32_t start, end;
+    char cmdline[64];
+} BootModule;
+
+static BootModule boot_modules[MAX_BOOT_MODULES];
+static int boot_module_count = 0;
+
+// Physical memory manager: one bit per 4 KB frame, set while the frame is
+// in use. Everything starts used; only the available ranges of the boot
+// memory map are freed, minus the first 1 MB (BIOS, VGA), the kernel
+// image and the boot modules. The bitmap itself goes right after those and
+// is sized from the highest available address, so it scales with the RAM
+// we boot with.
+// There is no paging, so frame addresses are usable pointers.
+#define PAGE_SIZE 4096
+#define PMM_MAX_REGIONS 32
+
+typedef struct {
+    uint64_t base, length;
+    uint32_t type;
+} MemRegion;
+
+extern uint8_t kernel_end[];            // linker.ld
+static uint32_t* pmm_bitmap = 0;
+static uint32_t pmm_frames = 0;         // Frames covered by the bitmap
+static uint32_t pmm_total = 0;          // Frames the allocator manages
+static uint32_t pmm_used = 0;
+static uint32_t pmm_next = 0;           // Next-fit search start
+static MemRegion pmm_regions[PMM_MAX_REGIONS];
+static int pmm_region_count = 0;
+
+static inline int pmm_test(uint32_t frame) {
+    return (pmm_bitmap[frame >> 5] >> (frame & 31)) & 1;
+}
+
+static inline void pmm_set(uint32_t frame, int used) {
+    if (used) pmm_bitmap[frame >> 5] |= 1u << (frame & 31);
+    else pmm_bitmap[frame >> 5] &= ~(1u << (frame & 31));
+}
+
+// Frames in [start, end) of physical memory: free ones rounded inwards,
+// used ones outwards
+void pmm_mark_range(uint64_t start, uint64_t end, int used) {
+    uint64_t first = used ? start / PAGE_SIZE : (start + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t last = used ? (end + PAGE_SIZE - 1) / PAGE_SIZE : end / PAGE_SIZE;
+    if (last > pmm_frames) last = pmm_frames;
+    for (uint64_t f = first; f < last; f++) {
+        if (pmm_test(f) == used) continue;
+        pmm_set(f, used);
+        if (used) pmm_total--;
+        else pmm_total++;
+    }
+}
+
+void pmm_init(const MultibootInfo* mbi) {
+    // Copy the memory map (it lives in boot loader memory), or make one
+    // from mem_upper if the loader gave no map
+    pmm_region_count = 0;
+    if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+        uint32_t p = mbi->mmap_addr;
+        while (p < mbi->mmap_addr + mbi->mmap_length && pmm_region_count < PMM_MAX_REGIONS) {
+            const MultibootMmapEntry* e = (const MultibootMmapEntry*)p;
+            MemRegion* r = &pmm_regions[pmm_region_count++];
+            r->base = e->addr;
+            r->length = e->len;
+            r->type = e->type;
+            p += e->size + sizeof(e->size);
+        }
+    } else if (mbi->flags & MULTIBOOT_INFO_MEMORY) {
+        pmm_regions[0].base = 0;
+        pmm_regions[0].length = (uint64_t)mbi->mem_lower * 1024;
+        pmm_regions[0].type = MULTIBOOT_MEMORY_AVAILABLE;
+        pmm_regions[1].base = 0x100000;
+        pmm_regions[1].length = (uint64_t)mbi->mem_upper * 1024;
+        pmm_regions[1].type = MULTIBOOT_MEMORY_AVAILABLE;
+        pmm_region_count = 2;
+    }
+    
+    // Note the modules; the bitmap goes after the last of them
+    uint32_t reserved_end = (uint32_t)kernel_end;
+    boot_module_count = 0;
+    if (mbi->flags & MULTIBOOT_INFO_MODS) {
+        const MultibootModule* mods = (const MultibootModule*)mbi->mods_addr;
+        for (uint32_t i = 0; i < mbi->mods_count && boot_module_count < MAX_BOOT_MODULES; i++) {
+            BootModule* m = &boot_modules[boot_module_count++];
+            m->start = mods[i].mod_start;
+            m->end = mods[i].mod_end;
+            m->cmdline[0] = '\0';
+            const char* str = (const char*)mods[i].string;
+            if (str) {
+                int n = 0;
+                while (str[n] && n < (int)sizeof(m->cmdline) - 1) {
+                    m->cmdline[n] = str[n];
+                    n++;
+                }
+                m->cmdline[n] = '\0';
+            }
+            if (m->end > reserved_end) reserved_end = m->end;
+        }
+    }
+    
+    // Size the bitmap to the highest available byte below 4 GB
+    uint64_t top = 0;
+    for (int i = 0; i < pmm_region_count; i++) {
+        uint64_t end = pmm_regions[i].base + pmm_regions[i].length;
+        if (pmm_regions[i].type == MULTIBOOT_MEMORY_AVAILABLE && end > top) top = end;
+    }
+    if (top > 0x100000000ull) top = 0x100000000ull;
+    uint32_t frames = top / PAGE_SIZE;
+    uint32_t bitmap_start = (reserved_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint32_t bitmap_bytes = ((frames + 31) / 32) * 4;
+    if (bitmap_start + bitmap_bytes > top) return;  // Not even room for the bitmap
+    
+    pmm_bitmap = (uint32_t*)bitmap_start;
+    pmm_frames = frames;
+    memset(pmm_bitmap, 0xFF, bitmap_bytes);
+    pmm_total = 0;
+    for (int i = 0; i < pmm_region_count; i++) {
+        if (pmm_regions[i].type == MULTIBOOT_MEMORY_AVAILABLE) {
+            pmm_mark_range(pmm_regions[i].base, pmm_regions[i].base + pmm_regions[i].length, 0);
+        }
+    }
+    pmm_mark_range(0, bitmap_start + bitmap_bytes, 1);
+    pmm_used = 0;
+    pmm_next = (bitmap_start + bitmap_bytes) / PAGE_SIZE;
+}
+
+// count contiguous frames; returns their address, or 0 when out of memory
+void* pmm_alloc(uint32_t count) {
+    if (count == 0 || count > pmm_total - pmm_used) return 0;
+    uint32_t run = 0;
+    uint32_t f = pmm_next;
+    for (uint32_t scanned = 0; scanned < pmm_frames + count; scanned++, f++) {
+        if (f >= pmm_frames) {
+            f = 0;
+            run = 0;
+        }
+        // Skip whole words of used frames when not inside a run
+        if (run == 0 && (f & 31) == 0 && pmm_bitmap[f >> 5] == 0xFFFFFFFF) {
+            f += 31;
+            scanned += 31;
+            continue;
+        }
+        if (pmm_test(f)) {
+            run = 0;
+            continue;
+        }
+        if (++run == count) {
+            uint32_t first = f + 1 - count;
+            for (uint32_t i = first; i <= f; i++) pmm_set(i, 1);
+            pmm_used += count;
+            pmm_next = f + 1;
+            return (void*)(first * PAGE_SIZE);
+        }
+    }
+    return 0;
+}
+
+void pmm_free(void* addr, uint32_t count) {
+    uint32_t first = (uint32_t)addr / PAGE_SIZE;
+    for (uint32_t f = first; f < first + count && f < pmm_frames; f++) {
+        if (pmm_test(f)) {
+            pmm_set(f, 0);
+            pmm_used--;
+        }
+    }
+}
+
+// Kernel heap. Requests up to KHEAP_MAX_SLAB bytes come from per-size-class
+// slab caches (powers of two from 16 bytes); each slab is one frame with
+// its header at the start, followed by equal objects on a free list.
+// Larger requests get their own run of frames behind the same header, so
+// kfree finds the header by rounding the pointer down to its page.
+#define KHEAP_MIN_SHIFT 4
+#define KHEAP_CLASSES 8                 // 16 .. 2048 bytes
+#define KHEAP_MAX_SLAB (1u << (KHEAP_MIN_SHIFT + KHEAP_CLASSES - 1))
+#define KHEAP_MAGIC 0x48454150          // "HEAP"
+
+typedef struct Slab {
+    uint32_t magic;
+    uint32_t object_size;               // 0 for a large allocation
+    uint32_t count;                     // Objects in use, or frames if large
+    void* free_list;
+    struct Slab* next;                  // Next slab in the cache with room
+    uint32_t reserved[3];               // Keep objects 16-byte aligned
+} Slab;
+
+typedef struct {
+    Slab* partial;                      // Slabs with at least one free object
+    uint32_t slabs;
+    uint32_t objects;
+} SlabCache;
+
+static SlabCache kheap_caches[KHEAP_CLASSES];
+static uint32_t kheap_large_frames = 0;
+static uint32_t kheap_bytes = 0;        // Allocated, rounded up to class or page
+
+static inline uint32_t kheap_class(uint32_t size) {
+    uint32_t c = 0;
+    while ((1u << (KHEAP_MIN_SHIFT + c)) < size) c++;
+    return c;
+}
+
+static inline uint32_t kheap_objects_per_slab(uint32_t object_size) {
+    return (PAGE_SIZE - sizeof(Slab)) / object_size;
+}
+
+void* kmalloc(uint32_t size) {
+    if (size == 0) size = 1;
+    if (size > KHEAP_MAX_SLAB) {
+        uint32_t frames = (size + sizeof(Slab) + PAGE_SIZE - 1) / PAGE_SIZE;
+        Slab* s = pmm_alloc(frames);
+        if (!s) return 0;
+        s->magic = KHEAP_MAGIC;
+        s->object_size = 0;
+        s->count = frames;
+        kheap_large_frames += frames;
+        kheap_bytes += frames * PAGE_SIZE - sizeof(Slab);
+        return s + 1;
+    }
+    
+    SlabCache* cache = &kheap_caches[kheap_class(size)];
+    uint32_t object_size = 1u << (KHEAP_MIN_SHIFT + kheap_class(size));
+    Slab* s = cache->partial;
+    if (!s) {
+        s = pmm_alloc(1);
+        if (!s) return 0;
+        s->magic = KHEAP_MAGIC;
+        s->object_size = object_size;
+        s->count = 0;
+        s->free_list = 0;
+        char* objects = (char*)(s + 1);
+        for (int i = kheap_objects_per_slab(object_size) - 1; i >= 0; i--) {
+            *(void**)(objects + i * object_size) = s->free_list;
+            s->free_list = objects + i * object_size;
+        }
+        s->next = 0;
+        cache->partial = s;
+        cache->slabs++;
+    }
+    void* p = s->free_list;
+    s->free_list = *(void**)p;
+    s->count++;
+    if (!s->free_list) cache->partial = s->next;    // Now full
+    cache->objects++;
+    kheap_bytes += object_size;
+    return p;
+}
+
+// Usable size of a kmalloc block
+uint32_t ksize(const void* p) {
+    const Slab* s = (const Slab*)((uint32_t)p & ~(PAGE_SIZE - 1));
+    return s->object_size ? s->object_size : s->count * PAGE_SIZE - sizeof(Slab);
+}
+
+void kfree(void* p) {
+    if (!p) return;
+    Slab* s = (Slab*)((uint32_t)p & ~(PAGE_SIZE - 1));
+    if (s->magic != KHEAP_MAGIC) return;
+    if (!s->object_size) {
+        kheap_large_frames -= s->count;
+        kheap_bytes -= s->count * PAGE_SIZE - sizeof(Slab);
+        s->magic = 0;
+        pmm_free(s, s->count);
+        return;
+    }
+    
+    SlabCache* cache = &kheap_caches[kheap_class(s->object_size)];
+    if (!s->free_list) {
+        s->next = cache->partial;       // Was full, has room again
+        cache->partial = s;
+    }
+    *(void**)p = s->free_list;
+    s->free_list = p;
+    s->count--;
+    cache->objects--;
+    kheap_bytes -= s->object_size;
+    
+    // Give empty slabs back, keeping one per cache to avoid thrashing
+    if (s->count == 0 && cache->slabs > 1) {
+        Slab** link = &cache->partial;
+        while (*link != s) link = &(*link)->next;
+        *link = s->next;
+        cache->slabs--;
+        s->magic = 0;
+        pmm_free(s, 1);
+    }
+}
+
+// Grow or shrink a block, moving it only when it no longer fits its size
+// class; returns 0 (leaving p untouched) when out of memory
+void* krealloc(void* p, uint32_t size) {
+    if (!p) return kmalloc(size);
+    uint32_t old = ksize(p);
+    if (size <= old && (old <= KHEAP_MAX_SLAB ? size > old / 2 : size + PAGE_SIZE > old)) return p;
+    void* q = kmalloc(size);
+    if (!q) return 0;
+    memcpy(q, p, size < old ? size : old);
+    kfree(p);
+    return q;
+}
+
 static uint8_t shift_pressed = 0;
 static uint8_t ctrl_pressed = 0;
 
@@ -324,6 +821,7 @@ char scancode_to_char(uint8_t scancode) {
 }
 
 char get_key() {
+    console_flush();
     while (!(inb(0x64) & 0x01)) {
         asm volatile("pause");
     }
@@ -332,821 +830,7118 @@ char get_key() {
     return scancode_to_char(scancode);
 }
 
-// File system functions
-void init_fs() {
-    memset(files, 0, sizeof(files));
-    memset(dirs, 0, sizeof(dirs));
-    
-    // Create root directory
-    dirs[0].used = 1;
-    strcpy(dirs[0].name, "/");
-    strcpy(dirs[0].path, "/");
-    
-    // Create /mnt directory
-    dirs[1].used = 1;
-    strcpy(dirs[1].name, "mnt");
-    strcpy(dirs[1].path, "/mnt");
-    
-    // Create mount points: /mnt/c, /mnt/d, /mnt/e, /mnt/f
-    const char* mounts[] = {"c", "d", "e", "f"};
-    for (int i = 0; i < 4; i++) {
-        dirs[2 + i].used = 1;
-        strcpy(dirs[2 + i].name, mounts[i]);
-        strcpy(dirs[2 + i].path, "/mnt/");
-        strcat(dirs[2 + i].path, mounts[i]);
+// ATA disk: the master drive on the primary IDE channel (QEMU's -hda),
+// driven by polled PIO with 28-bit LBAs. The drive's interrupt stays
+// disabled (nIEN) since the kernel has no IDT; a DMA path can replace
+// ata_transfer later without touching its callers.
+#define ATA_DATA 0x1F0
+#define ATA_SECTOR_COUNT 0x1F2
+#define ATA_LBA_LOW 0x1F3
+#define ATA_LBA_MID 0x1F4
+#define ATA_LBA_HIGH 0x1F5
+#define ATA_DRIVE 0x1F6
+#define ATA_STATUS 0x1F7
+#define ATA_COMMAND 0x1F7
+#define ATA_CONTROL 0x3F6               // Reads as the alternate status
+#define ATA_SR_BSY 0x80
+#define ATA_SR_DF 0x20
+#define ATA_SR_DRQ 0x08
+#define ATA_SR_ERR 0x01
+#define ATA_CMD_READ 0x20
+#define ATA_CMD_WRITE 0x30
+#define ATA_CMD_FLUSH 0xE7
+#define ATA_CMD_IDENTIFY 0xEC
+#define ATA_TIMEOUT 1000000             // Status polls before giving up
+
+static uint32_t ata_sectors = 0;        // 0 when there is no disk
+
+// Wait until the drive is not busy and, if drq is set, wants data;
+// -1 on an error or a timeout
+int ata_wait(int drq) {
+    for (uint32_t i = 0; i < ATA_TIMEOUT; i++) {
+        uint8_t status = inb(ATA_STATUS);
+        if (status & ATA_SR_BSY) continue;
+        if (status & (ATA_SR_ERR | ATA_SR_DF)) return -1;
+        if (!drq || (status & ATA_SR_DRQ)) return 0;
     }
+    return -1;
 }
 
-int find_file(const char* name, const char* path) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, name) == 0 && 
-            strcmp(files[i].path, path) == 0) {
-            return i;
-        }
+// Probe the drive with IDENTIFY; returns its size in sectors, 0 if there
+// is no ATA disk
+uint32_t ata_init() {
+    if (inb(ATA_STATUS) == 0xFF) return 0;      // Floating bus
+    outb(ATA_CONTROL, 0x02);
+    outb(ATA_DRIVE, 0xA0);
+    for (int i = 0; i < 4; i++) inb(ATA_CONTROL);   // 400 ns to settle
+    outb(ATA_SECTOR_COUNT, 0);
+    outb(ATA_LBA_LOW, 0);
+    outb(ATA_LBA_MID, 0);
+    outb(ATA_LBA_HIGH, 0);
+    outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+    if (inb(ATA_STATUS) == 0) return 0;
+    for (uint32_t i = 0; i < ATA_TIMEOUT && (inb(ATA_STATUS) & ATA_SR_BSY); i++) {
     }
-    return -1;
+    if (inb(ATA_LBA_MID) || inb(ATA_LBA_HIGH)) return 0;   // ATAPI or SATA
+    if (ata_wait(1) < 0) return 0;
+    uint16_t id[256];
+    uint16_t* p = id;
+    uint32_t words = 256;
+    asm volatile("rep insw" : "+D"(p), "+c"(words) : "d"(ATA_DATA) : "memory");
+    ata_sectors = id[60] | (uint32_t)id[61] << 16;
+    return ata_sectors;
 }
 
-int find_dir(const char* path) {
-    for (int i = 0; i < MAX_DIRS; i++) {
-        if (dirs[i].used && strcmp(dirs[i].path, path) == 0) {
-            return i;
+// Move count (1 to 256) sectors starting at lba; 0 on success, else -1
+int ata_transfer(uint32_t lba, uint32_t count, void* buf, int write) {
+    if (count == 0 || count > 256 || lba >= ata_sectors || count > ata_sectors - lba) return -1;
+    if (ata_wait(0) < 0) return -1;
+    outb(ATA_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
+    outb(ATA_SECTOR_COUNT, (uint8_t)count);     // 0 means 256
+    outb(ATA_LBA_LOW, (uint8_t)lba);
+    outb(ATA_LBA_MID, (uint8_t)(lba >> 8));
+    outb(ATA_LBA_HIGH, (uint8_t)(lba >> 16));
+    outb(ATA_COMMAND, write ? ATA_CMD_WRITE : ATA_CMD_READ);
+    uint16_t* p = buf;
+    for (uint32_t s = 0; s < count; s++) {
+        if (ata_wait(1) < 0) return -1;
+        uint32_t words = 256;
+        if (write) {
+            asm volatile("rep outsw" : "+S"(p), "+c"(words) : "d"(ATA_DATA) : "memory");
+        } else {
+            asm volatile("rep insw" : "+D"(p), "+c"(words) : "d"(ATA_DATA) : "memory");
         }
     }
-    return -1;
+    return 0;
 }
 
-void cmd_ls() {
-    print("Directory listing of ");
-    print(current_dir);
-    print(":\n");
-    
-    int found_items = 0;
-    
-    // List directories first
-    for (int i = 0; i < MAX_DIRS; i++) {
-        if (dirs[i].used) {
-            // Check if this directory is a direct child of current_dir
-            int len = strlen(current_dir);
-            const char* dir_path = dirs[i].path;
-            
-            // Skip if it's the current directory itself
-            if (strcmp(dir_path, current_dir) == 0) continue;
-            
-            // Check if it starts with current_dir
-            if (strncmp(dir_path, current_dir, len) == 0) {
-                const char* remainder = dir_path + len;
-                
-                // Handle root directory special case
-                if (strcmp(current_dir, "/") == 0) {
-                    remainder = dir_path + 1; // Skip the leading /
-                }
-                
-                // Check if this is a direct child (no more slashes in remainder)
-                if (remainder[0] != '\0') {
-                    int has_slash = 0;
-                    for (int j = (remainder[0] == '/' ? 1 : 0); remainder[j]; j++) {
-                        if (remainder[j] == '/') {
-                            has_slash = 1;
-                            break;
-                        }
-                    }
-                    
-                    if (!has_slash) {
-                        print("  [DIR]  ");
-                        print(dirs[i].name);
-                        print("/");
-                        print("\n");
-                        found_items = 1;
-                    }
-                }
-            }
-        }
+int ata_read(uint32_t lba, uint32_t count, void* buf) {
+    return ata_transfer(lba, count, buf, 0);
+}
+
+int ata_write(uint32_t lba, uint32_t count, const void* buf) {
+    return ata_transfer(lba, count, (void*)buf, 1);
+}
+
+// Write the drive's own cache out to the media
+int ata_flush() {
+    if (ata_wait(0) < 0) return -1;
+    outb(ATA_COMMAND, ATA_CMD_FLUSH);
+    return ata_wait(0);
+}
+
+// Buffer cache: every block the file system reads or writes goes through
+// here. Blocks are found by (device, block) in a hash table, kept on an
+// LRU list, and writes only mark them dirty. Dirty blocks go to disk in
+// one batch, sorted and merged into multi-block transfers, when sync asks,
+// when half the cache is dirty, or when a dirty block would be evicted.
+// Repeated small appends to a block therefore cost one disk write.
+// The number of blocks, bcache_blocks, is a power of two set by
+// tables_init from the memory we boot with.
+#define BCACHE_HASH (bcache_blocks * 2)
+#define BCACHE_RUN 64                   // Blocks per merged write
+#define DISK_ATA0 0
+
+typedef struct {
+    uint32_t device;
+    uint32_t block;
+    int32_t hash_next;
+    int32_t lru_prev, lru_next;         // lru_prev is towards the most recent
+    uint8_t valid;
+    uint8_t dirty;
+} Buffer;
+
+static uint32_t bcache_blocks;
+static Buffer* bcache;
+static uint8_t (*bcache_data)[AFS_BLOCK_SIZE];
+static int32_t* bcache_order;           // Scratch for bcache_flush
+static uint8_t bcache_run[BCACHE_RUN * AFS_BLOCK_SIZE] __attribute__((aligned(4)));
+static int32_t* bcache_buckets;         // BCACHE_HASH chains
+static int32_t bcache_lru_head = -1;    // Most recently used
+static int32_t bcache_lru_tail = -1;
+static uint32_t bcache_dirty = 0;
+static uint32_t bcache_hits = 0;
+static uint32_t bcache_misses = 0;
+static uint32_t bcache_writes = 0;      // Blocks written to disk
+static const char* fs_error = "";       // Why the last file operation failed
+
+static inline uint32_t bcache_hash(uint32_t device, uint32_t block) {
+    return (block * 2654435761u ^ device) & (BCACHE_HASH - 1);
+}
+
+void bcache_init() {
+    memset(bcache_buckets, 0xFF, BCACHE_HASH * sizeof(int32_t));
+    for (int i = 0; i < (int)bcache_blocks; i++) {
+        bcache[i].valid = 0;
+        bcache[i].dirty = 0;
+        bcache[i].hash_next = -1;
+        bcache[i].lru_prev = i - 1;
+        bcache[i].lru_next = i + 1 < (int)bcache_blocks ? i + 1 : -1;
     }
-    
-    // List files
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].path, current_dir) == 0) {
-            print("  [FILE] ");
-            print(files[i].name);
-            
-            // Show file extension for .algr and .algebra files
-            int name_len = strlen(files[i].name);
-            if (name_len > 5 && strcmp(files[i].name + name_len - 5, ".algr") == 0) {
-                print(" (source)");
-            } else if (name_len > 8 && strcmp(files[i].name + name_len - 8, ".algebra") == 0) {
-                print(" (executable)");
+    bcache_lru_head = 0;
+    bcache_lru_tail = bcache_blocks - 1;
+}
+
+void bcache_touch(int i) {
+    if (i == bcache_lru_head) return;
+    Buffer* b = &bcache[i];
+    bcache[b->lru_prev].lru_next = b->lru_next;
+    if (b->lru_next >= 0) bcache[b->lru_next].lru_prev = b->lru_prev;
+    else bcache_lru_tail = b->lru_prev;
+    b->lru_prev = -1;
+    b->lru_next = bcache_lru_head;
+    bcache[bcache_lru_head].lru_prev = i;
+    bcache_lru_head = i;
+}
+
+// Write every dirty block back, lowest block first, merging neighbours
+// into single transfers; returns the number written, or -1 on an error
+int bcache_flush() {
+    int32_t* order = bcache_order;
+    uint32_t n = 0;
+    if (bcache_dirty == 0) return 0;
+    for (int i = 0; i < (int)bcache_blocks; i++) {
+        if (!bcache[i].dirty) continue;
+        // Insertion sort by (device, block); there are few dirty blocks
+        uint32_t j = n++;
+        for (; j > 0; j--) {
+            Buffer* prev = &bcache[order[j - 1]];
+            if (prev->device < bcache[i].device ||
+                (prev->device == bcache[i].device && prev->block < bcache[i].block)) {
+                break;
             }
-            
-            print(" - ");
-            print_num(files[i].size);
-            print(" bytes\n");
-            found_items = 1;
+            order[j] = order[j - 1];
         }
+        order[j] = i;
     }
-    
-    if (!found_items) {
-        print("  (empty)\n");
+    int status = 0;
+    for (uint32_t start = 0; start < n;) {
+        Buffer* first = &bcache[order[start]];
+        uint32_t run = 1;
+        while (start + run < n && run < BCACHE_RUN && bcache[order[start + run]].device == first->device &&
+               bcache[order[start + run]].block == first->block + run) {
+            run++;
+        }
+        for (uint32_t k = 0; k < run; k++) {
+            memcpy(bcache_run + k * AFS_BLOCK_SIZE, bcache_data[order[start + k]], AFS_BLOCK_SIZE);
+        }
+        if (ata_write(first->block * AFS_SECTORS_PER_BLOCK, run * AFS_SECTORS_PER_BLOCK, bcache_run) < 0) {
+            status = -1;
+        } else {
+            for (uint32_t k = 0; k < run; k++) bcache[order[start + k]].dirty = 0;
+            bcache_dirty -= run;
+            bcache_writes += run;
+        }
+        start += run;
     }
+    if (ata_flush() < 0) status = -1;
+    if (status < 0) fs_error = "Disk I/O error";
+    return status < 0 ? -1 : (int)n;
 }
 
-void cmd_mkdir(const char* name) {
-    if (strlen(name) == 0) {
-        print("Usage: mkdir <dirname>\n");
-        return;
+// Buffer for (device, block), read from disk unless the caller is about to
+// overwrite all of it; -1 on a read error
+int bcache_get(uint32_t device, uint32_t block, int read) {
+    uint32_t h = bcache_hash(device, block);
+    for (int i = bcache_buckets[h]; i >= 0; i = bcache[i].hash_next) {
+        if (bcache[i].device == device && bcache[i].block == block) {
+            bcache_hits++;
+            bcache_touch(i);
+            return i;
+        }
     }
-    
-    char fullpath[MAX_PATH];
-    strcpy(fullpath, current_dir);
-    if (fullpath[strlen(fullpath) - 1] != '/') strcat(fullpath, "/");
-    strcat(fullpath, name);
-    
-    if (find_dir(fullpath) >= 0) {
-        print("Error: Directory already exists\n");
-        return;
+    bcache_misses++;
+    int i = bcache_lru_tail;
+    Buffer* b = &bcache[i];
+    if (b->dirty && bcache_flush() < 0) return -1;
+    if (b->valid) {
+        int32_t* link = &bcache_buckets[bcache_hash(b->device, b->block)];
+        while (*link != i) link = &bcache[*link].hash_next;
+        *link = b->hash_next;
+        b->valid = 0;
     }
-    
-    for (int i = 0; i < MAX_DIRS; i++) {
-        if (!dirs[i].used) {
-            dirs[i].used = 1;
-            strcpy(dirs[i].name, name);
-            strcpy(dirs[i].path, fullpath);
-            print("Directory created: ");
-            print(fullpath);
-            print("\n");
-            return;
-        }
+    if (read && ata_read(block * AFS_SECTORS_PER_BLOCK, AFS_SECTORS_PER_BLOCK, bcache_data[i]) < 0) {
+        fs_error = "Disk I/O error";
+        return -1;
     }
-    print("Error: Maximum directories reached\n");
+    b->device = device;
+    b->block = block;
+    b->valid = 1;
+    b->hash_next = bcache_buckets[h];
+    bcache_buckets[h] = i;
+    bcache_touch(i);
+    return i;
 }
 
-void cmd_cd(const char* path) {
-    if (strlen(path) == 0 || strcmp(path, "/") == 0) {
-        strcpy(current_dir, "/");
-        return;
-    }
-    
-    if (strcmp(path, "..") == 0) {
-        // Go up one directory
-        if (strcmp(current_dir, "/") == 0) return; // Already at root
-        
-        // Find last slash
-        int len = strlen(current_dir);
-        if (current_dir[len - 1] == '/') len--;
-        
-        while (len > 0 && current_dir[len - 1] != '/') len--;
-        
-        if (len == 0) {
-            strcpy(current_dir, "/");
-        } else {
-            current_dir[len] = '\0';
-            if (current_dir[0] == '\0') strcpy(current_dir, "/");
-        }
-        return;
+int disk_read_block(uint32_t block, void* buf) {
+    int i = bcache_get(DISK_ATA0, block, 1);
+    if (i < 0) return -1;
+    memcpy(buf, bcache_data[i], AFS_BLOCK_SIZE);
+    return 0;
+}
+
+int disk_write_block(uint32_t block, const void* buf) {
+    int i = bcache_get(DISK_ATA0, block, 0);
+    if (i < 0) return -1;
+    memcpy(bcache_data[i], buf, AFS_BLOCK_SIZE);
+    if (!bcache[i].dirty) {
+        bcache[i].dirty = 1;
+        bcache_dirty++;
     }
-    
-    char newpath[MAX_PATH];
-    if (path[0] == '/') {
-        // Absolute path
-        strcpy(newpath, path);
-    } else {
-        // Relative path
-        strcpy(newpath, current_dir);
-        if (newpath[strlen(newpath) - 1] != '/') strcat(newpath, "/");
-        strcat(newpath, path);
+    if (bcache_dirty >= bcache_blocks / 2) return bcache_flush() < 0 ? -1 : 0;
+    return 0;
+}
+
+// AFS, the on-disk file system (layout in afs.h), mounted at /mnt/c. Both
+// bitmaps and the superblock live in memory while mounted; allocations
+// only mark them dirty, and afs_commit hands the changed blocks to the
+// buffer cache once per operation. Inodes and directory entries are updated in place.
+static AfsSuper afs_super;
+static uint8_t afs_mounted = 0;
+static int afs_mount_dir = -1;          // Directory the disk is mounted on
+static uint8_t* afs_inode_map = 0;
+static uint8_t* afs_block_map = 0;
+static uint32_t afs_next_block = 0;     // Next-fit search start
+static uint32_t afs_dirty_first = 0;    // Block bitmap blocks to write back
+static uint32_t afs_dirty_end = 0;
+static uint8_t afs_meta_dirty = 0;      // Superblock and inode bitmap
+
+// Write back the metadata changed since the last commit
+int afs_commit() {
+    int status = 0;
+    for (uint32_t i = afs_dirty_first; i < afs_dirty_end; i++) {
+        if (disk_write_block(afs_super.block_bitmap + i, afs_block_map + i * AFS_BLOCK_SIZE) < 0) status = -1;
     }
-    
-    // Normalize path (remove trailing slash except for root)
-    int len = strlen(newpath);
-    if (len > 1 && newpath[len - 1] == '/') {
-        newpath[len - 1] = '\0';
+    afs_dirty_first = afs_dirty_end = 0;
+    if (afs_meta_dirty) {
+        uint32_t buf[AFS_BLOCK_SIZE / 4];
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, &afs_super, sizeof(afs_super));
+        if (disk_write_block(AFS_SUPER_BLOCK, buf) < 0) status = -1;
+        if (disk_write_block(afs_super.inode_bitmap, afs_inode_map) < 0) status = -1;
+        afs_meta_dirty = 0;
     }
-    
-    if (find_dir(newpath) >= 0) {
-        strcpy(current_dir, newpath);
+    return status;
+}
+
+void afs_mark_block(uint32_t block, int used) {
+    if (used) {
+        afs_block_map[block >> 3] |= 1 << (block & 7);
+        afs_super.free_blocks--;
     } else {
-        print("Error: Directory not found: ");
-        print(newpath);
-        print("\n");
+        afs_block_map[block >> 3] &= ~(1 << (block & 7));
+        afs_super.free_blocks++;
+    }
+    uint32_t map_block = block / (AFS_BLOCK_SIZE * 8);
+    if (afs_dirty_first == afs_dirty_end) {
+        afs_dirty_first = map_block;
+        afs_dirty_end = map_block + 1;
+    } else if (map_block < afs_dirty_first) {
+        afs_dirty_first = map_block;
+    } else if (map_block >= afs_dirty_end) {
+        afs_dirty_end = map_block + 1;
     }
+    afs_meta_dirty = 1;
 }
 
-void cmd_rm(const char* name) {
-    if (strlen(name) == 0) {
-        print("Usage: rm <filename>\n");
-        return;
+// A free block, zero-filled if zero is set; 0 when the disk is full
+uint32_t afs_alloc_block(int zero) {
+    uint32_t bytes = afs_super.block_bitmap_blocks * AFS_BLOCK_SIZE;
+    if (afs_super.free_blocks == 0) {
+        fs_error = "Disk full";
+        return 0;
     }
-    
-    int idx = find_file(name, current_dir);
-    if (idx >= 0) {
-        files[idx].used = 0;
-        print("File removed: ");
-        print(name);
-        print("\n");
-    } else {
-        print("Error: File not found\n");
+    for (uint32_t n = 0; n < bytes; n++) {
+        uint32_t i = (afs_next_block >> 3) + n;
+        if (i >= bytes) i -= bytes;
+        if (afs_block_map[i] == 0xFF) continue;
+        uint32_t block = i << 3;
+        while (afs_block_map[block >> 3] & (1 << (block & 7))) block++;
+        if (zero) {
+            uint32_t buf[AFS_BLOCK_SIZE / 4];
+            memset(buf, 0, sizeof(buf));
+            if (disk_write_block(block, buf) < 0) return 0;
+        }
+        afs_mark_block(block, 1);
+        afs_next_block = block + 1;
+        return block;
     }
+    fs_error = "Disk full";
+    return 0;
 }
 
-// Math expression evaluator with proper operator precedence
-int is_digit(char c) { return c >= '0' && c <= '9'; }
-int is_space(char c) { return c == ' ' || c == '\t'; }
+int afs_inode_io(uint32_t ino, AfsInode* inode, int write) {
+    uint32_t buf[AFS_BLOCK_SIZE / 4];
+    uint32_t block = afs_super.inode_table + ino / AFS_INODES_PER_BLOCK;
+    if (disk_read_block(block, buf) < 0) return -1;
+    AfsInode* slot = (AfsInode*)buf + ino % AFS_INODES_PER_BLOCK;
+    if (!write) {
+        memcpy(inode, slot, sizeof(AfsInode));
+        return 0;
+    }
+    memcpy(slot, inode, sizeof(AfsInode));
+    return disk_write_block(block, buf);
+}
 
-// Forward declarations
-int eval_expr(const char* expr);
-int parse_term(const char** expr);
-int parse_factor(const char** expr);
+// Entry i of pointer block ptr_block, allocating it if alloc is set and
+// it is a hole; 0 for a hole or on failure
+uint32_t afs_ptr(uint32_t ptr_block, uint32_t i, int alloc, int zero) {
+    uint32_t ptrs[AFS_PTRS_PER_BLOCK];
+    if (disk_read_block(ptr_block, ptrs) < 0) return 0;
+    if (ptrs[i] || !alloc) return ptrs[i];
+    ptrs[i] = afs_alloc_block(zero);
+    if (ptrs[i] && disk_write_block(ptr_block, ptrs) < 0) return 0;
+    return ptrs[i];
+}
 
-int parse_number(const char** expr) {
-    while (is_space(**expr)) (*expr)++;
-    int num = 0, sign = 1;
-    if (**expr == '-') { sign = -1; (*expr)++; }
-    else if (**expr == '+') { (*expr)++; }
-    while (is_digit(**expr)) {
-        num = num * 10 + (**expr - '0');
-        (*expr)++;
-    }
-    return num * sign;
+uint32_t afs_root_ptr(uint32_t* slot, int alloc, int zero) {
+    if (!*slot && alloc) *slot = afs_alloc_block(zero);
+    return *slot;
 }
 
-// Parse factor (number or parenthesized expression)
-int parse_factor(const char** expr) {
-    while (is_space(**expr)) (*expr)++;
-    
-    if (**expr == '(') {
-        (*expr)++;
-        const char* temp = *expr;
-        int result = eval_expr(temp);
-        *expr = temp;
-        while (**expr && **expr != ')') (*expr)++;
-        if (**expr == ')') (*expr)++;
-        return result;
+// Disk block holding block n of a file; 0 for a hole. With alloc set,
+// missing data and pointer blocks are allocated, which may change inode.
+uint32_t afs_bmap(AfsInode* inode, uint32_t n, int alloc) {
+    if (n < AFS_DIRECT) return afs_root_ptr(&inode->direct[n], alloc, 0);
+    n -= AFS_DIRECT;
+    if (n < AFS_PTRS_PER_BLOCK) {
+        uint32_t ind = afs_root_ptr(&inode->indirect, alloc, 1);
+        return ind ? afs_ptr(ind, n, alloc, 0) : 0;
     }
-    
-    return parse_number(expr);
+    n -= AFS_PTRS_PER_BLOCK;
+    if (n >= AFS_PTRS_PER_BLOCK * AFS_PTRS_PER_BLOCK) {
+        fs_error = "File too large";
+        return 0;
+    }
+    uint32_t dbl = afs_root_ptr(&inode->double_indirect, alloc, 1);
+    uint32_t ind = dbl ? afs_ptr(dbl, n / AFS_PTRS_PER_BLOCK, alloc, 1) : 0;
+    return ind ? afs_ptr(ind, n % AFS_PTRS_PER_BLOCK, alloc, 0) : 0;
 }
 
-// Parse term (handles * and /)
-int parse_term(const char** expr) {
-    int result = parse_factor(expr);
-    
-    while (1) {
-        while (is_space(**expr)) (*expr)++;
-        char op = **expr;
-        
-        if (op != '*' && op != '/') break;
-        
-        (*expr)++;
-        int right = parse_factor(expr);
-        
-        if (op == '*') {
-            result *= right;
-        } else if (op == '/') {
-            if (right != 0) result /= right;
+// Free block and, for pointer blocks (depth > 0), everything below it
+void afs_free_tree(uint32_t block, int depth) {
+    if (block < afs_super.data_start || block >= afs_super.block_count) return;
+    if (depth > 0) {
+        uint32_t ptrs[AFS_PTRS_PER_BLOCK];
+        if (disk_read_block(block, ptrs) == 0) {
+            for (uint32_t i = 0; i < AFS_PTRS_PER_BLOCK; i++) afs_free_tree(ptrs[i], depth - 1);
         }
     }
-    
-    return result;
+    afs_mark_block(block, 0);
 }
 
-// Parse expression (handles + and -)
-int eval_expr(const char* expr) {
-    int result = parse_term(&expr);
-    
-    while (*expr) {
-        while (is_space(*expr)) expr++;
-        if (!*expr) break;
-        
-        char op = *expr;
-        if (op != '+' && op != '-') break;
-        
-        expr++;
-        int right = parse_term(&expr);
-        
-        if (op == '+') {
-            result += right;
-        } else if (op == '-') {
-            result -= right;
+void afs_free_data(AfsInode* inode) {
+    for (int i = 0; i < AFS_DIRECT; i++) afs_free_tree(inode->direct[i], 0);
+    afs_free_tree(inode->indirect, 1);
+    afs_free_tree(inode->double_indirect, 2);
+    memset(inode->direct, 0, sizeof(inode->direct));
+    inode->indirect = 0;
+    inode->double_indirect = 0;
+    inode->size = 0;
+}
+
+// Copy up to len bytes from offset; returns the number copied
+uint32_t afs_read(uint32_t ino, uint32_t offset, char* dst, uint32_t len) {
+    AfsInode inode;
+    if (afs_inode_io(ino, &inode, 0) < 0 || offset >= inode.size) return 0;
+    if (len > inode.size - offset) len = inode.size - offset;
+    uint32_t buf[AFS_BLOCK_SIZE / 4];
+    for (uint32_t done = 0; done < len;) {
+        uint32_t pos = offset + done;
+        uint32_t from = pos % AFS_BLOCK_SIZE;
+        uint32_t chunk = AFS_BLOCK_SIZE - from;
+        if (chunk > len - done) chunk = len - done;
+        uint32_t block = afs_bmap(&inode, pos / AFS_BLOCK_SIZE, 0);
+        if (!block) {
+            memset(buf, 0, sizeof(buf));
+        } else if (disk_read_block(block, buf) < 0) {
+            return done;
         }
+        memcpy(dst + done, (char*)buf + from, chunk);
+        done += chunk;
     }
-    
-    return result;
+    return len;
 }
 
-void solve_equation(const char* eq) {
-    const char* p = eq;
-    while (is_space(*p)) p++;
-    
-    if (*p != 'x') {
-        print("Error: Equation must start with 'x'\n");
-        return;
-    }
-    p++;
-    while (is_space(*p)) p++;
-    
-    char op = *p++;
-    int a = parse_number(&p);
-    
-    while (is_space(*p)) p++;
-    if (*p != '=') {
-        print("Error: Missing '=' sign\n");
-        return;
-    }
-    p++;
-    
-    int b = parse_number(&p);
-    int x = 0;
-    
-    switch (op) {
-        case '+': x = b - a; break;
-        case '-': x = b + a; break;
-        case '*': x = a ? b / a : 0; break;
-        case '/': x = b * a; break;
-        default: print("Error: Invalid operator\n"); return;
+// Append len bytes; *size gets the new file size, which on failure
+// includes whatever part was written
+int afs_append(uint32_t ino, const char* src, uint32_t len, uint32_t* size) {
+    AfsInode inode;
+    if (afs_inode_io(ino, &inode, 0) < 0) return -1;
+    int status = 0;
+    uint32_t buf[AFS_BLOCK_SIZE / 4];
+    while (len > 0) {
+        uint32_t from = inode.size % AFS_BLOCK_SIZE;
+        uint32_t chunk = AFS_BLOCK_SIZE - from;
+        if (chunk > len) chunk = len;
+        uint32_t block = afs_bmap(&inode, inode.size / AFS_BLOCK_SIZE, 1);
+        if (!block) {
+            status = -1;
+            break;
+        }
+        if (from > 0) {
+            if (disk_read_block(block, buf) < 0) {
+                status = -1;
+                break;
+            }
+        } else if (chunk < AFS_BLOCK_SIZE) {
+            memset(buf, 0, sizeof(buf));
+        }
+        memcpy((char*)buf + from, src, chunk);
+        if (disk_write_block(block, buf) < 0) {
+            status = -1;
+            break;
+        }
+        inode.size += chunk;
+        src += chunk;
+        len -= chunk;
     }
-    
-    print("x = ");
-    print_num(x);
-    print("\n");
+    *size = inode.size;
+    if (afs_inode_io(ino, &inode, 1) < 0) status = -1;
+    if (afs_commit() < 0) status = -1;
+    return status;
 }
 
-// Process escape sequences in strings
-void process_escape_sequences(char* str) {
-    int read = 0, write = 0;
-    while (str[read]) {
-        if (str[read] == '\\' && str[read + 1]) {
-            if (str[read + 1] == 'n') {
-                str[write++] = '\n';
-                read += 2;
-            } else if (str[read + 1] == 't') {
-                str[write++] = '\t';
-                read += 2;
-            } else if (str[read + 1] == '\\') {
-                str[write++] = '\\';
-                read += 2;
-            } else if (str[read + 1] == '"') {
-                str[write++] = '"';
-                read += 2;
-            } else {
-                str[write++] = str[read++];
+int afs_truncate(uint32_t ino) {
+    AfsInode inode;
+    if (afs_inode_io(ino, &inode, 0) < 0) return -1;
+    afs_free_data(&inode);
+    int status = afs_inode_io(ino, &inode, 1);
+    if (afs_commit() < 0) status = -1;
+    return status;
+}
+
+// Find the entry for ino in directory dir (or a free one if ino is 0);
+// returns the disk block holding it and its index, or 0
+uint32_t afs_dir_find(uint32_t dir, uint32_t ino, AfsDirent* entries, uint32_t* index) {
+    AfsInode inode;
+    if (afs_inode_io(dir, &inode, 0) < 0) return 0;
+    for (uint32_t pos = 0; pos < inode.size; pos += AFS_BLOCK_SIZE) {
+        uint32_t block = afs_bmap(&inode, pos / AFS_BLOCK_SIZE, 0);
+        if (!block || disk_read_block(block, entries) < 0) continue;
+        uint32_t count = (inode.size - pos) / sizeof(AfsDirent);
+        if (count > AFS_DIRENTS_PER_BLOCK) count = AFS_DIRENTS_PER_BLOCK;
+        for (uint32_t i = 0; i < count; i++) {
+            if (entries[i].inode == ino) {
+                *index = i;
+                return block;
             }
-        } else {
-            str[write++] = str[read++];
         }
     }
-    str[write] = '\0';
+    return 0;
 }
 
-// Parse and execute print statements
-void execute_print_statement(const char* line) {
-    // Format: print("text");
-    const char* start = line;
-    while (*start && *start != '(') start++;
-    if (!*start) return;
-    
-    start++;  // Skip '('
-    while (*start && *start == ' ') start++;
-    
-    if (*start != '"') return;
-    start++;  // Skip opening quote
-    
-    char buffer[512];
-    int i = 0;
-    while (*start && *start != '"' && i < 510) {
-        buffer[i++] = *start++;
+// Enter ino into directory dir as name, reusing a free slot if there is one
+int afs_dir_add(uint32_t dir, uint32_t ino, int type, const char* name) {
+    AfsDirent entries[AFS_DIRENTS_PER_BLOCK];
+    AfsDirent entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.inode = ino;
+    entry.type = type;
+    strcpy(entry.name, name);
+    uint32_t index;
+    uint32_t block = afs_dir_find(dir, 0, entries, &index);
+    if (block) {
+        entries[index] = entry;
+        return disk_write_block(block, entries);
     }
-    buffer[i] = '\0';
-    
-    process_escape_sequences(buffer);
-    print(buffer);
+    uint32_t size;
+    return afs_append(dir, (const char*)&entry, sizeof(entry), &size);
 }
 
-void cmd_algebra(const char* expr) {
-    if (strlen(expr) == 0) {
-        print("Usage: algebra <expression> or algebra x + 6 = 3\n");
-        return;
+// Create an empty file or directory called name in directory dir;
+// returns its inode, or 0 on failure
+uint32_t afs_create(uint32_t dir, const char* name, int type) {
+    uint32_t ino = 0;
+    if (afs_super.free_inodes > 0) {
+        for (uint32_t i = 0; i < afs_super.inode_count / 8; i++) {
+            if (afs_inode_map[i] == 0xFF) continue;
+            ino = i << 3;
+            while (afs_inode_map[ino >> 3] & (1 << (ino & 7))) ino++;
+            break;
+        }
     }
-    
-    int has_x = 0, has_eq = 0;
-    for (int i = 0; expr[i]; i++) {
-        if (expr[i] == 'x') has_x = 1;
-        if (expr[i] == '=') has_eq = 1;
+    if (!ino) {
+        fs_error = "No free inodes on disk";
+        return 0;
     }
-    
-    if (has_x && has_eq) {
-        solve_equation(expr);
-    } else {
-        int result = eval_expr(expr);
-        print("Result: ");
-        print_num(result);
-        print("\n");
+    AfsInode inode;
+    memset(&inode, 0, sizeof(inode));
+    inode.type = type;
+    inode.parent = dir;
+    if (afs_inode_io(ino, &inode, 1) < 0) return 0;
+    afs_inode_map[ino >> 3] |= 1 << (ino & 7);
+    afs_super.free_inodes--;
+    afs_meta_dirty = 1;
+    if (afs_dir_add(dir, ino, type, name) < 0) {
+        // Leave no typed inode behind that no directory entry names
+        inode.type = AFS_TYPE_FREE;
+        afs_inode_io(ino, &inode, 1);
+        afs_inode_map[ino >> 3] &= ~(1 << (ino & 7));
+        afs_super.free_inodes++;
+        ino = 0;
     }
+    afs_commit();
+    return ino;
 }
 
-void cmd_algebra_writeline(const char* args) {
-    char filename[MAX_FILENAME];
-    const char* expr = args;
-    int i = 0;
-    
-    while (*expr && !is_space(*expr) && i < MAX_FILENAME - 1) {
-        filename[i++] = *expr++;
-    }
-    filename[i] = '\0';
-    
-    while (is_space(*expr)) expr++;
-    
-    if (strlen(filename) == 0 || strlen(expr) == 0) {
-        print("Usage: algebra-writeline <filename> <expression>\n");
-        return;
-    }
-    
-    char result_str[32];
-    int result;
-    int has_x = 0, has_eq = 0;
-    for (int j = 0; expr[j]; j++) {
-        if (expr[j] == 'x') has_x = 1;
-        if (expr[j] == '=') has_eq = 1;
-    }
-    
-    if (has_x && has_eq) {
-        print("Note: Equation solving to file not fully implemented\n");
-        return;
-    } else {
-        result = eval_expr(expr);
-    }
-    
-    char* p = result_str;
-    if (result < 0) { *p++ = '-'; result = -result; }
-    if (result == 0) { *p++ = '0'; }
-    else {
-        char tmp[16];
-        int j = 0;
-        while (result > 0) {
-            tmp[j++] = '0' + (result % 10);
-            result /= 10;
-        }
-        while (j > 0) *p++ = tmp[--j];
-    }
-    *p++ = '\n';
-    *p = '\0';
-    
-    int idx = find_file(filename, current_dir);
-    if (idx < 0) {
-        for (int j = 0; j < MAX_FILES; j++) {
-            if (!files[j].used) {
-                idx = j;
-                files[j].used = 1;
-                strcpy(files[j].name, filename);
-                strcpy(files[j].path, current_dir);
-                files[j].size = 0;
-                break;
-            }
+// Move ino from directory from to directory to, calling it name there
+int afs_move(uint32_t from, uint32_t ino, uint32_t to, const char* name, int type) {
+    AfsDirent entries[AFS_DIRENTS_PER_BLOCK];
+    uint32_t index;
+    if (from != to && afs_dir_add(to, ino, type, name) < 0) return -1;
+    uint32_t block = afs_dir_find(from, ino, entries, &index);
+    if (block) {
+        if (from == to) {
+            memset(entries[index].name, 0, AFS_NAME_MAX);
+            strcpy(entries[index].name, name);
+        } else {
+            memset(&entries[index], 0, sizeof(AfsDirent));
         }
+        if (disk_write_block(block, entries) < 0) return -1;
     }
-    
-    if (idx < 0) {
-        print("Error: Cannot create file\n");
-        return;
-    }
-    
-    int len = strlen(result_str);
-    if (files[idx].size + len < MAX_FILESIZE) {
-        memcpy(files[idx].data + files[idx].size, result_str, len);
-        files[idx].size += len;
-        files[idx].data[files[idx].size] = '\0';
-        print("Result written to ");
-        print(filename);
-        print("\n");
-    } else {
-        print("Error: File size limit exceeded\n");
-    }
+    AfsInode inode;
+    if (afs_inode_io(ino, &inode, 0) < 0) return -1;
+    inode.parent = to;
+    int status = afs_inode_io(ino, &inode, 1);
+    if (afs_commit() < 0) status = -1;
+    return status;
 }
 
-void cmd_cat(const char* filename) {
-    if (strlen(filename) == 0) {
-        print("Usage: cat <filename>\n");
-        return;
-    }
-    
-    int idx = find_file(filename, current_dir);
-    if (idx >= 0) {
-        for (uint32_t i = 0; i < files[idx].size; i++) {
-            putchar(files[idx].data[i]);
-        }
-        if (files[idx].size > 0 && files[idx].data[files[idx].size - 1] != '\n') {
-            putchar('\n');
-        }
-    } else {
-        print("Error: File not found: ");
-        print(filename);
-        print("\n");
+// Remove ino's entry from directory dir and free the inode and its data
+int afs_unlink(uint32_t dir, uint32_t ino) {
+    AfsDirent entries[AFS_DIRENTS_PER_BLOCK];
+    uint32_t index;
+    uint32_t block = afs_dir_find(dir, ino, entries, &index);
+    if (block) {
+        memset(&entries[index], 0, sizeof(AfsDirent));
+        if (disk_write_block(block, entries) < 0) return -1;
     }
+    AfsInode inode;
+    if (afs_inode_io(ino, &inode, 0) < 0) return -1;
+    afs_free_data(&inode);
+    inode.type = AFS_TYPE_FREE;
+    int status = afs_inode_io(ino, &inode, 1);
+    afs_inode_map[ino >> 3] &= ~(1 << (ino & 7));
+    afs_super.free_inodes++;
+    afs_meta_dirty = 1;
+    if (afs_commit() < 0) status = -1;
+    return status;
 }
 
-// Atom editor state
+// Hash index: files and directories are chained by (parent directory,
+// name) through their hash_next fields (-1 ends a chain), which is the
+// cache path resolution walks one component at a time. Unused slots form
+// free lists through the same field, so lookup, create and remove are
+// O(1) on average however large the tables get.
+#define FILE_HASH_SIZE (max_files * 2)
+#define DIR_HASH_SIZE (MAX_DIRS * 2)
+static int32_t* file_buckets;           // FILE_HASH_SIZE, see tables_init
+static int32_t dir_buckets[DIR_HASH_SIZE];
+static int32_t file_free_list = -1;
+static int32_t dir_free_list = -1;
+static int current_dir_id = 0;          // Directory current_dir names
+
+// Running totals kept by every file system mutation, so the stats
+// commands take a snapshot instead of scanning the tables
 typedef struct {
-    char filename[MAX_FILENAME];
-    char buffer[MAX_FILESIZE];
-    int buffer_size;
-    int cursor_pos;
-    int view_offset;
-    int modified;
-    char clipboard[MAX_FILESIZE];
-    int clipboard_size;
-    int select_start;
-    int select_end;
-} AtomEditor;
+    uint32_t files;
+    uint32_t dirs;
+    uint32_t bytes;                     // Sum of file sizes
+    uint32_t extents;
+} FsStats;
 
-static AtomEditor atom_state;
+static FsStats fs_stats;
 
-void atom_draw_screen() {
-    clear_screen();
-    
-    // Draw title bar
-    print("  Atom Editor - ");
-    print(atom_state.filename);
-    if (atom_state.modified) print(" [Modified]");
-    print("\n");
-    
-    // Draw separator
-    for (int i = 0; i < VGA_WIDTH; i++) putchar('-');
-    putchar('\n');
-    
-    // Draw file content with cursor
-    int line_start = 0;
-    int current_line = 0;
-    int lines_shown = 0;
-    int max_lines = VGA_HEIGHT - 5; // Reserve space for status
-    int cursor_line = 0;
-    int cursor_col = 0;
-    int cursor_screen_x = 0;
-    int cursor_screen_y = 0;
-    
-    // Calculate which line the cursor is on
-    for (int i = 0; i < atom_state.cursor_pos && i < atom_state.buffer_size; i++) {
-        if (atom_state.buffer[i] == '\n') {
-            cursor_line++;
-            cursor_col = 0;
-        } else {
-            cursor_col++;
-        }
-    }
-    
-    // Draw lines
-    for (int i = 0; i <= atom_state.buffer_size && lines_shown < max_lines; i++) {
-        if (i == atom_state.buffer_size || atom_state.buffer[i] == '\n') {
-            if (current_line >= atom_state.view_offset) {
-                cursor_screen_y = lines_shown + 2;
-                // Print line and track cursor position
-                for (int j = line_start; j < i; j++) {
-                    if (current_line == cursor_line && j - line_start == cursor_col) {
-                        // Save cursor position before printing character
-                        cursor_screen_x = cursor_x;
-                    }
-                    putchar(atom_state.buffer[j]);
-                }
-                // If cursor is at end of line
-                if (current_line == cursor_line && i - line_start == cursor_col) {
-                    cursor_screen_x = cursor_x;
-                }
-                putchar('\n');
-                lines_shown++;
-            }
-            line_start = i + 1;
-            current_line++;
-        }
+// FNV-1a of the parent id and the first len bytes of name
+uint32_t fs_hash(int parent, const char* name, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 4; i++) {
+        hash ^= (uint8_t)(parent >> (i * 8));
+        hash *= 16777619u;
     }
-    
-    // Draw cursor bar after text is drawn
-    if (cursor_screen_x > 0 && cursor_screen_y > 0) {
-        vga[cursor_screen_y * VGA_WIDTH + cursor_screen_x] = (0x09 << 8) | '|';  // Blue cursor bar
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
     }
-    
-    // Move cursor to position on screen (update for visual feedback)
-    cursor_x = cursor_screen_x + 1;
-    cursor_y = cursor_screen_y;
-    
-    // Move to bottom for status
-    cursor_y = VGA_HEIGHT - 3;
-    cursor_x = 0;
-    for (int i = 0; i < VGA_WIDTH; i++) putchar('-');
-    
-    // Status bar
-    print("\n^O Save  ^X Exit  ^K Cut  ^U Paste  ^F Find");
-    print("  Pos: ");
-    print_num(atom_state.cursor_pos);
-    print("/");
-    print_num(atom_state.buffer_size);
-    print("\n");
+    return hash;
 }
 
-void atom_cut() {
-    // Cut from cursor position to end of line
-    int line_end = atom_state.cursor_pos;
-    while (line_end < atom_state.buffer_size && 
-           atom_state.buffer[line_end] != '\n') {
-        line_end++;
-    }
-    
-    int cut_length = line_end - atom_state.cursor_pos;
-    if (cut_length > 0) {
-        memcpy(atom_state.clipboard, 
-               &atom_state.buffer[atom_state.cursor_pos], 
-               cut_length);
-        atom_state.clipboard_size = cut_length;
-        
-        // Remove from buffer
-        for (int i = atom_state.cursor_pos; i < atom_state.buffer_size - cut_length; i++) {
-            atom_state.buffer[i] = atom_state.buffer[i + cut_length];
+static inline int fs_name_equal(const char* entry, const char* name, int len) {
+    return strncmp(entry, name, len) == 0 && entry[len] == '\0';
+}
+
+void file_index_insert(int idx) {
+    uint32_t b = fs_hash(files[idx].dir, files[idx].name, strlen(files[idx].name)) & (FILE_HASH_SIZE - 1);
+    files[idx].hash_next = file_buckets[b];
+    file_buckets[b] = idx;
+}
+
+void file_index_remove(int idx) {
+    uint32_t b = fs_hash(files[idx].dir, files[idx].name, strlen(files[idx].name)) & (FILE_HASH_SIZE - 1);
+    int32_t* link = &file_buckets[b];
+    while (*link != idx) link = &files[*link].hash_next;
+    *link = files[idx].hash_next;
+}
+
+void dir_index_insert(int idx) {
+    uint32_t b = fs_hash(dirs[idx].parent, dirs[idx].name, strlen(dirs[idx].name)) & (DIR_HASH_SIZE - 1);
+    dirs[idx].hash_next = dir_buckets[b];
+    dir_buckets[b] = idx;
+}
+
+void dir_index_remove(int idx) {
+    uint32_t b = fs_hash(dirs[idx].parent, dirs[idx].name, strlen(dirs[idx].name)) & (DIR_HASH_SIZE - 1);
+    int32_t* link = &dir_buckets[b];
+    while (*link != idx) link = &dirs[*link].hash_next;
+    *link = dirs[idx].hash_next;
+}
+
+int find_file(const char* name, int dir) {
+    int len = strlen(name);
+    int i = file_buckets[fs_hash(dir, name, len) & (FILE_HASH_SIZE - 1)];
+    for (; i >= 0; i = files[i].hash_next) {
+        if (files[i].dir == dir && fs_name_equal(files[i].name, name, len)) {
+            return i;
         }
-        atom_state.buffer_size -= cut_length;
-        atom_state.modified = 1;
     }
+    return -1;
 }
 
-void atom_paste() {
-    // Paste from clipboard
-    if (atom_state.clipboard_size > 0 && 
-        atom_state.buffer_size + atom_state.clipboard_size < MAX_FILESIZE) {
-        
-        // Shift content to make space
-        for (int i = atom_state.buffer_size - 1; i >= atom_state.cursor_pos; i--) {
-            atom_state.buffer[i + atom_state.clipboard_size] = atom_state.buffer[i];
+int dir_lookup(int parent, const char* name, int len) {
+    int i = dir_buckets[fs_hash(parent, name, len) & (DIR_HASH_SIZE - 1)];
+    for (; i >= 0; i = dirs[i].hash_next) {
+        if (dirs[i].parent == parent && fs_name_equal(dirs[i].name, name, len)) {
+            return i;
         }
-        
-        // Insert clipboard
-        memcpy(&atom_state.buffer[atom_state.cursor_pos],
-               atom_state.clipboard,
-               atom_state.clipboard_size);
-        
-        atom_state.buffer_size += atom_state.clipboard_size;
-        atom_state.cursor_pos += atom_state.clipboard_size;
-        atom_state.modified = 1;
     }
+    return -1;
 }
 
-void atom_find() {
-    // Simple find - move cursor to next occurrence
-    print("\nFind: ");
-    char search[256];
-    int search_len = 0;
-    
-    // Read search string
-    while (1) {
-        char c = get_key();
-        if (c == '\n') break;
-        if (c == '\b' && search_len > 0) search_len--;
-        else if (c >= 32 && c <= 126 && search_len < 255) {
-            search[search_len++] = c;
-            putchar(c);
+// Resolve path from base (or from the root if it starts with '/'), one
+// component at a time; -1 if a component does not exist
+int find_dir(const char* path, int base) {
+    int dir = path[0] == '/' ? 0 : base;
+    while (*path) {
+        while (*path == '/') path++;
+        const char* name = path;
+        while (*path && *path != '/') path++;
+        int len = path - name;
+        if (len == 0 || (len == 1 && name[0] == '.')) continue;
+        if (len == 2 && name[0] == '.' && name[1] == '.') {
+            if (dirs[dir].parent >= 0) dir = dirs[dir].parent;
+            continue;
         }
+        dir = dir_lookup(dir, name, len);
+        if (dir < 0) return -1;
+    }
+    return dir;
+}
+
+// Absolute path of a directory, cut short if it does not fit
+void dir_path(int dir, char* out) {
+    int chain[MAX_PATH / 2], depth = 0;
+    for (; dir > 0 && depth < MAX_PATH / 2; dir = dirs[dir].parent) chain[depth++] = dir;
+    int len = 0;
+    out[len++] = '/';
+    while (depth > 0) {
+        const char* name = dirs[chain[--depth]].name;
+        int n = strlen(name);
+        if (len + n + 1 >= MAX_PATH) break;
+        memcpy(out + len, name, n);
+        len += n;
+        if (depth > 0) out[len++] = '/';
+    }
+    out[len] = '\0';
+}
+
+// Enter directory i into parent's list and the index (parent -1 makes it
+// the root)
+void dir_link(int i, int parent) {
+    Directory* d = &dirs[i];
+    d->parent = parent;
+    d->next = -1;
+    d->prev = parent >= 0 ? dirs[parent].last_dir : -1;
+    if (parent >= 0) {
+        if (d->prev >= 0) dirs[d->prev].next = i;
+        else dirs[parent].first_dir = i;
+        dirs[parent].last_dir = i;
+    }
+    dir_index_insert(i);
+}
+
+void dir_unlink(int i) {
+    Directory* d = &dirs[i];
+    dir_index_remove(i);
+    if (d->prev >= 0) dirs[d->prev].next = d->next;
+    else dirs[d->parent].first_dir = d->next;
+    if (d->next >= 0) dirs[d->next].prev = d->prev;
+    else dirs[d->parent].last_dir = d->prev;
+}
+
+void file_link(int idx, int dir) {
+    File* f = &files[idx];
+    f->dir = dir;
+    f->next = -1;
+    f->prev = dirs[dir].last_file;
+    if (f->prev >= 0) files[f->prev].next = idx;
+    else dirs[dir].first_file = idx;
+    dirs[dir].last_file = idx;
+    file_index_insert(idx);
+}
+
+void file_unlink(int idx) {
+    File* f = &files[idx];
+    file_index_remove(idx);
+    if (f->prev >= 0) files[f->prev].next = f->next;
+    else dirs[f->dir].first_file = f->next;
+    if (f->next >= 0) files[f->next].prev = f->prev;
+    else dirs[f->dir].last_file = f->prev;
+}
+
+// Claim a free directory slot under parent (-1 for the root itself) for
+// a directory whose contents are in memory, or on disk at inode
+int dir_attach(const char* name, int parent, uint32_t inode) {
+    int i = dir_free_list;
+    if (i < 0 || strlen(name) >= MAX_FILENAME) return -1;
+    dir_free_list = dirs[i].hash_next;
+    Directory* d = &dirs[i];
+    d->used = 1;
+    strcpy(d->name, name);
+    d->inode = inode;
+    d->first_dir = d->last_dir = -1;
+    d->first_file = d->last_file = -1;
+    fs_stats.dirs++;
+    dir_link(i, parent);
+    return i;
+}
+
+// New directory under parent, created on disk too if parent is there
+int create_dir(const char* name, int parent) {
+    uint32_t inode = 0;
+    if (dir_free_list < 0 || strlen(name) >= MAX_FILENAME) return -1;
+    if (parent >= 0 && dirs[parent].inode) {
+        inode = afs_create(dirs[parent].inode, name, AFS_TYPE_DIR);
+        if (!inode) return -1;
+    }
+    return dir_attach(name, parent, inode);
+}
+
+// File system functions
+void init_fs() {
+    memset(files, 0, max_files * sizeof(File));
+    memset(dirs, 0, sizeof(dirs));
+    memset(file_buckets, 0xFF, FILE_HASH_SIZE * sizeof(int32_t));
+    memset(dir_buckets, 0xFF, sizeof(dir_buckets));
+    file_free_list = -1;
+    for (int i = max_files - 1; i >= 0; i--) {
+        files[i].hash_next = file_free_list;
+        file_free_list = i;
+    }
+    memset(&fs_stats, 0, sizeof(fs_stats));
+    dir_free_list = -1;
+    for (int i = MAX_DIRS - 1; i >= 0; i--) {
+        dirs[i].hash_next = dir_free_list;
+        dir_free_list = i;
     }
-    search[search_len] = '\0';
     
-    // Find from current position
-    if (search_len > 0) {
-        for (int i = atom_state.cursor_pos + 1; i < atom_state.buffer_size; i++) {
-            int match = 1;
-            if (i + search_len <= atom_state.buffer_size) {
-                for (int j = 0; j < search_len; j++) {
-                    if (atom_state.buffer[i + j] != search[j]) {
-                        match = 0;
-                        break;
-                    }
+    // Create root directory and /mnt
+    create_dir("/", -1);
+    int mnt = create_dir("mnt", 0);
+    
+    // Create mount points: /mnt/c, /mnt/d, /mnt/e, /mnt/f
+    const char* mounts[] = {"c", "d", "e", "f"};
+    for (int i = 0; i < 4; i++) {
+        create_dir(mounts[i], mnt);
+    }
+}
+
+// Claim a free file slot in dir for a file of size bytes at inode on
+// disk, or for an empty file in memory if inode is 0
+int file_attach(const char* name, int dir, uint32_t inode, uint32_t size) {
+    int i = file_free_list;
+    if (i < 0 || strlen(name) >= MAX_FILENAME) return -1;
+    file_free_list = files[i].hash_next;
+    File* f = &files[i];
+    f->used = 1;
+    strcpy(f->name, name);
+    f->head = 0;
+    f->tail = 0;
+    f->size = size;
+    f->inode = inode;
+    fs_stats.files++;
+    fs_stats.bytes += size;
+    file_link(i, dir);
+    return i;
+}
+
+// New empty file in dir, on disk if dir is; in memory its data is
+// allocated on the first write
+int create_file(const char* name, int dir) {
+    uint32_t inode = 0;
+    if (file_free_list < 0 || strlen(name) >= MAX_FILENAME) return -1;
+    if (dirs[dir].inode) {
+        inode = afs_create(dirs[dir].inode, name, AFS_TYPE_FILE);
+        if (!inode) return -1;
+    }
+    return file_attach(name, dir, inode, 0);
+}
+
+// True for extents over file data in a boot module, which has no
+// ExtentBuffer around it
+int extent_borrowed(const Extent* e) {
+    for (int i = 0; i < boot_module_count; i++) {
+        if ((uint32_t)e->data >= boot_modules[i].start && (uint32_t)e->data < boot_modules[i].end) return 1;
+    }
+    return 0;
+}
+
+static inline ExtentBuffer* extent_buffer(const Extent* e) {
+    return (ExtentBuffer*)(e->data - sizeof(ExtentBuffer));
+}
+
+// Room left that no other file can see; module data is always full
+static inline int extent_writable(const Extent* e) {
+    return e->used < e->capacity && extent_buffer(e)->refs == 1;
+}
+
+void extent_free(Extent* e) {
+    if (!extent_borrowed(e)) {
+        ExtentBuffer* b = extent_buffer(e);
+        if (--b->refs == 0) kfree(b);
+    }
+    kfree(e);
+    fs_stats.extents--;
+}
+
+void file_truncate(int idx) {
+    if (files[idx].inode) afs_truncate(files[idx].inode);
+    Extent* e = files[idx].head;
+    while (e) {
+        Extent* next = e->next;
+        extent_free(e);
+        e = next;
+    }
+    fs_stats.bytes -= files[idx].size;
+    files[idx].head = 0;
+    files[idx].tail = 0;
+    files[idx].size = 0;
+}
+
+void remove_file(int idx) {
+    File* f = &files[idx];
+    file_truncate(idx);
+    if (f->inode) afs_unlink(dirs[f->dir].inode, f->inode);
+    file_unlink(idx);
+    files[idx].used = 0;
+    fs_stats.files--;
+    files[idx].hash_next = file_free_list;
+    file_free_list = idx;
+}
+
+// Extents double in size up to FILE_MAX_EXTENT, so appending never moves
+// existing data and an n-byte file has O(log n + n / FILE_MAX_EXTENT) of them
+#define FILE_MIN_EXTENT 64
+#define FILE_MAX_EXTENT (64 * 1024)
+
+// An extent whose buffer takes about bytes of heap, sized to fill its slab
+// object or frames exactly
+Extent* extent_new(uint32_t bytes, uint32_t offset) {
+    Extent* e = kmalloc(sizeof(Extent));
+    ExtentBuffer* b = kmalloc(bytes > KHEAP_MAX_SLAB ? bytes - sizeof(Slab) : bytes);
+    if (!e || !b) {
+        kfree(e);
+        kfree(b);
+        return 0;
+    }
+    b->refs = 1;
+    e->next = 0;
+    e->offset = offset;
+    e->capacity = ksize(b) - sizeof(ExtentBuffer);
+    e->used = 0;
+    e->data = b->bytes;
+    return e;
+}
+
+// Returns -1 when out of memory or disk space, keeping whatever part
+// fitted; fs_error says which
+int file_append(int idx, const char* src, uint32_t len) {
+    File* f = &files[idx];
+    if (f->inode) {
+        uint32_t size = f->size;
+        int status = afs_append(f->inode, src, len, &size);
+        fs_stats.bytes += size - f->size;
+        f->size = size;
+        return status;
+    }
+    while (len > 0) {
+        Extent* e = f->tail;
+        if (!e || !extent_writable(e)) {
+            uint32_t bytes = e ? 2 * (e->capacity + sizeof(ExtentBuffer)) : FILE_MIN_EXTENT;
+            if (bytes > FILE_MAX_EXTENT) bytes = FILE_MAX_EXTENT;
+            Extent* next = extent_new(bytes, f->size);
+            if (!next) {
+                fs_error = "Out of memory";
+                return -1;
+            }
+            if (e) e->next = next;
+            else f->head = next;
+            f->tail = e = next;
+            fs_stats.extents++;
+        }
+        uint32_t chunk = e->capacity - e->used;
+        if (chunk > len) chunk = len;
+        memcpy(e->data + e->used, src, chunk);
+        e->used += chunk;
+        f->size += chunk;
+        fs_stats.bytes += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Copy up to len bytes from offset; returns the number copied
+uint32_t file_read(int idx, uint32_t offset, char* dst, uint32_t len) {
+    File* f = &files[idx];
+    if (f->inode) return afs_read(f->inode, offset, dst, len);
+    if (offset >= f->size) return 0;
+    if (len > f->size - offset) len = f->size - offset;
+    Extent* e = f->head;
+    while (offset >= e->offset + e->used) e = e->next;
+    for (uint32_t done = 0; done < len; e = e->next) {
+        uint32_t from = offset + done - e->offset;
+        uint32_t chunk = e->used - from;
+        if (chunk > len - done) chunk = len - done;
+        memcpy(dst + done, e->data + from, chunk);
+        done += chunk;
+    }
+    return len;
+}
+
+// Contiguous view of a file for the compiler and the image loader. A file
+// in several extents is merged into one, which later appends extend; a
+// file on disk is read into a buffer that lasts until the next call. 0 when
+// out of memory.
+const char* file_data(int idx) {
+    File* f = &files[idx];
+    static const uint32_t empty = 0;
+    static char* disk_view = 0;
+    if (f->inode) {
+        kfree(disk_view);
+        disk_view = f->size ? kmalloc(f->size) : 0;
+        if (!disk_view) return f->size ? 0 : (const char*)&empty;
+        file_read(idx, 0, disk_view, f->size);
+        return disk_view;
+    }
+    if (!f->head) return (const char*)&empty;
+    if (f->head == f->tail) return f->head->data;
+    // extent_new takes the heap block size, which for a large block
+    // includes the Slab header
+    uint32_t bytes = f->size + sizeof(ExtentBuffer);
+    if (bytes > KHEAP_MAX_SLAB) bytes += sizeof(Slab);
+    Extent* e = extent_new(bytes, 0);
+    if (!e) return 0;
+    if (e->capacity < f->size) {
+        kfree(extent_buffer(e));
+        kfree(e);
+        return 0;
+    }
+    e->used = file_read(idx, 0, e->data, f->size);
+    file_truncate(idx);
+    f->head = f->tail = e;
+    f->size = e->used;
+    fs_stats.bytes += e->used;
+    fs_stats.extents++;
+    return e->data;
+}
+
+// Copy file src into dir as name. Files in memory share the source's
+// buffers, so only the extent chain is duplicated; anything involving the
+// disk is copied block by block. Returns the new file, or -1.
+int file_copy(int src, int dir, const char* name) {
+    int idx = create_file(name, dir);
+    if (idx < 0) {
+        fs_error = "Cannot create file";
+        return -1;
+    }
+    if (files[src].inode || files[idx].inode) {
+        char buf[AFS_BLOCK_SIZE];
+        for (uint32_t pos = 0; pos < files[src].size;) {
+            uint32_t n = file_read(src, pos, buf, sizeof(buf));
+            if (n == 0 || file_append(idx, buf, n) < 0) {
+                remove_file(idx);
+                return -1;
+            }
+            pos += n;
+        }
+        return idx;
+    }
+    File* f = &files[idx];
+    for (Extent* e = files[src].head; e; e = e->next) {
+        Extent* copy = kmalloc(sizeof(Extent));
+        if (!copy) {
+            fs_error = "Out of memory";
+            remove_file(idx);
+            return -1;
+        }
+        *copy = *e;
+        copy->next = 0;
+        if (!extent_borrowed(e)) extent_buffer(e)->refs++;
+        if (f->tail) f->tail->next = copy;
+        else f->head = copy;
+        f->tail = copy;
+        f->size += e->used;
+        fs_stats.bytes += e->used;
+        fs_stats.extents++;
+    }
+    return idx;
+}
+
+// Give file idx a new name, in dir; both must be on the same side of
+// memory and disk
+int file_rename(int idx, int dir, const char* name) {
+    File* f = &files[idx];
+    if (f->inode && afs_move(dirs[f->dir].inode, f->inode, dirs[dir].inode, name, AFS_TYPE_FILE) < 0) return -1;
+    file_unlink(idx);
+    strcpy(f->name, name);
+    file_link(idx, dir);
+    return 0;
+}
+
+// An unused name "~<n>" in dir (n's digits least significant first), for
+// building a file's new contents before file_replace swaps them in
+void file_temp_name(int dir, char* tmp) {
+    for (uint32_t n = 0;; n++) {
+        int len = 0;
+        tmp[len++] = '~';
+        uint32_t v = n;
+        do {
+            tmp[len++] = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        tmp[len] = '\0';
+        if (find_file(tmp, dir) < 0 && dir_lookup(dir, tmp, len) < 0) return;
+    }
+}
+
+// Rename file idx to name in dir, removing any file already called that
+int file_replace(int idx, int dir, const char* name) {
+    int old = find_file(name, dir);
+    if (old >= 0 && old != idx) remove_file(old);
+    return file_rename(idx, dir, name);
+}
+
+// Copy src to name in dir. A file already called that is only replaced
+// once the copy is complete, so a failed copy leaves it as it was.
+int file_copy_over(int src, int dir, const char* name) {
+    if (find_file(name, dir) < 0) return file_copy(src, dir, name);
+    char tmp[MAX_FILENAME];
+    file_temp_name(dir, tmp);
+    int idx = file_copy(src, dir, tmp);
+    if (idx < 0 || file_replace(idx, dir, name) < 0) return -1;
+    return idx;
+}
+
+// Remove an empty directory
+void remove_dir(int i) {
+    if (dirs[i].inode) afs_unlink(dirs[dirs[i].parent].inode, dirs[i].inode);
+    dir_unlink(i);
+    dirs[i].used = 0;
+    fs_stats.dirs--;
+    dirs[i].hash_next = dir_free_list;
+    dir_free_list = i;
+}
+
+// True if dir is ancestor or the same directory as d
+int dir_contains(int dir, int d) {
+    for (; d >= 0; d = dirs[d].parent) {
+        if (d == dir) return 1;
+    }
+    return 0;
+}
+
+// Mount the AFS on the ATA disk at dir by mirroring its directory tree
+// into the tables; file data stays on disk. Returns -1 if the disk holds
+// no valid file system.
+int afs_mount(int dir) {
+    uint32_t buf[AFS_BLOCK_SIZE / 4];
+    if (!ata_sectors || disk_read_block(AFS_SUPER_BLOCK, buf) < 0) return -1;
+    memcpy(&afs_super, buf, sizeof(afs_super));
+    AfsSuper* sb = &afs_super;
+    if (sb->magic != AFS_MAGIC || sb->version != AFS_VERSION || sb->block_size != AFS_BLOCK_SIZE ||
+        sb->block_count > ata_sectors / AFS_SECTORS_PER_BLOCK || sb->data_start >= sb->block_count ||
+        sb->inode_count > AFS_MAX_INODES || sb->block_bitmap_blocks * AFS_BLOCK_SIZE * 8 < sb->block_count) {
+        return -1;
+    }
+    afs_inode_map = kmalloc(AFS_BLOCK_SIZE);
+    afs_block_map = kmalloc(sb->block_bitmap_blocks * AFS_BLOCK_SIZE);
+    if (!afs_inode_map || !afs_block_map || disk_read_block(sb->inode_bitmap, afs_inode_map) < 0) return -1;
+    for (uint32_t i = 0; i < sb->block_bitmap_blocks; i++) {
+        if (disk_read_block(sb->block_bitmap + i, afs_block_map + i * AFS_BLOCK_SIZE) < 0) return -1;
+    }
+    afs_next_block = sb->data_start;
+    afs_mounted = 1;
+    afs_mount_dir = dir;
+    dirs[dir].inode = AFS_ROOT_INODE;
+    
+    // Breadth first, so the queue only holds directories already attached
+    static int queue[MAX_DIRS];
+    int head = 0, tail = 0;
+    queue[tail++] = dir;
+    AfsDirent* entries = (AfsDirent*)buf;
+    while (head < tail) {
+        int d = queue[head++];
+        AfsInode inode;
+        if (afs_inode_io(dirs[d].inode, &inode, 0) < 0) continue;
+        for (uint32_t pos = 0; pos < inode.size; pos += AFS_BLOCK_SIZE) {
+            uint32_t block = afs_bmap(&inode, pos / AFS_BLOCK_SIZE, 0);
+            if (!block || disk_read_block(block, buf) < 0) continue;
+            uint32_t count = (inode.size - pos) / sizeof(AfsDirent);
+            if (count > AFS_DIRENTS_PER_BLOCK) count = AFS_DIRENTS_PER_BLOCK;
+            for (uint32_t i = 0; i < count; i++) {
+                AfsDirent* e = &entries[i];
+                if (!e->inode || e->inode >= sb->inode_count) continue;
+                e->name[AFS_NAME_MAX - 1] = '\0';
+                if (e->type == AFS_TYPE_DIR) {
+                    int sub = dir_attach(e->name, d, e->inode);
+                    if (sub >= 0) queue[tail++] = sub;
+                } else {
+                    AfsInode child;
+                    if (afs_inode_io(e->inode, &child, 0) == 0) file_attach(e->name, d, e->inode, child.size);
                 }
-                if (match) {
-                    atom_state.cursor_pos = i;
-                    break;
+            }
+        }
+    }
+    return 0;
+}
+
+// Boot module archives: cpio "newc" format, as packed by tools/mkinitrd.
+// Each entry is a 110-byte header of hex fields, the NUL-terminated name
+// and the data, the latter two padded to 4 bytes.
+#define CPIO_HEADER_SIZE 110
+
+uint32_t cpio_field(const char* header, int index) {
+    const char* p = header + 6 + index * 8;
+    uint32_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        char c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= c - '0';
+        else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+    }
+    return value;
+}
+
+// Directory path relative to base, creating missing components; -1 if
+// one cannot be created
+int preload_dir(const char* path, int len, int base) {
+    int dir = base;
+    for (int i = 0; i < len;) {
+        int start = i;
+        while (i < len && path[i] != '/') i++;
+        int n = i - start;
+        i++;
+        if (n == 0 || (n == 1 && path[start] == '.')) continue;
+        if (n >= MAX_FILENAME) return -1;
+        int sub = dir_lookup(dir, path + start, n);
+        if (sub < 0) {
+            char name[MAX_FILENAME];
+            memcpy(name, path + start, n);
+            name[n] = '\0';
+            sub = create_dir(name, dir);
+            if (sub < 0) return -1;
+        }
+        dir = sub;
+    }
+    return dir;
+}
+
+// Load the archive in module m into the tree under base; returns the
+// number of files loaded, or -1 if the module is not a newc archive.
+// File data is not copied: each file gets one extent over its bytes in the
+// module, so even large files are available at once. Files going to a
+// directory on disk are written there instead.
+int preload_module(const BootModule* m, int base) {
+    const char* p = (const char*)m->start;
+    const char* end = (const char*)m->end;
+    int loaded = 0;
+    while (p + CPIO_HEADER_SIZE <= end) {
+        if (strncmp(p, "070701", 6) != 0) return loaded ? loaded : -1;
+        uint32_t mode = cpio_field(p, 1);
+        uint32_t size = cpio_field(p, 6);
+        uint32_t name_size = cpio_field(p, 11);
+        const char* name = p + CPIO_HEADER_SIZE;
+        char* data = (char*)(((uint32_t)name + name_size + 3) & ~3u);
+        if (name_size == 0 || data > end || size > (uint32_t)(end - data)) break;
+        const char* next = (const char*)(((uint32_t)data + size + 3) & ~3u);
+        if (strcmp(name, "TRAILER!!!") == 0) break;
+        
+        int len = name_size - 1;
+        int leaf = len;
+        while (leaf > 0 && name[leaf - 1] != '/') leaf--;
+        if ((mode & 0170000) == 0040000) {
+            preload_dir(name, len, base);
+        } else if ((mode & 0170000) == 0100000 && len - leaf < MAX_FILENAME) {
+            int dir = preload_dir(name, leaf, base);
+            if (dir >= 0) {
+                int idx = find_file(name + leaf, dir);
+                if (idx >= 0) remove_file(idx);
+                if (dirs[dir].inode) {
+                    idx = create_file(name + leaf, dir);
+                    if (idx >= 0 && file_append(idx, data, size) < 0) idx = -1;
+                } else {
+                    idx = file_attach(name + leaf, dir, 0, 0);
+                    Extent* e = idx >= 0 && size > 0 ? kmalloc(sizeof(Extent)) : 0;
+                    if (e) {
+                        e->next = 0;
+                        e->offset = 0;
+                        e->capacity = size;
+                        e->used = size;
+                        e->data = data;
+                        files[idx].head = files[idx].tail = e;
+                        files[idx].size = size;
+                        fs_stats.bytes += size;
+                        fs_stats.extents++;
+                    } else if (idx >= 0 && size > 0) {
+                        remove_file(idx);
+                        idx = -1;
+                    }
                 }
+                if (idx >= 0) loaded++;
             }
         }
+        p = next;
+    }
+    return loaded;
+}
+
+// Preload every boot module. A module's command line may name the
+// directory to load it into after the file name, as in
+// "module /boot/initrd.cpio /home"; the default is the root.
+void preload_modules() {
+    for (int i = 0; i < boot_module_count; i++) {
+        const BootModule* m = &boot_modules[i];
+        const char* target = m->cmdline;
+        while (*target && *target != ' ') target++;
+        while (*target == ' ') target++;
+        int base = 0;
+        if (*target) base = preload_dir(target, strlen(target), 0);
+        int loaded = base >= 0 ? preload_module(m, base) : -1;
+        if (loaded < 0) {
+            print("Warning: Boot module is not a cpio archive: ");
+            print(m->cmdline);
+            print("\n");
+        } else {
+            print("Preloaded ");
+            print_num(loaded);
+            print(" files from ");
+            print(m->cmdline);
+            print("\n");
+        }
+    }
+}
+
+void cmd_ls() {
+    print("Directory listing of ");
+    print(current_dir);
+    print(":\n");
+    
+    Directory* d = &dirs[current_dir_id];
+    for (int i = d->first_dir; i >= 0; i = dirs[i].next) {
+        print("  [DIR]  ");
+        print(dirs[i].name);
+        print("/\n");
+    }
+    
+    for (int i = d->first_file; i >= 0; i = files[i].next) {
+        print("  [FILE] ");
+        print(files[i].name);
+        
+        // Show file extension for .algr and .algebra files
+        int name_len = strlen(files[i].name);
+        if (name_len > 5 && strcmp(files[i].name + name_len - 5, ".algr") == 0) {
+            print(" (source)");
+        } else if (name_len > 8 && strcmp(files[i].name + name_len - 8, ".algebra") == 0) {
+            print(" (executable)");
+        }
+        
+        print(" - ");
+        print_num(files[i].size);
+        print(" bytes\n");
+    }
+    
+    if (d->first_dir < 0 && d->first_file < 0) {
+        print("  (empty)\n");
+    }
+}
+
+// Split path into the directory holding its last component, which is
+// copied to leaf. Returns the directory, -1 if the last component is not
+// a valid name, or -2 if the directory does not exist.
+int path_parent(const char* path, char* leaf) {
+    char parent_path[MAX_PATH];
+    const char* last = path;
+    for (const char* p = path; *p; p++) {
+        if (*p == '/' && p[1]) last = p + 1;
+    }
+    int prefix = last - path;
+    if (prefix >= MAX_PATH) prefix = MAX_PATH - 1;
+    memcpy(parent_path, path, prefix);
+    parent_path[prefix] = '\0';
+    int len = strlen(last);
+    if (len > 0 && last[len - 1] == '/') len--;
+    if (len == 0 || len >= MAX_FILENAME || (last[0] == '.' && (len == 1 || (len == 2 && last[1] == '.')))) {
+        return -1;
+    }
+    memcpy(leaf, last, len);
+    leaf[len] = '\0';
+    int dir = find_dir(parent_path, current_dir_id);
+    return dir >= 0 ? dir : -2;
+}
+
+void cmd_mkdir(const char* name) {
+    if (strlen(name) == 0) {
+        print("Usage: mkdir <dirname>\n");
+        return;
+    }
+    
+    // The last component is created inside the directory the rest names
+    char leaf_name[MAX_FILENAME];
+    int parent = path_parent(name, leaf_name);
+    if (parent == -1) {
+        print("Error: Invalid directory name\n");
+        return;
+    }
+    if (parent < 0) {
+        print("Error: Directory not found: ");
+        print(name);
+        print("\n");
+        return;
+    }
+    if (dir_lookup(parent, leaf_name, strlen(leaf_name)) >= 0) {
+        print("Error: Directory already exists\n");
+        return;
+    }
+    
+    int idx = create_dir(leaf_name, parent);
+    if (idx < 0) {
+        print("Error: Maximum directories reached\n");
+        return;
+    }
+    char fullpath[MAX_PATH];
+    dir_path(idx, fullpath);
+    print("Directory created: ");
+    print(fullpath);
+    print("\n");
+}
+
+void cmd_cd(const char* path) {
+    if (strlen(path) == 0) path = "/";
+    
+    int dir = find_dir(path, current_dir_id);
+    if (dir >= 0) {
+        current_dir_id = dir;
+        dir_path(dir, current_dir);
+    } else {
+        print("Error: Directory not found: ");
+        print(path);
+        print("\n");
+    }
+}
+
+void cmd_rm(const char* name) {
+    int recursive = strncmp(name, "-r ", 3) == 0;
+    if (recursive) {
+        name += 3;
+        while (*name == ' ') name++;
+    }
+    if (strlen(name) == 0) {
+        print("Usage: rm [-r] <filename>\n");
+        return;
+    }
+    
+    char leaf[MAX_FILENAME];
+    int parent = path_parent(name, leaf);
+    int idx = parent >= 0 ? find_file(leaf, parent) : -1;
+    if (idx >= 0) {
+        remove_file(idx);
+        print("File removed: ");
+        print(name);
+        print("\n");
+        return;
+    }
+    int dir = parent >= 0 ? dir_lookup(parent, leaf, strlen(leaf)) : -1;
+    if (dir < 0) {
+        print("Error: File not found\n");
+        return;
+    }
+    if (!recursive) {
+        print("Error: Is a directory (use rm -r)\n");
+        return;
+    }
+    if (dir_contains(dir, current_dir_id) || (afs_mount_dir >= 0 && dir_contains(dir, afs_mount_dir))) {
+        print("Error: Cannot remove the current directory or a mount point\n");
+        return;
+    }
+    
+    // Post-order walk down the first children, so no stack is needed
+    int removed = 0;
+    for (int d = dir;;) {
+        if (dirs[d].first_file >= 0) {
+            remove_file(dirs[d].first_file);
+            removed++;
+        } else if (dirs[d].first_dir >= 0) {
+            d = dirs[d].first_dir;
+        } else {
+            int up = dirs[d].parent;
+            remove_dir(d);
+            removed++;
+            if (d == dir) break;
+            d = up;
+        }
+    }
+    print("Removed ");
+    print(name);
+    print(" (");
+    print_num(removed);
+    print(" entries)\n");
+}
+
+// Split "<src> <dst>" for cp and mv
+int split_two_paths(const char* args, char* src, char* dst) {
+    int n = 0;
+    while (*args && *args != ' ' && n < MAX_PATH - 1) src[n++] = *args++;
+    src[n] = '\0';
+    while (*args == ' ') args++;
+    n = 0;
+    while (*args && *args != ' ' && n < MAX_PATH - 1) dst[n++] = *args++;
+    dst[n] = '\0';
+    return src[0] && dst[0];
+}
+
+// Where src should go for cp or mv: into dst if it is a directory, else
+// to dst's parent under dst's name. Returns the directory or -1.
+int copy_target(const char* src_leaf, const char* dst, char* leaf) {
+    int dir = find_dir(dst, current_dir_id);
+    if (dir >= 0) {
+        strcpy(leaf, src_leaf);
+        return dir;
+    }
+    dir = path_parent(dst, leaf);
+    if (dir < 0) {
+        print("Error: Directory not found: ");
+        print(dst);
+        print("\n");
+        return -1;
+    }
+    return dir;
+}
+
+void cmd_cp(const char* args) {
+    char src[MAX_PATH], dst[MAX_PATH];
+    if (!split_two_paths(args, src, dst)) {
+        print("Usage: cp <source> <destination>\n");
+        return;
+    }
+    char src_leaf[MAX_FILENAME], leaf[MAX_FILENAME];
+    int src_dir = path_parent(src, src_leaf);
+    int idx = src_dir >= 0 ? find_file(src_leaf, src_dir) : -1;
+    if (idx < 0) {
+        print("Error: File not found: ");
+        print(src);
+        print("\n");
+        return;
+    }
+    int dir = copy_target(src_leaf, dst, leaf);
+    if (dir < 0) return;
+    if (dir_lookup(dir, leaf, strlen(leaf)) >= 0) {
+        print("Error: A directory has that name\n");
+        return;
+    }
+    int old = find_file(leaf, dir);
+    if (old == idx) {
+        print("Error: Source and destination are the same file\n");
+        return;
+    }
+    if (file_copy_over(idx, dir, leaf) < 0) {
+        print("Error: ");
+        print(fs_error);
+        print("\n");
+        return;
+    }
+    print("Copied ");
+    print(src);
+    print(" -> ");
+    print(dst);
+    print("\n");
+}
+
+void cmd_mv(const char* args) {
+    char src[MAX_PATH], dst[MAX_PATH];
+    if (!split_two_paths(args, src, dst)) {
+        print("Usage: mv <source> <destination>\n");
+        return;
+    }
+    char src_leaf[MAX_FILENAME], leaf[MAX_FILENAME];
+    int src_dir = path_parent(src, src_leaf);
+    int idx = src_dir >= 0 ? find_file(src_leaf, src_dir) : -1;
+    int moved_dir = src_dir >= 0 && idx < 0 ? dir_lookup(src_dir, src_leaf, strlen(src_leaf)) : -1;
+    if (idx < 0 && moved_dir < 0) {
+        print("Error: No such file or directory: ");
+        print(src);
+        print("\n");
+        return;
+    }
+    int dir = copy_target(src_leaf, dst, leaf);
+    if (dir < 0) return;
+    if (dir == src_dir && strcmp(leaf, src_leaf) == 0) {
+        print("Error: Source and destination are the same\n");
+        return;
+    }
+    // Like rm -r, leave the mount point and the directories above it alone
+    if (moved_dir >= 0 && afs_mount_dir >= 0 && dir_contains(moved_dir, afs_mount_dir)) {
+        print("Error: Cannot move a mount point\n");
+        return;
+    }
+    if (dir_lookup(dir, leaf, strlen(leaf)) >= 0) {
+        print("Error: A directory has that name\n");
+        return;
+    }
+    int old = find_file(leaf, dir);
+
+    if (idx >= 0) {
+        if ((files[idx].inode != 0) != (dirs[dir].inode != 0)) {
+            // Between memory and disk the data has to move
+            if (file_copy_over(idx, dir, leaf) < 0) {
+                print("Error: ");
+                print(fs_error);
+                print("\n");
+                return;
+            }
+            remove_file(idx);
+        } else {
+            if (file_rename(idx, dir, leaf) < 0) {
+                print("Error: ");
+                print(fs_error);
+                print("\n");
+                return;
+            }
+            if (old >= 0) remove_file(old);
+        }
+    } else {
+        if (old >= 0) {
+            print("Error: A file has that name\n");
+            return;
+        }
+        if (dir_contains(moved_dir, dir)) {
+            print("Error: Cannot move a directory into itself\n");
+            return;
+        }
+        if ((dirs[moved_dir].inode != 0) != (dirs[dir].inode != 0)) {
+            print("Error: Cannot move a directory between disk and memory\n");
+            return;
+        }
+        if (dirs[moved_dir].inode && afs_move(dirs[src_dir].inode, dirs[moved_dir].inode, dirs[dir].inode, leaf, AFS_TYPE_DIR) < 0) {
+            print("Error: ");
+            print(fs_error);
+            print("\n");
+            return;
+        }
+        dir_unlink(moved_dir);
+        strcpy(dirs[moved_dir].name, leaf);
+        dir_link(moved_dir, dir);
+        dir_path(current_dir_id, current_dir);
+    }
+    print("Moved ");
+    print(src);
+    print(" -> ");
+    print(dst);
+    print("\n");
+}
+
+// Arbitrary-precision integers
+//
+// Evaluator values are tagged words: an odd Value holds a 31-bit integer
+// as n << 1 | 1, an even one points to a BigInt. Results only become
+// BigInts once they leave the small range, so ordinary arithmetic never
+// allocates. BigInts are immutable and come from bn_arena, which is reset
+// at the start of every command; shell variables keep theirs in var_heap.
+typedef uint32_t Value;
+
+typedef struct {
+    int32_t sign;           // 1 or -1
+    uint32_t len;           // Limbs in use; the top one is nonzero
+    uint32_t limbs[];       // Base 2^32, least significant first
+} BigInt;
+
+#define VALUE_ERROR 0       // Failed operation; the reason is in value_error
+#define SMALL_MIN (-(1 << 30))
+#define SMALL_MAX ((1 << 30) - 1)
+#define VALUE_IS_SMALL(v) ((v) & 1)
+#define VALUE_SMALL(n) ((uint32_t)(n) << 1 | 1)
+#define VALUE_INT(v) ((int32_t)(v) >> 1)
+#define VALUE_BIG(v) ((const BigInt*)(v))
+#define KARATSUBA_THRESHOLD 32  // Limbs; schoolbook is faster below this
+#define BN_MAX_BITS (1 << 22)   // Largest power or factorial result
+
+// Both sized by tables_init from the memory we boot with
+static uint32_t* bn_arena;
+static uint32_t bn_arena_words;
+static uint32_t bn_used = 0;
+static uint32_t* var_heap[2];                   // Semispaces, see value_persist
+static uint32_t var_heap_words;
+static uint32_t var_heap_used = 0;
+static int var_heap_side = 0;
+static const char* value_error = "";
+
+uint32_t* bn_alloc(uint32_t words) {
+    if (words > bn_arena_words - bn_used) {
+        value_error = "Out of memory for big numbers";
+        return 0;
+    }
+    uint32_t* p = bn_arena + bn_used;
+    bn_used += words;
+    return p;
+}
+
+uint32_t bn_mark() {
+    return bn_used;
+}
+
+void bn_release(uint32_t mark) {
+    bn_used = mark;
+}
+
+BigInt* bn_new(uint32_t len) {
+    BigInt* r = (BigInt*)bn_alloc(2 + len);
+    if (r) r->len = len;
+    return r;
+}
+
+// Trim r, which must be the latest allocation, and return it as a Value.
+// Magnitudes that fit are demoted to small values and their storage freed.
+Value bn_finish(BigInt* r, int32_t sign) {
+    uint32_t len = r->len;
+    while (len > 0 && r->limbs[len - 1] == 0) len--;
+    if (len <= 1) {
+        uint32_t m = len ? r->limbs[0] : 0;
+        if (m <= (uint32_t)SMALL_MAX || (sign < 0 && m == 1u << 30)) {
+            bn_used = (uint32_t*)r - bn_arena;
+            return VALUE_SMALL(sign < 0 ? -(int32_t)m : (int32_t)m);
+        }
+    }
+    r->sign = sign;
+    r->len = len;
+    bn_used = r->limbs + len - bn_arena;
+    return (Value)r;
+}
+
+// Move v, the latest allocation, down to mark and free everything above
+// it, so loops do not accumulate dead intermediate results
+Value bn_keep(uint32_t mark, Value v) {
+    uint32_t* p = (uint32_t*)v;
+    if (v && !VALUE_IS_SMALL(v) && p >= bn_arena + mark && p < bn_arena + bn_used) {
+        uint32_t words = 2 + VALUE_BIG(v)->len;
+        uint32_t* dst = bn_arena + mark;
+        for (uint32_t i = 0; i < words; i++) dst[i] = p[i];
+        v = (Value)dst;
+        mark += words;
+    }
+    bn_used = mark;
+    return v;
+}
+
+Value value_from_int64(int64_t n) {
+    if (n >= SMALL_MIN && n <= SMALL_MAX) return VALUE_SMALL((int32_t)n);
+    BigInt* r = bn_new(2);
+    if (!r) return VALUE_ERROR;
+    uint64_t m = n < 0 ? -(uint64_t)n : (uint64_t)n;
+    r->limbs[0] = (uint32_t)m;
+    r->limbs[1] = (uint32_t)(m >> 32);
+    return bn_finish(r, n < 0 ? -1 : 1);
+}
+
+// Sign and magnitude of any Value, so BigInt code can take small operands
+typedef struct {
+    int32_t sign;
+    uint32_t len;
+    const uint32_t* limbs;
+    uint32_t small;         // Limb storage for a small value
+} BnView;
+
+void bn_view(Value v, BnView* view) {
+    if (VALUE_IS_SMALL(v)) {
+        int32_t n = VALUE_INT(v);
+        view->sign = n < 0 ? -1 : 1;
+        view->small = n < 0 ? -(uint32_t)n : (uint32_t)n;
+        view->len = n != 0;
+        view->limbs = &view->small;
+    } else {
+        view->sign = VALUE_BIG(v)->sign;
+        view->len = VALUE_BIG(v)->len;
+        view->limbs = VALUE_BIG(v)->limbs;
+    }
+}
+
+// r[0..an) = a + b for an >= bn; returns the carry out. r may alias a.
+uint32_t limbs_add(uint32_t* r, const uint32_t* a, uint32_t an, const uint32_t* b, uint32_t bn) {
+    uint64_t carry = 0;
+    uint32_t i = 0;
+    for (; i < bn; i++) {
+        carry += (uint64_t)a[i] + b[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    for (; i < an; i++) {
+        carry += a[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    return (uint32_t)carry;
+}
+
+// r[0..an) = a - b for a >= b, an >= bn. r may alias a.
+void limbs_sub(uint32_t* r, const uint32_t* a, uint32_t an, const uint32_t* b, uint32_t bn) {
+    uint32_t borrow = 0;
+    uint32_t i = 0;
+    for (; i < bn; i++) {
+        uint64_t d = (uint64_t)a[i] - b[i] - borrow;
+        r[i] = (uint32_t)d;
+        borrow = (uint32_t)(d >> 32) & 1;
+    }
+    for (; i < an; i++) {
+        uint32_t d = a[i] - borrow;
+        borrow = a[i] < borrow;
+        r[i] = d;
+    }
+}
+
+int limbs_cmp(const uint32_t* a, uint32_t an, const uint32_t* b, uint32_t bn) {
+    if (an != bn) return an < bn ? -1 : 1;
+    while (an-- > 0) {
+        if (a[an] != b[an]) return a[an] < b[an] ? -1 : 1;
+    }
+    return 0;
+}
+
+// r[0..an+bn) = a * b
+void limbs_mul_schoolbook(uint32_t* r, const uint32_t* a, uint32_t an, const uint32_t* b, uint32_t bn) {
+    for (uint32_t i = 0; i < an + bn; i++) r[i] = 0;
+    for (uint32_t i = 0; i < bn; i++) {
+        uint64_t carry = 0;
+        for (uint32_t j = 0; j < an; j++) {
+            carry += (uint64_t)a[j] * b[i] + r[i + j];
+            r[i + j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        r[i + an] = (uint32_t)carry;
+    }
+}
+
+// r[0..an+bn) = a * b; r must not overlap a or b. Karatsuba splits both
+// operands at m limbs and gets by with three half-size products:
+//     a*b = z2 B^2m + ((a0+a1)(b0+b1) - z0 - z2) B^m + z0
+// Returns -1 if scratch space runs out.
+int limbs_mul(uint32_t* r, const uint32_t* a, uint32_t an, const uint32_t* b, uint32_t bn) {
+    if (an < bn) {
+        const uint32_t* t = a; a = b; b = t;
+        uint32_t tn = an; an = bn; bn = tn;
+    }
+    if (bn < KARATSUBA_THRESHOLD) {
+        limbs_mul_schoolbook(r, a, an, b, bn);
+        return 0;
+    }
+
+    uint32_t mark = bn_mark();
+    if (an >= 2 * bn) {
+        // Unbalanced: multiply b by bn-limb slices of a and accumulate
+        uint32_t* t = bn_alloc(2 * bn);
+        if (!t) return -1;
+        for (uint32_t i = 0; i < an + bn; i++) r[i] = 0;
+        for (uint32_t off = 0; off < an; off += bn) {
+            uint32_t len = an - off < bn ? an - off : bn;
+            if (limbs_mul(t, a + off, len, b, bn) != 0) {
+                bn_release(mark);
+                return -1;
+            }
+            limbs_add(r + off, r + off, an + bn - off, t, len + bn);
+        }
+        bn_release(mark);
+        return 0;
+    }
+
+    // an < 2 * bn, so b has at least m limbs
+    uint32_t m = (an + 1) / 2;
+    uint32_t a1n = an - m, b1n = bn - m;
+    uint32_t* sa = bn_alloc(m + 1);
+    uint32_t* sb = bn_alloc(m + 1);
+    uint32_t* z1 = bn_alloc(2 * m + 2);
+    if (!z1) {
+        bn_release(mark);
+        return -1;
+    }
+    sa[m] = limbs_add(sa, a, m, a + m, a1n);
+    sb[m] = limbs_add(sb, b, m, b + m, b1n);
+
+    // z0 and z2 go straight into the low and high halves of r
+    int failed = limbs_mul(r, a, m, b, m) || limbs_mul(z1, sa, m + 1, sb, m + 1);
+    if (b1n > 0) {
+        failed = failed || limbs_mul(r + 2 * m, a + m, a1n, b + m, b1n);
+    } else {
+        for (uint32_t i = 2 * m; i < an + bn; i++) r[i] = 0;
+    }
+    if (failed) {
+        bn_release(mark);
+        return -1;
+    }
+    limbs_sub(z1, z1, 2 * m + 2, r, 2 * m);
+    limbs_sub(z1, z1, 2 * m + 2, r + 2 * m, a1n + b1n);
+
+    // The middle term fits in what is left of r; its top limbs are zero
+    uint32_t z1n = 2 * m + 2;
+    if (z1n > an + bn - m) z1n = an + bn - m;
+    limbs_add(r + m, r + m, an + bn - m, z1, z1n);
+    bn_release(mark);
+    return 0;
+}
+
+// (hi:lo) / d with divl; the quotient must fit in 32 bits (hi < d). Plain
+// 64-bit division would need libgcc's __udivdi3, which is not linked.
+static inline uint32_t div64_32(uint32_t hi, uint32_t lo, uint32_t d, uint32_t* rem) {
+    uint32_t q;
+    asm("divl %4" : "=a"(q), "=d"(*rem) : "a"(lo), "d"(hi), "rm"(d));
+    return q;
+}
+
+// q[0..an) = a / d; returns the remainder. q may alias a.
+uint32_t limbs_div_small(uint32_t* q, const uint32_t* a, uint32_t an, uint32_t d) {
+    uint32_t rem = 0;
+    for (uint32_t i = an; i-- > 0;) q[i] = div64_32(rem, a[i], d, &rem);
+    return rem;
+}
+
+// q[0..an-bn] = a / b for bn >= 2 and an >= bn (Knuth's algorithm D).
+// Returns -1 if scratch space runs out.
+int limbs_div(uint32_t* q, const uint32_t* a, uint32_t an, const uint32_t* b, uint32_t bn) {
+    uint32_t mark = bn_mark();
+    uint32_t* un = bn_alloc(an + 1);
+    uint32_t* vn = bn_alloc(bn);
+    if (!un || !vn) {
+        bn_release(mark);
+        return -1;
+    }
+
+    // Shift both so the divisor's top bit is set, which keeps each
+    // quotient estimate within two of the true limb
+    int s = __builtin_clz(b[bn - 1]);
+    for (uint32_t i = bn - 1; i > 0; i--) vn[i] = s ? b[i] << s | b[i - 1] >> (32 - s) : b[i];
+    vn[0] = b[0] << s;
+    un[an] = s ? a[an - 1] >> (32 - s) : 0;
+    for (uint32_t i = an - 1; i > 0; i--) un[i] = s ? a[i] << s | a[i - 1] >> (32 - s) : a[i];
+    un[0] = a[0] << s;
+
+    uint32_t vtop = vn[bn - 1], vnext = vn[bn - 2];
+    for (uint32_t j = an - bn + 1; j-- > 0;) {
+        // Estimate from the top two limbs and refine with the third
+        uint32_t qhat, rhat;
+        uint64_t r64;
+        if (un[j + bn] >= vtop) {
+            qhat = 0xFFFFFFFF;
+            r64 = (uint64_t)un[j + bn - 1] + vtop;
+        } else {
+            qhat = div64_32(un[j + bn], un[j + bn - 1], vtop, &rhat);
+            r64 = rhat;
+        }
+        while (r64 <= 0xFFFFFFFF && (uint64_t)qhat * vnext > (r64 << 32 | un[j + bn - 2])) {
+            qhat--;
+            r64 += vtop;
+        }
+
+        // Subtract qhat * v from the current window
+        uint64_t carry = 0;
+        uint32_t borrow = 0;
+        for (uint32_t i = 0; i < bn; i++) {
+            uint64_t p = (uint64_t)qhat * vn[i] + carry;
+            carry = p >> 32;
+            uint64_t d = (uint64_t)un[i + j] - (uint32_t)p - borrow;
+            un[i + j] = (uint32_t)d;
+            borrow = (uint32_t)(d >> 32) & 1;
+        }
+        uint64_t d = (uint64_t)un[j + bn] - carry - borrow;
+        un[j + bn] = (uint32_t)d;
+        q[j] = qhat;
+
+        if (d >> 63) {
+            // qhat was one too large: add the divisor back
+            q[j]--;
+            un[j + bn] += limbs_add(un + j, un + j, bn, vn, bn);
+        }
+    }
+    bn_release(mark);
+    return 0;
+}
+
+// x + y, taking y's sign from ysign (flipped by the caller to subtract)
+Value bn_add_signed(const BnView* x, const BnView* y, int32_t ysign) {
+    if (x->sign == ysign) {
+        const BnView* a = x->len >= y->len ? x : y;
+        const BnView* b = a == x ? y : x;
+        BigInt* r = bn_new(a->len + 1);
+        if (!r) return VALUE_ERROR;
+        r->limbs[a->len] = limbs_add(r->limbs, a->limbs, a->len, b->limbs, b->len);
+        return bn_finish(r, ysign);
+    }
+
+    int cmp = limbs_cmp(x->limbs, x->len, y->limbs, y->len);
+    if (cmp == 0) return VALUE_SMALL(0);
+    const BnView* a = cmp > 0 ? x : y;
+    const BnView* b = cmp > 0 ? y : x;
+    BigInt* r = bn_new(a->len);
+    if (!r) return VALUE_ERROR;
+    limbs_sub(r->limbs, a->limbs, a->len, b->limbs, b->len);
+    return bn_finish(r, cmp > 0 ? x->sign : ysign);
+}
+
+Value value_add(Value a, Value b) {
+    if (!a || !b) return VALUE_ERROR;
+    if (VALUE_IS_SMALL(a & b)) return value_from_int64((int64_t)VALUE_INT(a) + VALUE_INT(b));
+    BnView x, y;
+    bn_view(a, &x);
+    bn_view(b, &y);
+    return bn_add_signed(&x, &y, y.sign);
+}
+
+Value value_sub(Value a, Value b) {
+    if (!a || !b) return VALUE_ERROR;
+    if (VALUE_IS_SMALL(a & b)) return value_from_int64((int64_t)VALUE_INT(a) - VALUE_INT(b));
+    BnView x, y;
+    bn_view(a, &x);
+    bn_view(b, &y);
+    return bn_add_signed(&x, &y, -y.sign);
+}
+
+Value value_neg(Value a) {
+    if (!a) return VALUE_ERROR;
+    if (VALUE_IS_SMALL(a)) return value_from_int64(-(int64_t)VALUE_INT(a));
+    const BigInt* x = VALUE_BIG(a);
+    BigInt* r = bn_new(x->len);
+    if (!r) return VALUE_ERROR;
+    for (uint32_t i = 0; i < x->len; i++) r->limbs[i] = x->limbs[i];
+    return bn_finish(r, -x->sign);
+}
+
+Value value_mul(Value a, Value b) {
+    if (!a || !b) return VALUE_ERROR;
+    if (VALUE_IS_SMALL(a & b)) return value_from_int64((int64_t)VALUE_INT(a) * VALUE_INT(b));
+    BnView x, y;
+    bn_view(a, &x);
+    bn_view(b, &y);
+    if (x.len == 0 || y.len == 0) return VALUE_SMALL(0);
+    BigInt* r = bn_new(x.len + y.len);
+    if (!r) return VALUE_ERROR;
+    if (limbs_mul(r->limbs, x.limbs, x.len, y.limbs, y.len) != 0) {
+        bn_release((uint32_t*)r - bn_arena);
+        return VALUE_ERROR;
+    }
+    return bn_finish(r, x.sign * y.sign);
+}
+
+// Truncating division, like C's
+Value value_div(Value a, Value b) {
+    if (!a || !b) return VALUE_ERROR;
+    if (b == VALUE_SMALL(0)) {
+        value_error = "Division by zero";
+        return VALUE_ERROR;
+    }
+    // Only SMALL_MIN / -1 leaves the small range, and it still fits in 32 bits
+    if (VALUE_IS_SMALL(a & b)) return value_from_int64(VALUE_INT(a) / VALUE_INT(b));
+    BnView x, y;
+    bn_view(a, &x);
+    bn_view(b, &y);
+    if (limbs_cmp(x.limbs, x.len, y.limbs, y.len) < 0) return VALUE_SMALL(0);
+    BigInt* r = bn_new(x.len - y.len + 1);
+    if (!r) return VALUE_ERROR;
+    if (y.len == 1) {
+        limbs_div_small(r->limbs, x.limbs, x.len, y.limbs[0]);
+    } else if (limbs_div(r->limbs, x.limbs, x.len, y.limbs, y.len) != 0) {
+        bn_release((uint32_t*)r - bn_arena);
+        return VALUE_ERROR;
+    }
+    return bn_finish(r, x.sign * y.sign);
+}
+
+Value value_shl(Value a, uint32_t shift) {
+    return value_mul(a, value_from_int64((int64_t)1 << shift));
+}
+
+uint32_t value_bit_length(Value v) {
+    BnView x;
+    bn_view(v, &x);
+    return x.len ? x.len * 32 - __builtin_clz(x.limbs[x.len - 1]) : 0;
+}
+
+// Non-negative small exponents only; the result is capped at BN_MAX_BITS
+Value value_pow(Value base, Value exp) {
+    if (!base || !exp) return VALUE_ERROR;
+    if (!VALUE_IS_SMALL(exp) || VALUE_INT(exp) < 0) {
+        value_error = VALUE_IS_SMALL(exp) ? "Negative exponent" : "Result too large";
+        return VALUE_ERROR;
+    }
+    uint32_t n = VALUE_INT(exp);
+    if (n == 0) return VALUE_SMALL(1);
+    uint32_t bits = value_bit_length(base);
+    if (bits > 1 && (uint64_t)(bits - 1) * n > BN_MAX_BITS) {
+        value_error = "Result too large";
+        return VALUE_ERROR;
+    }
+
+    // Left-to-right binary exponentiation; squarings of large operands
+    // take the Karatsuba path
+    uint32_t mark = bn_mark();
+    Value r = base;
+    for (int bit = 30 - __builtin_clz(n); bit >= 0 && r; bit--) {
+        r = bn_keep(mark, value_mul(r, r));
+        if (n >> bit & 1) r = bn_keep(mark, value_mul(r, base));
+    }
+    return r;
+}
+
+// Product lo * (lo+1) * ... * hi by binary splitting, so the large
+// multiplications have balanced operands
+Value bn_product(uint32_t lo, uint32_t hi) {
+    if (hi - lo < 8) {
+        Value r = VALUE_SMALL(lo);
+        for (uint32_t k = lo + 1; k <= hi && r; k++) r = value_mul(r, VALUE_SMALL(k));
+        return r;
+    }
+    uint32_t mark = bn_mark();
+    uint32_t mid = lo + (hi - lo) / 2;
+    Value left = bn_product(lo, mid);
+    Value right = bn_product(mid + 1, hi);
+    return bn_keep(mark, value_mul(left, right));
+}
+
+Value value_factorial(Value a) {
+    if (!a) return VALUE_ERROR;
+    if (!VALUE_IS_SMALL(a) || VALUE_INT(a) < 0 ||
+        (uint64_t)VALUE_INT(a) * value_bit_length(a) > BN_MAX_BITS) {
+        value_error = VALUE_IS_SMALL(a) && VALUE_INT(a) < 0 ? "Factorial of negative number"
+                                                           : "Result too large";
+        return VALUE_ERROR;
+    }
+    return VALUE_INT(a) < 2 ? VALUE_SMALL(1) : bn_product(1, VALUE_INT(a));
+}
+
+int value_equal(Value a, Value b) {
+    if (a == b) return 1;
+    if (VALUE_IS_SMALL(a) || VALUE_IS_SMALL(b) || !a || !b) return 0;
+    return VALUE_BIG(a)->sign == VALUE_BIG(b)->sign &&
+           limbs_cmp(VALUE_BIG(a)->limbs, VALUE_BIG(a)->len, VALUE_BIG(b)->limbs, VALUE_BIG(b)->len) == 0;
+}
+
+// -1, 0 or 1
+int value_sign(Value v) {
+    if (VALUE_IS_SMALL(v)) return (VALUE_INT(v) > 0) - (VALUE_INT(v) < 0);
+    return VALUE_BIG(v)->sign;
+}
+
+// Greatest common divisor of |a| and |b| by Euclid's algorithm
+Value value_gcd(Value a, Value b) {
+    while (a && b && b != VALUE_SMALL(0)) {
+        Value r = value_sub(a, value_mul(value_div(a, b), b));
+        a = b;
+        b = r;
+    }
+    if (!a || !b) return VALUE_ERROR;
+    return value_sign(a) < 0 ? value_neg(a) : a;
+}
+
+// floor(sqrt(n)) for n >= 0, by Newton's iteration from above
+Value value_isqrt(Value n) {
+    if (!n || value_sign(n) <= 0) return n;
+    Value x = value_pow(VALUE_SMALL(2), VALUE_SMALL((value_bit_length(n) + 1) / 2));
+    while (x) {
+        Value y = value_div(value_add(x, value_div(n, x)), VALUE_SMALL(2));
+        Value step = value_sub(y, x);
+        if (!step) return VALUE_ERROR;
+        if (value_sign(step) >= 0) return x;
+        x = y;
+    }
+    return VALUE_ERROR;
+}
+
+// Value of len decimal digits, converted nine at a time
+Value value_parse_decimal(const char* s, uint32_t len) {
+    uint32_t mark = bn_mark();
+    Value v = VALUE_SMALL(0);
+    uint32_t i = 0;
+    while (i < len && v) {
+        uint32_t chunk = 0, scale = 1;
+        uint32_t end = i + ((len - i) % 9 ? (len - i) % 9 : 9);
+        for (; i < end; i++) {
+            chunk = chunk * 10 + (s[i] - '0');
+            scale *= 10;
+        }
+        v = bn_keep(mark, value_add(value_mul(v, VALUE_SMALL(scale)), VALUE_SMALL(chunk)));
+    }
+    return v;
+}
+
+// Decimal text of v, allocated in the arena; *len gets its length.
+// Dividing the whole number by 10^9 peels off nine digits per pass, so a
+// pass costs one divl per limb instead of one per limb per digit.
+char* value_to_decimal(Value v, uint32_t* len) {
+    if (!v) return 0;
+    BnView x;
+    bn_view(v, &x);
+    uint32_t mark = bn_mark();
+    uint32_t n = x.len;
+    uint32_t* t = bn_alloc(n + 1);
+    uint32_t* chunks = bn_alloc(n * 32 / 29 + 1);  // 10^9 > 2^29
+    if (!t || !chunks) {
+        bn_release(mark);
+        return 0;
+    }
+    for (uint32_t i = 0; i < n; i++) t[i] = x.limbs[i];
+    uint32_t count = 0;
+    while (n > 0) {
+        chunks[count++] = limbs_div_small(t, t, n, 1000000000);
+        while (n > 0 && t[n - 1] == 0) n--;
+    }
+
+    // Sign, the top chunk without leading zeros, then nine digits per chunk
+    char* s = (char*)bn_alloc((count * 9 + 2 + 4) / 4);
+    if (!s) {
+        bn_release(mark);
+        return 0;
+    }
+    char* p = s;
+    if (x.sign < 0 && count > 0) *p++ = '-';
+    char digits[10];
+    int d = 0;
+    uint32_t top = count > 0 ? chunks[count - 1] : 0;
+    do {
+        digits[d++] = '0' + top % 10;
+        top /= 10;
+    } while (top > 0);
+    while (d > 0) *p++ = digits[--d];
+    for (uint32_t i = count > 0 ? count - 1 : 0; i-- > 0;) {
+        uint32_t chunk = chunks[i];
+        for (int k = 8; k >= 0; k--) {
+            p[k] = '0' + chunk % 10;
+            chunk /= 10;
+        }
+        p += 9;
+    }
+    *p = '\0';
+    *len = p - s;
+
+    // Keep only the text
+    uint32_t words = (*len + 4) / 4;
+    uint32_t* dst = bn_arena + mark;
+    for (uint32_t i = 0; i < words; i++) dst[i] = ((uint32_t*)s)[i];
+    bn_used = mark + words;
+    return (char*)dst;
+}
+
+void print_value(Value v) {
+    if (VALUE_IS_SMALL(v)) {
+        print_num(VALUE_INT(v));
+        return;
+    }
+    uint32_t mark = bn_mark();
+    uint32_t len;
+    char* s = value_to_decimal(v, &len);
+    print(s ? s : "<out of memory>");
+    bn_release(mark);
+}
+
+#define POLY_MAX_DEGREE 16
+
+// Equation solutions are formatted into solve_text, so the shell and the VM
+// can print them and algebra-writeline can append them to a file
+static char solve_text[MAX_FILESIZE];
+static uint32_t solve_len = 0;
+static const char* solve_error = 0;  // First failure while formatting
+
+void solve_emit(const char* s) {
+    for (; *s; s++) {
+        if (solve_len + 1 < sizeof(solve_text)) solve_text[solve_len++] = *s;
+        else solve_error = "Solution too long";
+    }
+    solve_text[solve_len] = '\0';
+}
+
+void solve_emit_value(Value v) {
+    uint32_t mark = bn_mark();
+    uint32_t len;
+    char* s = value_to_decimal(v, &len);
+    solve_emit(s ? s : "<out of memory>");
+    bn_release(mark);
+}
+
+// Math expression evaluator with proper operator precedence
+int is_digit(char c) { return c >= '0' && c <= '9'; }
+int is_space(char c) { return c == ' ' || c == '\t'; }
+int is_ident_start(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+int is_ident_char(char c) { return is_ident_start(c) || is_digit(c); }
+
+// Symbol tables: open addressing with linear probing over a power-of-two
+// array from the heap, doubled whenever it passes 3/4 full. Used for shell
+// variables and for the compiler's name-to-slot map.
+#define SYMTAB_SIZE 256         // Initial capacity
+#define MAX_VARNAME 32
+
+typedef struct {
+    char name[MAX_VARNAME];
+    uint32_t hash;
+    Value value;            // Shell variable value, or compiler slot register
+    uint8_t used;
+} Symbol;
+
+typedef struct {
+    Symbol* entries;        // 0 until the first name is added
+    uint32_t capacity;
+    uint32_t count;
+} SymbolTable;
+
+static SymbolTable variables;   // Shell variables, set with 'algebra let'
+static int eval_error = 0;      // Set when an expression references an unknown name
+
+// FNV-1a
+uint32_t symbol_hash(const char* name, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Move the entries into an array twice the size; returns -1 when out of memory
+int symbol_grow(SymbolTable* table) {
+    uint32_t capacity = table->capacity ? table->capacity * 2 : SYMTAB_SIZE;
+    Symbol* entries = kmalloc(capacity * sizeof(Symbol));
+    if (!entries) return -1;
+    memset(entries, 0, capacity * sizeof(Symbol));
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        if (!table->entries[i].used) continue;
+        uint32_t j = table->entries[i].hash & (capacity - 1);
+        while (entries[j].used) j = (j + 1) & (capacity - 1);
+        entries[j] = table->entries[i];
+    }
+    kfree(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+    return 0;
+}
+
+// Find name, or add it when create is set. Returns 0 if the name is absent
+// (or there is no memory to add it). Adding may move every entry.
+Symbol* symbol_lookup(SymbolTable* table, const char* name, int len, uint32_t hash, int create) {
+    if (len >= MAX_VARNAME) return 0;
+    if (!table->capacity && (!create || symbol_grow(table) != 0)) return 0;
+    uint32_t i = hash & (table->capacity - 1);
+    for (;;) {
+        Symbol* s = &table->entries[i];
+        if (!s->used) {
+            if (!create) return 0;
+            // Keep the load factor below 3/4 so probe chains stay short
+            if (table->count + 1 > table->capacity * 3 / 4) {
+                if (symbol_grow(table) != 0) return 0;
+                return symbol_lookup(table, name, len, hash, create);
+            }
+            memcpy(s->name, name, len);
+            s->name[len] = '\0';
+            s->hash = hash;
+            s->value = 0;
+            s->used = 1;
+            table->count++;
+            return s;
+        }
+        if (s->hash == hash && strncmp(s->name, name, len) == 0 && s->name[len] == '\0') {
+            return s;
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+}
+
+// Delete name, shifting later entries of its probe chain back into the
+// hole so that lookups never stop short of them
+void symbol_remove(SymbolTable* table, const char* name, int len) {
+    Symbol* s = symbol_lookup(table, name, len, symbol_hash(name, len), 0);
+    if (!s) return;
+    uint32_t mask = table->capacity - 1;
+    uint32_t hole = s - table->entries;
+    for (uint32_t i = (hole + 1) & mask; table->entries[i].used; i = (i + 1) & mask) {
+        uint32_t home = table->entries[i].hash & mask;
+        // Entries whose home slot lies between the hole and i stay put
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            table->entries[hole] = table->entries[i];
+            hole = i;
+        }
+    }
+    table->entries[hole].used = 0;
+    table->count--;
+}
+
+// Copy every shell variable's BigInt into the other semispace, leaving
+// values that were overwritten behind
+void var_heap_collect() {
+    int to = !var_heap_side;
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < variables.capacity; i++) {
+        Symbol* s = &variables.entries[i];
+        if (!s->used || !s->value || VALUE_IS_SMALL(s->value)) continue;
+        uint32_t words = 2 + VALUE_BIG(s->value)->len;
+        memcpy(var_heap[to] + used, (const void*)s->value, words * sizeof(uint32_t));
+        s->value = (Value)(var_heap[to] + used);
+        used += words;
+    }
+    var_heap_side = to;
+    var_heap_used = used;
+}
+
+// Copy v out of the arena so it outlives the command, for storing in a
+// shell variable
+Value value_persist(Value v) {
+    if (!v || VALUE_IS_SMALL(v)) return v;
+    uint32_t words = 2 + VALUE_BIG(v)->len;
+    if (var_heap_used + words > var_heap_words) var_heap_collect();
+    if (var_heap_used + words > var_heap_words) {
+        value_error = "Out of memory for variables";
+        return VALUE_ERROR;
+    }
+    uint32_t* dst = var_heap[var_heap_side] + var_heap_used;
+    memcpy(dst, (const void*)v, words * sizeof(uint32_t));
+    var_heap_used += words;
+    return (Value)dst;
+}
+
+// Recognize "let name = rhs" or "name = rhs"; fills name and rhs on a match
+int parse_assignment(const char* s, char* name, const char** rhs) {
+    while (is_space(*s)) s++;
+    if (strncmp(s, "let", 3) == 0 && is_space(s[3])) {
+        s += 3;
+        while (is_space(*s)) s++;
+    }
+    if (!is_ident_start(*s)) return 0;
+    int len = 0;
+    while (is_ident_char(s[len])) len++;
+    const char* p = s + len;
+    while (is_space(*p)) p++;
+    if (*p != '=' || len >= MAX_VARNAME) return 0;
+    memcpy(name, s, len);
+    name[len] = '\0';
+    *rhs = p + 1;
+    return 1;
+}
+
+// Forward declarations
+Value parse_expr(const char** expr);
+Value parse_factor(const char** expr);
+
+// Report a failed operation once per evaluation and carry on with 0
+Value eval_check(Value v) {
+    if (v) return v;
+    if (!eval_error) {
+        print("Error: ");
+        print(value_error);
+        print("\n");
+    }
+    eval_error = 1;
+    return VALUE_SMALL(0);
+}
+
+void eval_fail(const char* msg) {
+    if (!eval_error) {
+        print("Error: ");
+        print(msg);
+        print("\n");
+    }
+    eval_error = 1;
+}
+
+Value parse_number(const char** expr) {
+    while (is_space(**expr)) (*expr)++;
+    int sign = 1;
+    if (**expr == '-') { sign = -1; (*expr)++; }
+    else if (**expr == '+') { (*expr)++; }
+    const char* digits = *expr;
+    while (is_digit(**expr)) (*expr)++;
+    Value num = eval_check(value_parse_decimal(digits, *expr - digits));
+    return sign < 0 ? eval_check(value_neg(num)) : num;
+}
+
+// Parse primary (number, variable or parenthesized expression)
+Value parse_primary(const char** expr) {
+    while (is_space(**expr)) (*expr)++;
+    
+    if (**expr == '(') {
+        (*expr)++;
+        Value result = parse_expr(expr);
+        while (is_space(**expr)) (*expr)++;
+        if (**expr == ')') (*expr)++;
+        return result;
+    }
+    
+    if (is_ident_start(**expr)) {
+        const char* name = *expr;
+        while (is_ident_char(**expr)) (*expr)++;
+        int len = *expr - name;
+        Symbol* s = symbol_lookup(&variables, name, len, symbol_hash(name, len), 0);
+        if (s) return s->value;
+        if (!eval_error) {
+            print("Error: Undefined variable: ");
+            for (int i = 0; i < len; i++) putchar(name[i]);
+            print("\n");
+        }
+        eval_error = 1;
+        return VALUE_SMALL(0);
+    }
+    
+    return parse_number(expr);
+}
+
+// Parse factor (sign, postfix ! and right-associative ^, so -2^2 is -4)
+Value parse_factor(const char** expr) {
+    while (is_space(**expr)) (*expr)++;
+    
+    if (**expr == '-' || **expr == '+') {
+        char sign = *(*expr)++;
+        Value result = parse_factor(expr);
+        return sign == '-' ? eval_check(value_neg(result)) : result;
+    }
+    
+    Value result = parse_primary(expr);
+    while (1) {
+        while (is_space(**expr)) (*expr)++;
+        if (**expr != '!') break;
+        (*expr)++;
+        result = eval_check(value_factorial(result));
+    }
+    if (**expr == '^') {
+        (*expr)++;
+        result = eval_check(value_pow(result, parse_factor(expr)));
+    }
+    return result;
+}
+
+// Parse term (handles * and /)
+Value parse_term(const char** expr) {
+    Value result = parse_factor(expr);
+    
+    while (1) {
+        while (is_space(**expr)) (*expr)++;
+        char op = **expr;
+        
+        if (op != '*' && op != '/') break;
+        
+        (*expr)++;
+        Value right = parse_factor(expr);
+        
+        if (op == '*') {
+            result = eval_check(value_mul(result, right));
+        } else if (op == '/') {
+            result = eval_check(value_div(result, right));
+        }
+    }
+    
+    return result;
+}
+
+// Parse expression (handles + and -)
+Value parse_expr(const char** expr) {
+    Value result = parse_term(expr);
+    
+    while (**expr) {
+        while (is_space(**expr)) (*expr)++;
+        if (!**expr) break;
+        
+        char op = **expr;
+        if (op != '+' && op != '-') break;
+        
+        (*expr)++;
+        Value right = parse_term(expr);
+        
+        if (op == '+') {
+            result = eval_check(value_add(result, right));
+        } else if (op == '-') {
+            result = eval_check(value_sub(result, right));
+        }
+    }
+    
+    return result;
+}
+
+Value eval_expr(const char* expr) {
+    return parse_expr(&expr);
+}
+
+// Floating-point mode (algebra -f). Everything in this section is compiled
+// for SSE2 scalar math; cmd_algebra_float only calls in when the CPU has it.
+#pragma GCC push_options
+#pragma GCC target("sse2", "fpmath=sse")
+
+double float_expr(const char** expr);
+double float_factor(const char** expr);
+
+static const double float_pow10[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// x * 10^n; powers up to 1e22 are exact doubles, so |n| <= 22 rounds once
+double float_scale(double x, int n) {
+    while (n > 22) { x *= 1e22; n -= 22; }
+    while (n < -22) { x /= 1e22; n += 22; }
+    return n >= 0 ? x * float_pow10[n] : x / float_pow10[-n];
+}
+
+double float_sqrt(double x) {
+    double r;
+    asm("sqrtsd %1, %0" : "=x"(r) : "x"(x));
+    return r;
+}
+
+double value_to_double(Value v) {
+    if (VALUE_IS_SMALL(v)) return VALUE_INT(v);
+    BnView x;
+    bn_view(v, &x);
+    double d = 0;
+    for (uint32_t i = x.len; i-- > 0;) d = d * 4294967296.0 + x.limbs[i];
+    return x.sign < 0 ? -d : d;
+}
+
+// digits[.digits][e[+-]digits]; the first 18 significant digits are kept
+double float_number(const char** expr) {
+    const char* p = *expr;
+    int64_t mant = 0;
+    int digits = 0, exp10 = 0, seen = 0;
+    for (; is_digit(*p); p++, seen++) {
+        if (digits < 18) { mant = mant * 10 + (*p - '0'); if (mant) digits++; }
+        else exp10++;
+    }
+    if (*p == '.') {
+        for (p++; is_digit(*p); p++, seen++) {
+            if (digits < 18) { mant = mant * 10 + (*p - '0'); exp10--; if (mant) digits++; }
+        }
+    }
+    if (!seen) {
+        eval_fail("Expected a number");
+        return 0;
+    }
+    if (*p == 'e' || *p == 'E') {
+        const char* e = p + 1;
+        int sign = 1, n = 0;
+        if (*e == '-' || *e == '+') sign = *e++ == '-' ? -1 : 1;
+        if (is_digit(*e)) {
+            for (; is_digit(*e); e++) if (n < 10000) n = n * 10 + (*e - '0');
+            exp10 += sign * n;
+            p = e;
+        }
+    }
+    *expr = p;
+    return float_scale((double)mant, exp10);
+}
+
+// Parse primary (number, sqrt(...), variable or parenthesized expression)
+double float_primary(const char** expr) {
+    while (is_space(**expr)) (*expr)++;
+    
+    if (**expr == '(') {
+        (*expr)++;
+        double result = float_expr(expr);
+        while (is_space(**expr)) (*expr)++;
+        if (**expr == ')') (*expr)++;
+        return result;
+    }
+    
+    if (is_ident_start(**expr)) {
+        const char* name = *expr;
+        while (is_ident_char(**expr)) (*expr)++;
+        int len = *expr - name;
+        if (len == 4 && strncmp(name, "sqrt", 4) == 0) return float_sqrt(float_primary(expr));
+        Symbol* s = symbol_lookup(&variables, name, len, symbol_hash(name, len), 0);
+        if (s) return value_to_double(s->value);
+        if (!eval_error) {
+            print("Error: Undefined variable: ");
+            for (int i = 0; i < len; i++) putchar(name[i]);
+            print("\n");
+        }
+        eval_error = 1;
+        return 0;
+    }
+    
+    return float_number(expr);
+}
+
+// Parse factor (sign and right-associative ^ with an integer exponent)
+double float_factor(const char** expr) {
+    while (is_space(**expr)) (*expr)++;
+    
+    if (**expr == '-' || **expr == '+') {
+        char sign = *(*expr)++;
+        double result = float_factor(expr);
+        return sign == '-' ? -result : result;
+    }
+    
+    double base = float_primary(expr);
+    while (is_space(**expr)) (*expr)++;
+    if (**expr != '^') return base;
+    (*expr)++;
+    
+    double e = float_factor(expr);
+    if (!(e >= -2147483647.0 && e <= 2147483647.0) || e != (double)(int32_t)e) {
+        eval_fail("Non-integer exponent");
+        return 0;
+    }
+    int32_t n = (int32_t)e;
+    uint32_t k = n < 0 ? -(uint32_t)n : (uint32_t)n;
+    double result = 1;
+    for (; k; k >>= 1) {
+        if (k & 1) result *= base;
+        base *= base;
+    }
+    return n < 0 ? 1 / result : result;
+}
+
+// Parse term (handles * and /)
+double float_term(const char** expr) {
+    double result = float_factor(expr);
+    
+    while (1) {
+        while (is_space(**expr)) (*expr)++;
+        char op = **expr;
+        if (op != '*' && op != '/') break;
+        (*expr)++;
+        double right = float_factor(expr);
+        result = op == '*' ? result * right : result / right;
+    }
+    
+    return result;
+}
+
+// Parse expression (handles + and -)
+double float_expr(const char** expr) {
+    double result = float_term(expr);
+    
+    while (1) {
+        while (is_space(**expr)) (*expr)++;
+        char op = **expr;
+        if (op != '+' && op != '-') break;
+        (*expr)++;
+        double right = float_term(expr);
+        result = op == '+' ? result + right : result - right;
+    }
+    
+    return result;
+}
+
+// Format d into buf (40 bytes) with 15 significant digits: scale into
+// [1e14, 1e15) using an estimate of the decimal exponent, round once, then
+// emit two 32-bit halves.
+void format_double(double d, char* buf) {
+    union { double d; uint32_t w[2]; } bits = { d };
+    uint32_t e2 = (bits.w[1] >> 20) & 0x7FF;
+    int n = 0;
+    
+    if (e2 == 0x7FF) {
+        strcpy(buf, d != d ? "nan" : bits.w[1] >> 31 ? "-inf" : "inf");
+        return;
+    }
+    if (d == 0) {
+        strcpy(buf, "0");
+        return;
+    }
+    if (bits.w[1] >> 31) { buf[n++] = '-'; d = -d; }
+    
+    // floor(e2 * log10(2)) is off by at most one for normal numbers, but
+    // subnormals have e2 = 0 and need a few more steps
+    int e10 = ((int)e2 - 1023) * 78913 >> 18;
+    double r = float_scale(d, 14 - e10);
+    while (r >= 1e15) r = float_scale(d, 14 - ++e10);
+    while (r < 1e14) r = float_scale(d, 14 - --e10);
+    r = (r + 4503599627370496.0) - 4503599627370496.0;  // Round to integer
+    if (r >= 1e15) { r = 1e14; e10++; }
+    
+    uint32_t hi = (uint32_t)(r / 1e9);
+    uint32_t lo = (uint32_t)(r - hi * 1e9);
+    char digits[16];
+    for (int i = 14; i >= 9; i--) { digits[i] = '0' + lo % 10; lo /= 10; }
+    for (int i = 8; i >= 6; i--) { digits[i] = '0' + lo % 10; lo /= 10; }
+    for (int i = 5; i >= 0; i--) { digits[i] = '0' + hi % 10; hi /= 10; }
+    int nd = 15;
+    while (nd > 1 && digits[nd - 1] == '0') nd--;
+    
+    if (e10 >= 15 || e10 < -5) {
+        buf[n++] = digits[0];
+        if (nd > 1) buf[n++] = '.';
+        for (int i = 1; i < nd; i++) buf[n++] = digits[i];
+        buf[n++] = 'e';
+        if (e10 < 0) { buf[n++] = '-'; e10 = -e10; }
+        if (e10 >= 100) buf[n++] = '0' + e10 / 100;
+        if (e10 >= 10) buf[n++] = '0' + e10 / 10 % 10;
+        buf[n++] = '0' + e10 % 10;
+    } else if (e10 >= 0) {
+        for (int i = 0; i <= e10; i++) buf[n++] = i < nd ? digits[i] : '0';
+        if (nd > e10 + 1) buf[n++] = '.';
+        for (int i = e10 + 1; i < nd; i++) buf[n++] = digits[i];
+    } else {
+        buf[n++] = '0';
+        buf[n++] = '.';
+        for (int i = -1; i > e10; i--) buf[n++] = '0';
+        for (int i = 0; i < nd; i++) buf[n++] = digits[i];
+    }
+    buf[n] = '\0';
+}
+
+void print_double(double d) {
+    char buf[40];
+    format_double(d, buf);
+    print(buf);
+}
+
+void solve_emit_double(double d) {
+    char buf[40];
+    format_double(d, buf);
+    solve_emit(buf);
+}
+
+// "x = re", or "x = re + im i" for a complex root
+void solve_emit_complex(double re, double im) {
+    solve_emit("x = ");
+    if (im == 0) {
+        solve_emit_double(re);
+    } else {
+        if (re != 0) {
+            solve_emit_double(re);
+            solve_emit(im < 0 ? " - " : " + ");
+            if (im < 0) im = -im;
+        }
+        solve_emit_double(im);
+        solve_emit("i");
+    }
+    solve_emit("\n");
+}
+
+// Roots of a x^2 + b x + c when the discriminant d is not a perfect square.
+// The real case avoids cancellation by computing the larger root first.
+void solve_quadratic_float(Value a, Value b, Value c, Value d) {
+    double fa = value_to_double(a), fb = value_to_double(b);
+    double fc = value_to_double(c), fd = value_to_double(d);
+    if (fd < 0) {
+        double re = -fb / (2 * fa);
+        double im = float_sqrt(-fd) / (2 * (fa < 0 ? -fa : fa));
+        solve_emit_complex(re, im);
+        solve_emit_complex(re, -im);
+        return;
+    }
+    double q = -0.5 * (fb + (fb < 0 ? -float_sqrt(fd) : float_sqrt(fd)));
+    double x1 = q / fa, x2 = fc / q;
+    solve_emit_complex(x1 < x2 ? x1 : x2, 0);
+    solve_emit_complex(x1 < x2 ? x2 : x1, 0);
+}
+
+#define NEWTON_MAX_ITER 200
+
+// Move z towards a root of the complex polynomial (ar, ai) of degree n by
+// Newton's method; returns 1 once the step is negligible
+int newton_refine(const double* ar, const double* ai, int n, double* zr, double* zi, int iters) {
+    double xr = *zr, xi = *zi;
+    int converged = 0;
+    for (int it = 0; it < iters && !converged; it++) {
+        // Horner's rule for p(z) and p'(z) together
+        double pr = ar[n], pi = ai[n], dr = 0, di = 0;
+        for (int i = n - 1; i >= 0; i--) {
+            double t = dr * xr - di * xi + pr;
+            di = dr * xi + di * xr + pi;
+            dr = t;
+            t = pr * xr - pi * xi + ar[i];
+            pi = pr * xi + pi * xr + ai[i];
+            pr = t;
+        }
+        double m = dr * dr + di * di;
+        if (pr == 0 && pi == 0) break;
+        if (m == 0) {
+            // Flat spot: nudge off it
+            xr += 0.5;
+            xi += 0.5;
+            continue;
+        }
+        double sr = (pr * dr + pi * di) / m, si = (pi * dr - pr * di) / m;
+        xr -= sr;
+        xi -= si;
+        converged = sr * sr + si * si <= 1e-30 * (xr * xr + xi * xi) + 1e-300;
+    }
+    *zr = xr;
+    *zi = xi;
+    return converged || iters == 0;
+}
+
+// All n complex roots of the polynomial c, by Newton's method with
+// deflation. Each root is polished against the undeflated polynomial, so
+// rounding in the deflation does not accumulate.
+void poly_roots(const Value* c, int n, double* re, double* im) {
+    double pr[POLY_MAX_DEGREE + 1], pi[POLY_MAX_DEGREE + 1];
+    double wr[POLY_MAX_DEGREE + 1], wi[POLY_MAX_DEGREE + 1];
+    for (int i = 0; i <= n; i++) {
+        pr[i] = wr[i] = value_to_double(c[i]);
+        pi[i] = wi[i] = 0;
+    }
+    
+    for (int k = n; k > 0; k--) {
+        double zr, zi;
+        if (k == 1) {
+            double m = wr[1] * wr[1] + wi[1] * wi[1];
+            zr = -(wr[0] * wr[1] + wi[0] * wi[1]) / m;
+            zi = -(wi[0] * wr[1] - wr[0] * wi[1]) / m;
+        } else {
+            // A complex start lets the iteration reach complex roots
+            for (int tries = 1;; tries++) {
+                zr = 0.4 * tries;
+                zi = (tries & 1 ? 0.9 : -0.9) * tries;
+                if (newton_refine(wr, wi, k, &zr, &zi, NEWTON_MAX_ITER) || tries == 8) break;
+            }
+        }
+        newton_refine(pr, pi, n, &zr, &zi, 8);
+        re[n - k] = zr;
+        im[n - k] = zi * zi <= 1e-18 * (zr * zr + zi * zi) ? 0 : zi;
+        
+        // Divide w by (x - z)
+        double br = wr[k], bi = wi[k];
+        for (int i = k - 1; i >= 0; i--) {
+            double tr = wr[i] + br * zr - bi * zi, ti = wi[i] + br * zi + bi * zr;
+            wr[i] = br;
+            wi[i] = bi;
+            br = tr;
+            bi = ti;
+        }
+    }
+}
+
+// Print all roots of c found numerically: real ones in ascending order,
+// then complex ones
+void solve_numeric(const Value* c, int n) {
+    double re[POLY_MAX_DEGREE], im[POLY_MAX_DEGREE];
+    poly_roots(c, n, re, im);
+    for (int i = 1; i < n; i++) {
+        for (int j = i; j > 0; j--) {
+            int complex_prev = im[j - 1] != 0, complex_cur = im[j] != 0;
+            if (complex_prev < complex_cur || (complex_prev == complex_cur && re[j - 1] <= re[j])) break;
+            double t = re[j]; re[j] = re[j - 1]; re[j - 1] = t;
+            t = im[j]; im[j] = im[j - 1]; im[j - 1] = t;
+        }
+    }
+    for (int i = 0; i < n; i++) solve_emit_complex(re[i], im[i]);
+}
+
+// Nearest integers to the real roots of c, for the caller to check exactly;
+// returns how many were found
+int poly_integer_candidates(const Value* c, int n, int32_t* out) {
+    double re[POLY_MAX_DEGREE], im[POLY_MAX_DEGREE];
+    poly_roots(c, n, re, im);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (im[i] != 0 || !(re[i] > -1e9 && re[i] < 1e9)) continue;
+        out[count++] = (int32_t)(re[i] < 0 ? re[i] - 0.5 : re[i] + 0.5);
+    }
+    return count;
+}
+
+#pragma GCC pop_options
+
+void cmd_algebra_float(const char* expr) {
+    if (!fpu_sse2) {
+        print("Error: Float mode needs SSE2\n");
+        return;
+    }
+    eval_error = 0;
+    double result = float_expr(&expr);
+    if (eval_error) return;
+    print("Result: ");
+    print_double(result);
+    print("\n");
+}
+
+// Polynomial equations. Each side of an equation is parsed into a
+// polynomial in x over a common denominator, so "x/2 + x/3 = 5" is solved
+// exactly instead of truncating like the integer evaluator.
+typedef struct {
+    Value c[POLY_MAX_DEGREE + 1];   // c[i] is the coefficient of x^i
+    int degree;
+    Value den;
+} Poly;
+
+void poly_expr(const char** expr, Poly* r);
+void poly_factor(const char** expr, Poly* r);
+
+void poly_const(Poly* p, Value v) {
+    p->c[0] = v;
+    p->degree = 0;
+    p->den = VALUE_SMALL(1);
+}
+
+void poly_trim(Poly* p) {
+    while (p->degree > 0 && p->c[p->degree] == VALUE_SMALL(0)) p->degree--;
+}
+
+// r = a + b, or a - b if negate; r may alias a or b
+void poly_add(Poly* r, const Poly* a, const Poly* b, int negate) {
+    int same = value_equal(a->den, b->den);
+    Poly t;
+    t.degree = a->degree > b->degree ? a->degree : b->degree;
+    for (int i = 0; i <= t.degree; i++) {
+        Value x = i <= a->degree ? a->c[i] : VALUE_SMALL(0);
+        Value y = i <= b->degree ? b->c[i] : VALUE_SMALL(0);
+        if (!same) {
+            x = eval_check(value_mul(x, b->den));
+            y = eval_check(value_mul(y, a->den));
+        }
+        t.c[i] = eval_check(negate ? value_sub(x, y) : value_add(x, y));
+    }
+    t.den = same ? a->den : eval_check(value_mul(a->den, b->den));
+    poly_trim(&t);
+    *r = t;
+}
+
+void poly_mul(Poly* r, const Poly* a, const Poly* b) {
+    if (a->degree + b->degree > POLY_MAX_DEGREE) {
+        eval_fail("Degree too high");
+        poly_const(r, VALUE_SMALL(0));
+        return;
+    }
+    Poly t;
+    t.degree = a->degree + b->degree;
+    for (int i = 0; i <= t.degree; i++) t.c[i] = VALUE_SMALL(0);
+    for (int i = 0; i <= a->degree; i++) {
+        for (int j = 0; j <= b->degree; j++) {
+            t.c[i + j] = eval_check(value_add(t.c[i + j], value_mul(a->c[i], b->c[j])));
+        }
+    }
+    t.den = eval_check(value_mul(a->den, b->den));
+    poly_trim(&t);
+    *r = t;
+}
+
+void poly_div(Poly* r, const Poly* a, const Poly* b) {
+    if (b->degree > 0) {
+        eval_fail("Cannot divide by an expression in x");
+        return;
+    }
+    if (b->c[0] == VALUE_SMALL(0)) {
+        eval_fail("Division by zero");
+        return;
+    }
+    Poly t;
+    t.degree = a->degree;
+    for (int i = 0; i <= t.degree; i++) t.c[i] = eval_check(value_mul(a->c[i], b->den));
+    t.den = eval_check(value_mul(a->den, b->c[0]));
+    *r = t;
+}
+
+// Parse primary (x, number, variable or parenthesized expression)
+void poly_primary(const char** expr, Poly* r) {
+    while (is_space(**expr)) (*expr)++;
+    poly_const(r, VALUE_SMALL(0));
+    
+    if (**expr == '(') {
+        (*expr)++;
+        poly_expr(expr, r);
+        while (is_space(**expr)) (*expr)++;
+        if (**expr == ')') (*expr)++;
+        return;
+    }
+    
+    if (is_ident_start(**expr)) {
+        const char* name = *expr;
+        while (is_ident_char(**expr)) (*expr)++;
+        int len = *expr - name;
+        if (len == 1 && name[0] == 'x') {
+            r->c[1] = VALUE_SMALL(1);
+            r->degree = 1;
+            return;
+        }
+        Symbol* s = symbol_lookup(&variables, name, len, symbol_hash(name, len), 0);
+        if (s) {
+            r->c[0] = s->value;
+            return;
+        }
+        if (!eval_error) {
+            print("Error: Undefined variable: ");
+            for (int i = 0; i < len; i++) putchar(name[i]);
+            print("\n");
+        }
+        eval_error = 1;
+        return;
+    }
+    
+    const char* digits = *expr;
+    while (is_digit(**expr)) (*expr)++;
+    if (*expr == digits) {
+        eval_fail("Expected a number");
+        return;
+    }
+    r->c[0] = eval_check(value_parse_decimal(digits, *expr - digits));
+    
+    // A decimal fraction is exact: 2.25 is 225/100
+    if (**expr == '.' && is_digit((*expr)[1])) {
+        const char* frac = ++(*expr);
+        while (is_digit(**expr)) (*expr)++;
+        Value scale = eval_check(value_pow(VALUE_SMALL(10), VALUE_SMALL(*expr - frac)));
+        Value f = eval_check(value_parse_decimal(frac, *expr - frac));
+        r->c[0] = eval_check(value_add(value_mul(r->c[0], scale), f));
+        r->den = scale;
+    }
+}
+
+// Parse factor (sign, postfix ! and right-associative ^). Powers of
+// polynomials need a constant exponent.
+void poly_factor(const char** expr, Poly* r) {
+    while (is_space(**expr)) (*expr)++;
+    
+    if (**expr == '-' || **expr == '+') {
+        char sign = *(*expr)++;
+        poly_factor(expr, r);
+        if (sign == '-') {
+            for (int i = 0; i <= r->degree; i++) r->c[i] = eval_check(value_neg(r->c[i]));
+        }
+        return;
+    }
+    
+    poly_primary(expr, r);
+    int integer = r->degree == 0 && r->den == VALUE_SMALL(1);
+    while (1) {
+        while (is_space(**expr)) (*expr)++;
+        if (**expr != '!') break;
+        (*expr)++;
+        if (!integer) {
+            eval_fail("Factorial needs an integer");
+            return;
+        }
+        r->c[0] = eval_check(value_factorial(r->c[0]));
+    }
+    if (**expr != '^') return;
+    (*expr)++;
+    
+    Poly e;
+    poly_factor(expr, &e);
+    if (e.degree > 0 || e.den != VALUE_SMALL(1)) {
+        eval_fail("Exponent must be an integer constant");
+        return;
+    }
+    if (integer) {
+        r->c[0] = eval_check(value_pow(r->c[0], e.c[0]));
+        return;
+    }
+    if (!VALUE_IS_SMALL(e.c[0]) || VALUE_INT(e.c[0]) < 0 || VALUE_INT(e.c[0]) > POLY_MAX_DEGREE) {
+        eval_fail(VALUE_IS_SMALL(e.c[0]) && VALUE_INT(e.c[0]) < 0 ? "Negative exponent" : "Degree too high");
+        return;
+    }
+    Poly base = *r;
+    poly_const(r, VALUE_SMALL(1));
+    for (int32_t n = VALUE_INT(e.c[0]); n > 0 && !eval_error; n--) poly_mul(r, r, &base);
+}
+
+// Parse term (handles *, / and implicit multiplication such as 3x or 2(x+1))
+void poly_term(const char** expr, Poly* r) {
+    poly_factor(expr, r);
+    
+    while (!eval_error) {
+        while (is_space(**expr)) (*expr)++;
+        char op = **expr;
+        Poly right;
+        if (op == '*' || op == '/') {
+            (*expr)++;
+            poly_factor(expr, &right);
+        } else if (is_digit(op) || is_ident_start(op) || op == '(') {
+            op = '*';
+            poly_factor(expr, &right);
+        } else {
+            break;
+        }
+        if (op == '*') poly_mul(r, r, &right);
+        else poly_div(r, r, &right);
+    }
+}
+
+// Parse expression (handles + and -)
+void poly_expr(const char** expr, Poly* r) {
+    poly_term(expr, r);
+    
+    while (!eval_error) {
+        while (is_space(**expr)) (*expr)++;
+        char op = **expr;
+        if (op != '+' && op != '-') break;
+        (*expr)++;
+        Poly right;
+        poly_term(expr, &right);
+        poly_add(r, r, &right, op == '-');
+    }
+}
+
+int solve_fail(const char* msg) {
+    print("Error: ");
+    print(msg);
+    print("\n");
+    return -1;
+}
+
+// "x = num/den" in lowest terms
+void solve_emit_root(Value num, Value den, int multiplicity) {
+    Value g = value_gcd(num, den);
+    num = value_div(num, g);
+    den = value_div(den, g);
+    if (den && value_sign(den) < 0) {
+        num = value_neg(num);
+        den = value_neg(den);
+    }
+    if (!num || !den) {
+        if (!solve_error) solve_error = value_error;
+        return;
+    }
+    solve_emit("x = ");
+    solve_emit_value(num);
+    if (den != VALUE_SMALL(1)) {
+        solve_emit("/");
+        solve_emit_value(den);
+    }
+    if (multiplicity > 1) {
+        solve_emit(" (multiplicity ");
+        solve_emit_value(VALUE_SMALL(multiplicity));
+        solve_emit(")");
+    }
+    solve_emit("\n");
+}
+
+// p(r) == 0 for the integer r, evaluated exactly
+int poly_has_root(const Value* c, int n, Value r) {
+    Value p = c[n];
+    for (int i = n - 1; i >= 0; i--) p = value_add(value_mul(p, r), c[i]);
+    return p == VALUE_SMALL(0);
+}
+
+// Divide c by (x - r) in place; the quotient has degree n - 1
+void poly_deflate(Value* c, int n, Value r) {
+    Value b = c[n];
+    for (int i = n - 1; i >= 0; i--) {
+        Value t = value_add(c[i], value_mul(b, r));
+        c[i] = b;
+        b = t;
+    }
+}
+
+// Solve den * (c[degree] x^degree + ... + c[0]) = 0 for integer coefficients
+// and format the solutions into solve_text; block is { den, c[0], ... }.
+// Degrees 1 and 2 are solved in closed form with exact rational roots.
+// Higher degrees use Newton's method, whose integer roots are confirmed
+// exactly and divided out before the rest is reported numerically.
+int solve_polynomial(const Value* block, int degree) {
+    solve_len = 0;
+    solve_error = 0;
+    solve_text[0] = '\0';
+    if (block[0] == VALUE_SMALL(0)) return solve_fail("Division by zero");
+    if (degree < 0 || degree > POLY_MAX_DEGREE) return solve_fail("Degree too high");
+    
+    Value c[POLY_MAX_DEGREE + 1];
+    int n = degree;
+    for (int i = 0; i <= n; i++) c[i] = block[i + 1];
+    while (n > 0 && c[n] == VALUE_SMALL(0)) n--;
+    if (n == 0) {
+        if (c[0] != VALUE_SMALL(0)) return solve_fail("No solution");
+        solve_emit("x can be any number\n");
+        return 0;
+    }
+    
+    int zeros = 0;
+    while (c[0] == VALUE_SMALL(0)) {
+        for (int i = 0; i < n; i++) c[i] = c[i + 1];
+        n--;
+        zeros++;
+    }
+    if (zeros) solve_emit_root(VALUE_SMALL(0), VALUE_SMALL(1), zeros);
+    
+    if (n > 2) {
+        if (!fpu_sse2) return solve_fail("Equations above degree 2 need SSE2");
+        int32_t guesses[POLY_MAX_DEGREE];
+        int count = poly_integer_candidates(c, n, guesses);
+        for (int i = 0; i < count && n > 0; i++) {
+            Value r = VALUE_SMALL(guesses[i]);
+            int multiplicity = 0;
+            while (n > 0 && poly_has_root(c, n, r)) {
+                poly_deflate(c, n--, r);
+                multiplicity++;
+            }
+            if (multiplicity) solve_emit_root(r, VALUE_SMALL(1), multiplicity);
+        }
+    }
+    
+    for (int i = 0; i <= n; i++) {
+        if (!c[i]) return solve_fail(value_error);
+    }
+    if (n == 1) {
+        solve_emit_root(value_neg(c[0]), c[1], 1);
+    } else if (n == 2) {
+        Value a = c[2], b = c[1];
+        Value d = value_sub(value_mul(b, b), value_mul(value_mul(a, c[0]), VALUE_SMALL(4)));
+        Value s = value_isqrt(d);
+        if (!s) return solve_fail(value_error);
+        Value a2 = value_add(a, a), nb = value_neg(b);
+        if (d == VALUE_SMALL(0)) {
+            solve_emit_root(nb, a2, 2);
+        } else if (value_sign(d) > 0 && value_equal(value_mul(s, s), d)) {
+            if (value_sign(a) < 0) s = value_neg(s);
+            solve_emit_root(value_sub(nb, s), a2, 1);
+            solve_emit_root(value_add(nb, s), a2, 1);
+        } else {
+            if (!fpu_sse2) return solve_fail("Irrational roots need SSE2");
+            solve_quadratic_float(a, b, c[0], d);
+        }
+    } else if (n > 2) {
+        solve_numeric(c, n);
+    }
+    
+    if (solve_error) return solve_fail(solve_error);
+    return 0;
+}
+
+// Parse and solve an equation in x into solve_text; returns 0 on success
+int solve_equation_text(const char* eq) {
+    const char* p = eq;
+    Poly left, right;
+    eval_error = 0;
+    poly_expr(&p, &left);
+    while (is_space(*p)) p++;
+    if (!eval_error && *p != '=') eval_fail("Missing '=' sign");
+    if (eval_error) return -1;
+    p++;
+    poly_expr(&p, &right);
+    while (is_space(*p)) p++;
+    if (!eval_error && *p) eval_fail("Unexpected text after equation");
+    if (eval_error) return -1;
+    
+    // left - right = 0 over the product of the denominators
+    Value block[POLY_MAX_DEGREE + 2];
+    int degree = left.degree > right.degree ? left.degree : right.degree;
+    block[0] = eval_check(value_mul(left.den, right.den));
+    for (int i = 0; i <= degree; i++) {
+        Value a = i <= left.degree ? left.c[i] : VALUE_SMALL(0);
+        Value b = i <= right.degree ? right.c[i] : VALUE_SMALL(0);
+        block[i + 1] = eval_check(value_sub(value_mul(a, right.den), value_mul(b, left.den)));
+    }
+    if (eval_error) return -1;
+    return solve_polynomial(block, degree);
+}
+
+void solve_equation(const char* eq) {
+    if (solve_equation_text(eq) == 0) print(solve_text);
+}
+
+// Matrices (algebra [1 2; 3 4] * [5; 6], det, transpose, solve A b).
+// Elements are doubles in row-major order with rows padded to an even
+// length, so the kernels below work on 16-byte SSE2 vectors of two.
+#define MAT_MAX_DIM 32
+#define MAT_MAX_VARS 8
+#define MAT_BLOCK 16        // Tile size for the blocked multiply
+
+typedef struct {
+    int rows, cols;
+    int stride;             // Doubles per row; even, so rows stay 16-byte aligned
+    int scalar;             // A plain number rather than a 1x1 matrix
+    double* a;
+} Matrix;
+
+typedef struct {
+    char name[MAX_VARNAME];
+    int rows, cols, scalar;
+    double a[MAT_MAX_DIM * MAT_MAX_DIM];    // Unpadded
+} MatrixVar;
+
+static MatrixVar matrix_vars[MAT_MAX_VARS];
+static int matrix_var_count = 0;
+
+MatrixVar* matrix_var_lookup(const char* name, int len) {
+    for (int i = 0; i < matrix_var_count; i++) {
+        if ((int)strlen(matrix_vars[i].name) == len && strncmp(matrix_vars[i].name, name, len) == 0) {
+            return &matrix_vars[i];
+        }
+    }
+    return 0;
+}
+
+// Scalars and matrices share one namespace: storing either kind of
+// variable drops one of the other kind with the same name
+void matrix_var_remove(const char* name, int len) {
+    MatrixVar* v = matrix_var_lookup(name, len);
+    if (v) *v = matrix_vars[--matrix_var_count];
+}
+
+// True if expr needs the matrix evaluator: a literal, a matrix keyword or
+// a matrix variable
+int matrix_syntax(const char* expr) {
+    while (*expr) {
+        if (*expr == '[') return 1;
+        if (!is_ident_start(*expr)) {
+            expr++;
+            continue;
+        }
+        const char* name = expr;
+        while (is_ident_char(*expr)) expr++;
+        int len = expr - name;
+        if ((len == 3 && strncmp(name, "det", 3) == 0) ||
+            (len == 5 && strncmp(name, "solve", 5) == 0) ||
+            (len == 9 && strncmp(name, "transpose", 9) == 0) ||
+            matrix_var_lookup(name, len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#pragma GCC push_options
+#pragma GCC target("sse2", "fpmath=sse")
+
+typedef double v2df __attribute__((vector_size(16)));
+
+void matrix_expr(const char** expr, Matrix* r);
+void matrix_postfix(const char** expr, Matrix* r);
+
+// Zeroed rows x cols matrix in the big-number arena, which is released
+// after every command
+int matrix_new(Matrix* m, int rows, int cols) {
+    m->rows = rows;
+    m->cols = cols;
+    m->stride = (cols + 1) & ~1;
+    m->scalar = 0;
+    m->a = 0;
+    if (rows > MAT_MAX_DIM || cols > MAT_MAX_DIM) {
+        eval_fail("Matrix too large");
+        return -1;
+    }
+    uint32_t words = rows * m->stride * 2 + 3;
+    uint32_t* p = bn_alloc(words);
+    if (!p) {
+        eval_fail(value_error);
+        return -1;
+    }
+    memset(p, 0, words * sizeof(uint32_t));
+    m->a = (double*)(((uint32_t)p + 15) & ~15u);
+    return 0;
+}
+
+int matrix_scalar(Matrix* m, double d) {
+    if (matrix_new(m, 1, 1) != 0) return -1;
+    m->a[0] = d;
+    m->scalar = 1;
+    return 0;
+}
+
+// c = a * b. The k and j loops are tiled so a MAT_BLOCK square of b is
+// reused from cache across all rows of a, and each row update is a
+// stream of two-wide multiply-adds.
+void matrix_mul_kernel(Matrix* c, const Matrix* a, const Matrix* b) {
+    int n = a->rows, m = a->cols, p = b->cols;
+    for (int kk = 0; kk < m; kk += MAT_BLOCK) {
+        int k_end = kk + MAT_BLOCK < m ? kk + MAT_BLOCK : m;
+        for (int jj = 0; jj < p; jj += MAT_BLOCK) {
+            int j_end = jj + MAT_BLOCK < p ? jj + MAT_BLOCK : p;
+            int pairs = (j_end - jj + 1) / 2;
+            for (int i = 0; i < n; i++) {
+                v2df* crow = (v2df*)(c->a + i * c->stride + jj);
+                for (int k = kk; k < k_end; k++) {
+                    double f = a->a[i * a->stride + k];
+                    v2df fv = { f, f };
+                    const v2df* brow = (const v2df*)(b->a + k * b->stride + jj);
+                    for (int j = 0; j < pairs; j++) crow[j] += fv * brow[j];
+                }
+            }
+        }
+    }
+}
+
+// row r -= f * row s, from column first on (rounded down to a vector)
+void matrix_row_sub(Matrix* m, int r, int s, double f, int first) {
+    v2df fv = { f, f };
+    v2df* dst = (v2df*)(m->a + r * m->stride);
+    const v2df* src = (const v2df*)(m->a + s * m->stride);
+    for (int j = first / 2; j < m->stride / 2; j++) dst[j] -= fv * src[j];
+}
+
+// Gaussian elimination with partial pivoting over the first n columns,
+// leaving them upper triangular. Returns the sign of the row permutation,
+// or 0 if a pivot is negligible next to the largest entry.
+int matrix_eliminate(Matrix* m, int n) {
+    double scale = 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            double v = m->a[i * m->stride + j];
+            if (v < 0) v = -v;
+            if (v > scale) scale = v;
+        }
+    }
+    double tiny = scale * n * 2.3e-16;
+
+    int sign = 1;
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        double best = 0;
+        for (int r = col; r < n; r++) {
+            double v = m->a[r * m->stride + col];
+            if (v < 0) v = -v;
+            if (v > best) {
+                best = v;
+                pivot = r;
+            }
+        }
+        if (best <= tiny) return 0;
+        if (pivot != col) {
+            v2df* x = (v2df*)(m->a + pivot * m->stride);
+            v2df* y = (v2df*)(m->a + col * m->stride);
+            for (int j = 0; j < m->stride / 2; j++) {
+                v2df t = x[j];
+                x[j] = y[j];
+                y[j] = t;
+            }
+            sign = -sign;
+        }
+        double inv = 1 / m->a[col * m->stride + col];
+        for (int r = col + 1; r < n; r++) {
+            double f = m->a[r * m->stride + col] * inv;
+            if (f != 0) matrix_row_sub(m, r, col, f, col);
+        }
+    }
+    return sign;
+}
+
+int matrix_copy(Matrix* dst, const Matrix* src, int extra_cols) {
+    if (matrix_new(dst, src->rows, src->cols + extra_cols) != 0) return -1;
+    for (int i = 0; i < src->rows; i++) {
+        for (int j = 0; j < src->cols; j++) dst->a[i * dst->stride + j] = src->a[i * src->stride + j];
+    }
+    return 0;
+}
+
+void matrix_det(Matrix* r, const Matrix* a) {
+    if (a->rows != a->cols) {
+        eval_fail("det needs a square matrix");
+        return;
+    }
+    Matrix t;
+    if (matrix_copy(&t, a, 0) != 0) return;
+    double d = matrix_eliminate(&t, t.rows);
+    for (int i = 0; d != 0 && i < t.rows; i++) d *= t.a[i * t.stride + i];
+    matrix_scalar(r, d);
+}
+
+// Solve a x = b for x by elimination on [a | b] and back substitution
+void matrix_solve(Matrix* r, const Matrix* a, const Matrix* b) {
+    if (a->rows != a->cols || b->rows != a->rows) {
+        eval_fail("solve needs a square matrix and a right-hand side with as many rows");
+        return;
+    }
+    int n = a->rows, k = b->cols;
+    Matrix t;
+    if (matrix_copy(&t, a, k) != 0) return;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < k; j++) t.a[i * t.stride + n + j] = b->a[i * b->stride + j];
+    }
+    if (matrix_eliminate(&t, n) == 0) {
+        eval_fail("Matrix is singular");
+        return;
+    }
+    // Eliminate upwards too, so each row ends up with only its pivot
+    for (int col = n - 1; col >= 0; col--) {
+        double inv = 1 / t.a[col * t.stride + col];
+        for (int i = 0; i < col; i++) {
+            double f = t.a[i * t.stride + col] * inv;
+            if (f != 0) matrix_row_sub(&t, i, col, f, col);
+        }
+    }
+    if (matrix_new(r, n, k) != 0) return;
+    for (int i = 0; i < n; i++) {
+        double inv = 1 / t.a[i * t.stride + i];
+        for (int j = 0; j < k; j++) r->a[i * r->stride + j] = t.a[i * t.stride + n + j] * inv;
+    }
+}
+
+void matrix_transpose(Matrix* r, const Matrix* a) {
+    if (matrix_new(r, a->cols, a->rows) != 0) return;
+    r->scalar = a->scalar;
+    for (int i = 0; i < a->rows; i++) {
+        for (int j = 0; j < a->cols; j++) r->a[j * r->stride + i] = a->a[i * a->stride + j];
+    }
+}
+
+// r = a op b for + - * /, elementwise or with a scalar operand
+void matrix_binary(Matrix* r, const Matrix* a, const Matrix* b, char op) {
+    if (op == '*' && !a->scalar && !b->scalar) {
+        if (a->cols != b->rows) {
+            eval_fail("Matrix dimensions do not match for *");
+            return;
+        }
+        if (matrix_new(r, a->rows, b->cols) == 0) matrix_mul_kernel(r, a, b);
+        return;
+    }
+    if (op == '/' && !b->scalar) {
+        eval_fail("Can only divide by a number");
+        return;
+    }
+    if ((op == '+' || op == '-') && a->scalar != b->scalar) {
+        eval_fail("Cannot add a number and a matrix");
+        return;
+    }
+    if ((op == '+' || op == '-') && (a->rows != b->rows || a->cols != b->cols)) {
+        eval_fail("Matrix dimensions do not match");
+        return;
+    }
+
+    const Matrix* shape = a->scalar ? b : a;
+    if (matrix_new(r, shape->rows, shape->cols) != 0) return;
+    r->scalar = a->scalar && b->scalar;
+    for (int i = 0; i < r->rows; i++) {
+        for (int j = 0; j < r->cols; j++) {
+            double x = a->scalar ? a->a[0] : a->a[i * a->stride + j];
+            double y = b->scalar ? b->a[0] : b->a[i * b->stride + j];
+            double v = op == '+' ? x + y : op == '-' ? x - y : op == '*' ? x * y : x / y;
+            r->a[i * r->stride + j] = v;
+        }
+    }
+}
+
+// [a b c; d e f]: elements are separated by spaces or commas, rows by ';'
+void matrix_literal(const char** expr, Matrix* r) {
+    double cells[MAT_MAX_DIM * MAT_MAX_DIM];
+    int rows = 0, cols = 0, col = 0;
+    while (!eval_error) {
+        while (is_space(**expr) || **expr == ',') (*expr)++;
+        char ch = **expr;
+        if (ch == ']' || ch == ';' || ch == '\0') {
+            if (col > 0 || ch == ';') {
+                if (rows > 0 && col != cols) {
+                    eval_fail("Rows have different lengths");
+                    return;
+                }
+                if (rows == MAT_MAX_DIM) {
+                    eval_fail("Matrix too large");
+                    return;
+                }
+                cols = col;
+                rows++;
+                col = 0;
+            }
+            if (ch != ';') break;
+            (*expr)++;
+            continue;
+        }
+        if (col == MAT_MAX_DIM) {
+            eval_fail("Matrix too large");
+            return;
+        }
+        cells[rows * MAT_MAX_DIM + col++] = float_factor(expr);
+    }
+    if (eval_error) return;
+    if (**expr != ']') {
+        eval_fail("Expected ']'");
+        return;
+    }
+    (*expr)++;
+    if (rows == 0 || cols == 0) {
+        eval_fail("Empty matrix");
+        return;
+    }
+    if (matrix_new(r, rows, cols) != 0) return;
+    for (int i = 0; i < rows; i++) {
+        for (int j = 0; j < cols; j++) r->a[i * r->stride + j] = cells[i * MAT_MAX_DIM + j];
+    }
+}
+
+int matrix_keyword(const char** expr, const char* word) {
+    int n = strlen(word);
+    if (strncmp(*expr, word, n) != 0 || is_ident_char((*expr)[n])) return 0;
+    *expr += n;
+    return 1;
+}
+
+// Parse primary (literal, det/transpose/solve, matrix variable, number,
+// scalar expression in parentheses)
+void matrix_primary(const char** expr, Matrix* r) {
+    while (is_space(**expr)) (*expr)++;
+    r->a = 0;
+    
+    if (**expr == '[') {
+        (*expr)++;
+        matrix_literal(expr, r);
+        return;
+    }
+    if (**expr == '(') {
+        (*expr)++;
+        matrix_expr(expr, r);
+        while (is_space(**expr)) (*expr)++;
+        if (**expr == ')') (*expr)++;
+        return;
+    }
+    
+    Matrix a, b;
+    if (matrix_keyword(expr, "det")) {
+        matrix_postfix(expr, &a);
+        if (!eval_error) matrix_det(r, &a);
+        return;
+    }
+    if (matrix_keyword(expr, "transpose")) {
+        matrix_postfix(expr, &a);
+        if (!eval_error) matrix_transpose(r, &a);
+        return;
+    }
+    if (matrix_keyword(expr, "solve")) {
+        matrix_postfix(expr, &a);
+        if (!eval_error) matrix_postfix(expr, &b);
+        if (!eval_error) matrix_solve(r, &a, &b);
+        return;
+    }
+    
+    if (is_ident_start(**expr)) {
+        const char* name = *expr;
+        int len = 0;
+        while (is_ident_char(name[len])) len++;
+        MatrixVar* v = matrix_var_lookup(name, len);
+        if (v) {
+            *expr += len;
+            if (matrix_new(r, v->rows, v->cols) != 0) return;
+            r->scalar = v->scalar;
+            for (int i = 0; i < v->rows; i++) {
+                for (int j = 0; j < v->cols; j++) r->a[i * r->stride + j] = v->a[i * v->cols + j];
+            }
+            return;
+        }
+    }
+    
+    // Anything else is a scalar: number, sqrt() or shell variable
+    matrix_scalar(r, float_primary(expr));
+}
+
+// Postfix ' transposes
+void matrix_postfix(const char** expr, Matrix* r) {
+    matrix_primary(expr, r);
+    while (!eval_error) {
+        while (is_space(**expr)) (*expr)++;
+        if (**expr != '\'') break;
+        (*expr)++;
+        Matrix t = *r;
+        matrix_transpose(r, &t);
+    }
+}
+
+void matrix_unary(const char** expr, Matrix* r) {
+    while (is_space(**expr)) (*expr)++;
+    if (**expr == '-') {
+        (*expr)++;
+        Matrix a, minus_one;
+        matrix_unary(expr, &a);
+        if (!eval_error && matrix_scalar(&minus_one, -1) == 0) matrix_binary(r, &minus_one, &a, '*');
+        return;
+    }
+    if (**expr == '+') (*expr)++;
+    matrix_postfix(expr, r);
+}
+
+void matrix_term(const char** expr, Matrix* r) {
+    matrix_unary(expr, r);
+    while (!eval_error) {
+        while (is_space(**expr)) (*expr)++;
+        char op = **expr;
+        if (op != '*' && op != '/') break;
+        (*expr)++;
+        Matrix a = *r, b;
+        matrix_unary(expr, &b);
+        if (!eval_error) matrix_binary(r, &a, &b, op);
+    }
+}
+
+void matrix_expr(const char** expr, Matrix* r) {
+    matrix_term(expr, r);
+    while (!eval_error) {
+        while (is_space(**expr)) (*expr)++;
+        char op = **expr;
+        if (op != '+' && op != '-') break;
+        (*expr)++;
+        Matrix a = *r, b;
+        matrix_term(expr, &b);
+        if (!eval_error) matrix_binary(r, &a, &b, op);
+    }
+}
+
+// One row per line with right-aligned columns
+void print_matrix(const Matrix* m) {
+    char cell[40];
+    if (m->scalar) {
+        print(" ");
+        print_double(m->a[0]);
+        print("\n");
+        return;
+    }
+    int width[MAT_MAX_DIM];
+    for (int j = 0; j < m->cols; j++) {
+        width[j] = 0;
+        for (int i = 0; i < m->rows; i++) {
+            format_double(m->a[i * m->stride + j], cell);
+            int len = strlen(cell);
+            if (len > width[j]) width[j] = len;
+        }
+    }
+    print("\n");
+    for (int i = 0; i < m->rows; i++) {
+        print("  [");
+        for (int j = 0; j < m->cols; j++) {
+            format_double(m->a[i * m->stride + j], cell);
+            for (int pad = width[j] - strlen(cell); pad >= 0; pad--) putchar(' ');
+            print(cell);
+        }
+        print(" ]\n");
+    }
+}
+
+// Evaluate, and store under name when it is not null. Vector spills need
+// the 16-byte stack alignment the ABI promises but the boot stack lacks.
+__attribute__((force_align_arg_pointer))
+void matrix_command(const char* name, const char* expr) {
+    Matrix r;
+    eval_error = 0;
+    matrix_expr(&expr, &r);
+    while (is_space(*expr)) expr++;
+    if (!eval_error && *expr) eval_fail("Unexpected text after expression");
+    if (eval_error) return;
+    
+    if (!name) {
+        print("Result:");
+        print_matrix(&r);
+        return;
+    }
+    MatrixVar* v = matrix_var_lookup(name, strlen(name));
+    if (!v) {
+        if (matrix_var_count == MAT_MAX_VARS) {
+            print("Error: Too many matrix variables\n");
+            return;
+        }
+        v = &matrix_vars[matrix_var_count++];
+        strcpy(v->name, name);
+    }
+    symbol_remove(&variables, name, strlen(name));
+    v->rows = r.rows;
+    v->cols = r.cols;
+    v->scalar = r.scalar;
+    for (int i = 0; i < r.rows; i++) {
+        for (int j = 0; j < r.cols; j++) v->a[i * r.cols + j] = r.a[i * r.stride + j];
+    }
+    print(name);
+    print(" =");
+    print_matrix(&r);
+}
+
+#pragma GCC pop_options
+
+void cmd_algebra_matrix(const char* name, const char* expr) {
+    if (!fpu_sse2) {
+        print("Error: Matrix mode needs SSE2\n");
+        return;
+    }
+    matrix_command(name, expr);
+}
+
+// Symbolic algebra (algebra simplify <expr>, algebra diff <expr>[, var]).
+// Expressions are a hash-consed DAG: equal subtrees are one node, so
+// a - b is a + (-1)*b, a / b is a * b^-1, and simplification and
+// differentiation are memoized per node. Nodes live until the next command.
+#define CAS_MAX_NODES 4096
+#define CAS_HASH_SIZE (CAS_MAX_NODES * 2)
+#define CAS_MAX_VARS 32
+#define CAS_MAX_FACTORS 64      // Factors in one product, or terms in one sum
+#define CAS_PRINT_NODES 200     // Larger results print shared parts once
+
+enum { CAS_NUM, CAS_VAR, CAS_ADD, CAS_MUL, CAS_POW, CAS_FUNC };
+enum { FN_SIN, FN_COS, FN_EXP, FN_LN, FN_COUNT };
+static const char* const cas_fn_names[FN_COUNT] = { "sin", "cos", "exp", "ln" };
+
+typedef struct {
+    uint8_t kind;
+    uint32_t value;         // Number (a Value), variable index, or function
+    int16_t a, b;           // Operands; FUNC uses a
+} CasNode;
+
+static CasNode cas_nodes[CAS_MAX_NODES];
+static int cas_count = 0;
+static int16_t cas_hash[CAS_HASH_SIZE];     // Node id + 1, 0 for empty
+static int16_t cas_simplified[CAS_MAX_NODES];
+static int16_t cas_derivative[CAS_MAX_NODES];
+static uint16_t cas_uses[CAS_MAX_NODES];    // While printing
+static int16_t cas_label[CAS_MAX_NODES];
+static char cas_var_names[CAS_MAX_VARS][MAX_VARNAME];
+static int cas_var_count = 0;
+static int cas_zero, cas_one, cas_minus_one;
+
+int cas_node(int kind, uint32_t value, int a, int b) {
+    uint32_t h = value;
+    if (kind == CAS_NUM && !VALUE_IS_SMALL(value)) {
+        h = VALUE_BIG(value)->limbs[0] ^ VALUE_BIG(value)->len;
+    }
+    h = ((h * 31 + kind) * 31 + (uint32_t)a) * 31 + (uint32_t)b;
+    uint32_t slot = (h * 2654435761u) & (CAS_HASH_SIZE - 1);
+    while (cas_hash[slot]) {
+        CasNode* n = &cas_nodes[cas_hash[slot] - 1];
+        if (n->kind == kind && n->a == a && n->b == b &&
+            (n->value == value || (kind == CAS_NUM && value_equal(n->value, value)))) {
+            return cas_hash[slot] - 1;
+        }
+        slot = (slot + 1) & (CAS_HASH_SIZE - 1);
+    }
+    if (cas_count >= CAS_MAX_NODES) {
+        eval_fail("Expression too large");
+        return 0;
+    }
+    int id = cas_count++;
+    cas_nodes[id].kind = kind;
+    cas_nodes[id].value = value;
+    cas_nodes[id].a = a;
+    cas_nodes[id].b = b;
+    cas_hash[slot] = id + 1;
+    return id;
+}
+
+int cas_num(Value v) { return v ? cas_node(CAS_NUM, v, -1, -1) : (eval_check(v), cas_zero); }
+int cas_add(int a, int b) { return cas_node(CAS_ADD, 0, a, b); }
+int cas_mul(int a, int b) { return cas_node(CAS_MUL, 0, a, b); }
+int cas_pow(int a, int b) { return cas_node(CAS_POW, 0, a, b); }
+int cas_fn(int fn, int a) { return cas_node(CAS_FUNC, fn, a, -1); }
+
+int cas_is_num(int n, int32_t v) {
+    return cas_nodes[n].kind == CAS_NUM && cas_nodes[n].value == VALUE_SMALL(v);
+}
+
+void cas_reset() {
+    cas_count = 0;
+    cas_var_count = 0;
+    memset(cas_hash, 0, sizeof(cas_hash));
+    memset(cas_simplified, 0xFF, sizeof(cas_simplified));
+    memset(cas_derivative, 0xFF, sizeof(cas_derivative));
+    cas_zero = cas_num(VALUE_SMALL(0));
+    cas_one = cas_num(VALUE_SMALL(1));
+    cas_minus_one = cas_num(VALUE_SMALL(-1));
+}
+
+int cas_var(const char* name, int len) {
+    for (int i = 0; i < cas_var_count; i++) {
+        if ((int)strlen(cas_var_names[i]) == len && strncmp(cas_var_names[i], name, len) == 0) {
+            return cas_node(CAS_VAR, i, -1, -1);
+        }
+    }
+    if (cas_var_count == CAS_MAX_VARS || len >= MAX_VARNAME) {
+        eval_fail("Too many variables");
+        return cas_zero;
+    }
+    memcpy(cas_var_names[cas_var_count], name, len);
+    cas_var_names[cas_var_count][len] = '\0';
+    return cas_node(CAS_VAR, cas_var_count++, -1, -1);
+}
+
+// Parser, with the precedence of parse_expr plus implicit multiplication
+int cas_expr(const char** expr);
+int cas_unary(const char** expr);
+
+int cas_primary(const char** expr) {
+    while (is_space(**expr)) (*expr)++;
+    if (**expr == '(') {
+        (*expr)++;
+        int n = cas_expr(expr);
+        while (is_space(**expr)) (*expr)++;
+        if (**expr == ')') (*expr)++;
+        return n;
+    }
+    if (is_ident_start(**expr)) {
+        const char* name = *expr;
+        while (is_ident_char(**expr)) (*expr)++;
+        int len = *expr - name;
+        const char* p = *expr;
+        while (is_space(*p)) p++;
+        if (*p == '(') {
+            for (int fn = 0; fn < FN_COUNT; fn++) {
+                if ((int)strlen(cas_fn_names[fn]) == len && strncmp(cas_fn_names[fn], name, len) == 0) {
+                    *expr = p;
+                    return cas_fn(fn, cas_primary(expr));
+                }
+            }
+        }
+        return cas_var(name, len);
+    }
+    const char* digits = *expr;
+    while (is_digit(**expr)) (*expr)++;
+    if (*expr == digits) {
+        eval_fail("Expected a number, variable or '('");
+        return cas_zero;
+    }
+    return cas_num(value_parse_decimal(digits, *expr - digits));
+}
+
+int cas_power(const char** expr) {
+    int base = cas_primary(expr);
+    while (is_space(**expr)) (*expr)++;
+    if (**expr != '^') return base;
+    (*expr)++;
+    return cas_pow(base, cas_unary(expr));
+}
+
+int cas_unary(const char** expr) {
+    while (is_space(**expr)) (*expr)++;
+    if (**expr == '-') {
+        (*expr)++;
+        return cas_mul(cas_minus_one, cas_unary(expr));
+    }
+    if (**expr == '+') (*expr)++;
+    return cas_power(expr);
+}
+
+int cas_term(const char** expr) {
+    int left = cas_unary(expr);
+    while (!eval_error) {
+        while (is_space(**expr)) (*expr)++;
+        char op = **expr;
+        if (op == '*') {
+            (*expr)++;
+            left = cas_mul(left, cas_unary(expr));
+        } else if (op == '/') {
+            (*expr)++;
+            left = cas_mul(left, cas_pow(cas_unary(expr), cas_minus_one));
+        } else if (is_digit(op) || is_ident_start(op) || op == '(') {
+            left = cas_mul(left, cas_power(expr));
+        } else {
+            break;
+        }
+    }
+    return left;
+}
+
+int cas_expr(const char** expr) {
+    int left = cas_term(expr);
+    while (!eval_error) {
+        while (is_space(**expr)) (*expr)++;
+        char op = **expr;
+        if (op != '+' && op != '-') break;
+        (*expr)++;
+        int right = cas_term(expr);
+        left = cas_add(left, op == '-' ? cas_mul(cas_minus_one, right) : right);
+    }
+    return left;
+}
+
+// A product as a rational coefficient n/d times base^exp factors
+typedef struct {
+    Value n, d;
+    int base[CAS_MAX_FACTORS];
+    int exp[CAS_MAX_FACTORS];
+    int count;
+} CasProduct;
+
+int cas_simplify(int n);
+
+void cas_collect_factors(CasProduct* p, int n) {
+    CasNode* node = &cas_nodes[n];
+    if (node->kind == CAS_MUL) {
+        cas_collect_factors(p, node->a);
+        cas_collect_factors(p, node->b);
+        return;
+    }
+    if (node->kind == CAS_NUM) {
+        p->n = eval_check(value_mul(p->n, node->value));
+        return;
+    }
+    if (node->kind == CAS_POW && cas_nodes[node->a].kind == CAS_NUM && cas_is_num(node->b, -1)) {
+        p->d = eval_check(value_mul(p->d, cas_nodes[node->a].value));
+        return;
+    }
+    int base = node->kind == CAS_POW ? node->a : n;
+    int exp = node->kind == CAS_POW ? node->b : cas_one;
+    for (int i = 0; i < p->count; i++) {
+        if (p->base[i] == base) {
+            p->exp[i] = cas_simplify(cas_add(p->exp[i], exp));
+            return;
+        }
+    }
+    if (p->count == CAS_MAX_FACTORS) {
+        eval_fail("Expression too complex");
+        return;
+    }
+    p->base[p->count] = base;
+    p->exp[p->count++] = exp;
+}
+
+// n/d * rest in canonical form; rest < 0 means no other factors
+int cas_scaled(Value n, Value d, int rest) {
+    Value g = value_gcd(n, d);
+    n = eval_check(value_div(n, g));
+    d = eval_check(value_div(d, g));
+    if (value_sign(d) < 0) {
+        n = eval_check(value_neg(n));
+        d = eval_check(value_neg(d));
+    }
+    if (n == VALUE_SMALL(0)) return cas_zero;
+    // Coefficient first, then the denominator, then the other factors
+    int coef = -1;
+    if (n != VALUE_SMALL(1) || (rest < 0 && d == VALUE_SMALL(1))) coef = cas_num(n);
+    if (d != VALUE_SMALL(1)) {
+        int inv = cas_pow(cas_num(d), cas_minus_one);
+        coef = coef < 0 ? inv : cas_mul(coef, inv);
+    }
+    if (coef < 0) return rest;
+    return rest < 0 ? coef : cas_mul(coef, rest);
+}
+
+// The factors of p without its coefficient, sorted so equal products
+// hash-cons to one node; -1 if there are none
+int cas_product_rest(CasProduct* p) {
+    for (int i = 1; i < p->count; i++) {
+        for (int j = i; j > 0 && p->base[j - 1] > p->base[j]; j--) {
+            int t = p->base[j]; p->base[j] = p->base[j - 1]; p->base[j - 1] = t;
+            t = p->exp[j]; p->exp[j] = p->exp[j - 1]; p->exp[j - 1] = t;
+        }
+    }
+    int rest = -1;
+    for (int i = 0; i < p->count; i++) {
+        if (cas_is_num(p->exp[i], 0)) continue;
+        int f = cas_is_num(p->exp[i], 1) ? p->base[i] : cas_pow(p->base[i], p->exp[i]);
+        rest = rest < 0 ? f : cas_mul(rest, f);
+    }
+    return rest;
+}
+
+void cas_product_init(CasProduct* p) {
+    p->n = VALUE_SMALL(1);
+    p->d = VALUE_SMALL(1);
+    p->count = 0;
+}
+
+int cas_simplify_mul(int n) {
+    CasProduct p;
+    cas_product_init(&p);
+    cas_collect_factors(&p, n);
+    if (p.n == VALUE_SMALL(0)) return cas_zero;
+    // Re-simplify factors whose exponents were combined, such as x^2 * x^-2
+    for (int i = 0; i < p.count; i++) {
+        if (!cas_is_num(p.exp[i], 1) && !cas_is_num(p.exp[i], 0)) {
+            int f = cas_simplify(cas_pow(p.base[i], p.exp[i]));
+            if (cas_nodes[f].kind != CAS_POW || cas_nodes[f].a != p.base[i]) {
+                p.exp[i] = cas_zero;
+                CasProduct q;
+                cas_product_init(&q);
+                cas_collect_factors(&q, f);
+                p.n = eval_check(value_mul(p.n, q.n));
+                p.d = eval_check(value_mul(p.d, q.d));
+                for (int j = 0; j < q.count && !eval_error; j++) {
+                    if (p.count == CAS_MAX_FACTORS) {
+                        eval_fail("Expression too complex");
+                        break;
+                    }
+                    p.base[p.count] = q.base[j];
+                    p.exp[p.count++] = q.exp[j];
+                }
+            }
+        }
+    }
+    return cas_scaled(p.n, p.d, cas_product_rest(&p));
+}
+
+int cas_simplify_add(int n) {
+    int rest[CAS_MAX_FACTORS];
+    Value num[CAS_MAX_FACTORS], den[CAS_MAX_FACTORS];
+    int count = 0;
+    int stack[CAS_MAX_FACTORS], depth = 0;
+    Value scale_n[CAS_MAX_FACTORS], scale_d[CAS_MAX_FACTORS];
+    stack[depth] = n;
+    scale_n[depth] = VALUE_SMALL(1);
+    scale_d[depth++] = VALUE_SMALL(1);
+    while (depth > 0 && !eval_error) {
+        depth--;
+        int t = stack[depth];
+        
+        // Split the term into its coefficient and the rest; a sum times a
+        // number is distributed, so a - b - (a - b) cancels
+        CasProduct p;
+        cas_product_init(&p);
+        p.n = scale_n[depth];
+        p.d = scale_d[depth];
+        int r = t;
+        if (cas_nodes[t].kind != CAS_ADD) {
+            cas_collect_factors(&p, t);
+            r = cas_product_rest(&p);
+        }
+        if (r >= 0 && cas_nodes[r].kind == CAS_ADD) {
+            if (depth + 2 > CAS_MAX_FACTORS) {
+                eval_fail("Expression too complex");
+                break;
+            }
+            for (int i = 0; i < 2; i++) {
+                stack[depth] = i ? cas_nodes[r].a : cas_nodes[r].b;
+                scale_n[depth] = p.n;
+                scale_d[depth++] = p.d;
+            }
+            continue;
+        }
+        int i = 0;
+        while (i < count && rest[i] != r) i++;
+        if (i == count) {
+            if (count == CAS_MAX_FACTORS) {
+                eval_fail("Expression too complex");
+                break;
+            }
+            rest[count] = r;
+            num[count] = p.n;
+            den[count++] = p.d;
+        } else {
+            num[i] = eval_check(value_add(value_mul(num[i], p.d), value_mul(p.n, den[i])));
+            den[i] = eval_check(value_mul(den[i], p.d));
+        }
+    }
+    if (eval_error) return cas_zero;
+    
+    // Variable terms in node order, the constant last
+    for (int i = 1; i < count; i++) {
+        for (int j = i; j > 0 && (unsigned)rest[j - 1] > (unsigned)rest[j]; j--) {
+            int t = rest[j]; rest[j] = rest[j - 1]; rest[j - 1] = t;
+            Value v = num[j]; num[j] = num[j - 1]; num[j - 1] = v;
+            v = den[j]; den[j] = den[j - 1]; den[j - 1] = v;
+        }
+    }
+    int sum = -1;
+    for (int i = 0; i < count; i++) {
+        if (num[i] == VALUE_SMALL(0)) continue;
+        int term = cas_scaled(num[i], den[i], rest[i]);
+        sum = sum < 0 ? term : cas_add(sum, term);
+    }
+    return sum < 0 ? cas_zero : sum;
+}
+
+int cas_simplify_pow(int n) {
+    int base = cas_simplify(cas_nodes[n].a), exp = cas_simplify(cas_nodes[n].b);
+    CasNode* b = &cas_nodes[base];
+    CasNode* e = &cas_nodes[exp];
+    if (cas_is_num(exp, 0)) return cas_one;
+    if (cas_is_num(exp, 1)) return base;
+    if (cas_is_num(base, 1)) return cas_one;
+    if (e->kind != CAS_NUM) return cas_pow(base, exp);
+    
+    if (b->kind == CAS_NUM) {
+        if (base == cas_zero) {
+            if (value_sign(e->value) < 0) eval_fail("Division by zero");
+            return cas_zero;
+        }
+        if (value_sign(e->value) > 0) {
+            Value v = value_pow(b->value, e->value);
+            return v ? cas_num(v) : cas_pow(base, exp);
+        }
+        // n^-k is kept as (n^k)^-1, the form products use for denominators
+        if (exp == cas_minus_one) return cas_pow(base, exp);
+        Value v = value_pow(b->value, value_neg(e->value));
+        return v ? cas_pow(cas_num(v), cas_minus_one) : cas_pow(base, exp);
+    }
+    // (a^m)^n = a^(mn) for an integer n, and (ab)^n = a^n b^n
+    if (b->kind == CAS_POW) {
+        return cas_simplify(cas_pow(b->a, cas_mul(b->b, exp)));
+    }
+    if (b->kind == CAS_MUL) {
+        return cas_simplify(cas_mul(cas_pow(b->a, exp), cas_pow(b->b, exp)));
+    }
+    return cas_pow(base, exp);
+}
+
+int cas_simplify_fn(int n) {
+    int fn = cas_nodes[n].value;
+    int a = cas_simplify(cas_nodes[n].a);
+    CasNode* arg = &cas_nodes[a];
+    if (a == cas_zero && (fn == FN_SIN || fn == FN_COS || fn == FN_EXP)) {
+        return fn == FN_SIN ? cas_zero : cas_one;
+    }
+    if (fn == FN_LN && a == cas_one) return cas_zero;
+    if (fn == FN_LN && arg->kind == CAS_FUNC && arg->value == FN_EXP) return arg->a;
+    if (fn == FN_EXP && arg->kind == CAS_FUNC && arg->value == FN_LN) return arg->a;
+    return cas_fn(fn, a);
+}
+
+// Rewrite bottom-up into a canonical form: constants folded, like terms and
+// like factors combined, products and sums flattened and sorted
+int cas_simplify(int n) {
+    if (eval_error) return cas_zero;
+    if (cas_simplified[n] >= 0) return cas_simplified[n];
+    int r;
+    switch (cas_nodes[n].kind) {
+        case CAS_ADD:
+            cas_simplify(cas_nodes[n].a);
+            cas_simplify(cas_nodes[n].b);
+            r = cas_simplify_add(cas_add(cas_simplified[cas_nodes[n].a], cas_simplified[cas_nodes[n].b]));
+            break;
+        case CAS_MUL:
+            cas_simplify(cas_nodes[n].a);
+            cas_simplify(cas_nodes[n].b);
+            r = cas_simplify_mul(cas_mul(cas_simplified[cas_nodes[n].a], cas_simplified[cas_nodes[n].b]));
+            break;
+        case CAS_POW: r = cas_simplify_pow(n); break;
+        case CAS_FUNC: r = cas_simplify_fn(n); break;
+        default: r = n; break;
+    }
+    if (eval_error) return cas_zero;
+    cas_simplified[n] = r;
+    cas_simplified[r] = r;
+    return r;
+}
+
+// d/dvar, memoized so each shared node is differentiated once and the
+// result stays a DAG of linear size
+int cas_diff(int n, int var) {
+    if (eval_error) return cas_zero;
+    if (cas_derivative[n] >= 0) return cas_derivative[n];
+    CasNode* node = &cas_nodes[n];
+    int a = node->a, b = node->b, r = cas_zero;
+    switch (node->kind) {
+        case CAS_NUM:
+            break;
+        case CAS_VAR:
+            r = n == var ? cas_one : cas_zero;
+            break;
+        case CAS_ADD:
+            r = cas_add(cas_diff(a, var), cas_diff(b, var));
+            break;
+        case CAS_MUL:
+            r = cas_add(cas_mul(cas_diff(a, var), b), cas_mul(a, cas_diff(b, var)));
+            break;
+        case CAS_POW: {
+            int da = cas_diff(a, var), db = cas_simplify(cas_diff(b, var));
+            if (db == cas_zero) {
+                // b * a^(b - 1) * a'
+                r = cas_mul(cas_mul(b, cas_pow(a, cas_add(b, cas_minus_one))), da);
+            } else {
+                // a^b * (b' ln a + b a' / a)
+                r = cas_mul(n, cas_add(cas_mul(db, cas_fn(FN_LN, a)),
+                                       cas_mul(b, cas_mul(da, cas_pow(a, cas_minus_one)))));
+            }
+            break;
+        }
+        case CAS_FUNC: {
+            int da = cas_diff(a, var);
+            switch (node->value) {
+                case FN_SIN: r = cas_mul(cas_fn(FN_COS, a), da); break;
+                case FN_COS: r = cas_mul(cas_minus_one, cas_mul(cas_fn(FN_SIN, a), da)); break;
+                case FN_EXP: r = cas_mul(n, da); break;
+                case FN_LN: r = cas_mul(da, cas_pow(a, cas_minus_one)); break;
+            }
+            break;
+        }
+    }
+    if (eval_error) return cas_zero;
+    cas_derivative[n] = r;
+    return r;
+}
+
+// Printing. Results whose tree would exceed CAS_PRINT_NODES print each
+// shared subexpression once as #k = ... and refer to it by label.
+enum { PREC_ADD = 1, PREC_MUL, PREC_POW, PREC_ATOM };
+
+void cas_print(int n, int prec);
+
+// Printed size of the tree under n, saturating
+uint32_t cas_tree_size(int n, uint32_t* memo) {
+    if (memo[n]) return memo[n];
+    CasNode* node = &cas_nodes[n];
+    uint32_t size = 1;
+    if (node->a >= 0) size += cas_tree_size(node->a, memo);
+    if (node->b >= 0) size += cas_tree_size(node->b, memo);
+    if (size > 1000000) size = 1000000;
+    return memo[n] = size;
+}
+
+// Negative leading coefficient of a product, printed as subtraction
+int cas_negative(int n) {
+    CasNode* node = &cas_nodes[n];
+    while (node->kind == CAS_MUL && cas_label[n] < 0) {
+        n = node->a;
+        node = &cas_nodes[n];
+    }
+    return node->kind == CAS_NUM && value_sign(node->value) < 0;
+}
+
+void cas_print_product(int n, int prec, int negate);
+
+void cas_print_sum(int n, int first) {
+    CasNode* node = &cas_nodes[n];
+    if (node->kind == CAS_ADD && cas_label[n] < 0) {
+        cas_print_sum(node->a, first);
+        cas_print_sum(node->b, 0);
+        return;
+    }
+    if (first) {
+        cas_print(n, PREC_ADD);
+    } else if (!cas_negative(n)) {
+        print(" + ");
+        cas_print(n, PREC_ADD);
+    } else {
+        // a + (-k)*b prints as a - k*b
+        print(" - ");
+        if (node->kind == CAS_NUM) print_value(value_neg(node->value));
+        else cas_print_product(n, PREC_ADD, 1);
+    }
+}
+
+// x^-k for a numeric k > 0 prints in the denominator
+int cas_is_denominator(int n) {
+    CasNode* node = &cas_nodes[n];
+    return node->kind == CAS_POW && cas_label[n] < 0 && cas_nodes[node->b].kind == CAS_NUM &&
+           value_sign(cas_nodes[node->b].value) < 0;
+}
+
+int cas_count_factors(int n, int den) {
+    CasNode* node = &cas_nodes[n];
+    if (node->kind == CAS_MUL && cas_label[n] < 0) {
+        return cas_count_factors(node->a, den) + cas_count_factors(node->b, den);
+    }
+    return cas_is_denominator(n) == den;
+}
+
+// Print the factors of a product chain: the numerator when den is 0, the
+// denominator (factors with negative exponents) when den is 1. nums is the
+// number of numerator factors; negate flips the sign of the coefficient.
+int cas_print_factors(int n, int den, int nums, int count, int negate) {
+    CasNode* node = &cas_nodes[n];
+    if (node->kind == CAS_MUL && cas_label[n] < 0) {
+        count = cas_print_factors(node->a, den, nums, count, negate);
+        return cas_print_factors(node->b, den, nums, count, negate);
+    }
+    if (cas_is_denominator(n) != den) return count;
+    if (count == 0 && !den && node->kind == CAS_NUM) {
+        Value v = negate ? value_neg(node->value) : node->value;
+        // A unit coefficient is implied: -x rather than -1*x
+        if (nums > 1 && (v == VALUE_SMALL(1) || v == VALUE_SMALL(-1))) {
+            if (v == VALUE_SMALL(-1)) print("-");
+            return -1;
+        }
+        print_value(v);
+        return 1;
+    }
+    if (count > 0) print("*");
+    if (den && !cas_is_num(node->b, -1)) {
+        cas_print(node->a, PREC_ATOM);
+        print("^");
+        print_value(value_neg(cas_nodes[node->b].value));
+    } else {
+        cas_print(den ? node->a : n, PREC_POW);
+    }
+    return count < 0 ? 1 : count + 1;
+}
+
+void cas_print_product(int n, int prec, int negate) {
+    CasNode* node = &cas_nodes[n];
+    int nums = cas_count_factors(n, 0), dens = cas_count_factors(n, 1);
+    if (node->kind == CAS_POW && !dens) {
+        int paren = prec == PREC_ATOM;
+        if (paren) print("(");
+        cas_print(node->a, PREC_ATOM);
+        print("^");
+        cas_print(node->b, PREC_ATOM);
+        if (paren) print(")");
+        return;
+    }
+    int paren = prec > PREC_MUL || (prec == PREC_MUL && !negate && cas_negative(n));
+    if (paren) print("(");
+    if (nums > 0) cas_print_factors(n, 0, nums, 0, negate);
+    else print("1");
+    if (dens > 0) {
+        print("/");
+        if (dens > 1) print("(");
+        cas_print_factors(n, 1, nums, 0, 0);
+        if (dens > 1) print(")");
+    }
+    if (paren) print(")");
+}
+
+void cas_print(int n, int prec) {
+    CasNode* node = &cas_nodes[n];
+    if (cas_label[n] > 0) {
+        print("#");
+        print_num(cas_label[n]);
+        return;
+    }
+    switch (node->kind) {
+        case CAS_NUM:
+            if (prec > PREC_ADD && value_sign(node->value) < 0) {
+                print("(");
+                print_value(node->value);
+                print(")");
+            } else {
+                print_value(node->value);
+            }
+            return;
+        case CAS_VAR:
+            print(cas_var_names[node->value]);
+            return;
+        case CAS_FUNC:
+            print(cas_fn_names[node->value]);
+            print("(");
+            cas_print(node->a, 0);
+            print(")");
+            return;
+        case CAS_ADD:
+            if (prec > PREC_ADD) print("(");
+            cas_print_sum(n, 1);
+            if (prec > PREC_ADD) print(")");
+            return;
+        default:
+            cas_print_product(n, prec, 0);
+            return;
+    }
+}
+
+// Count parents of each node reachable from n, visiting each node once
+void cas_count_uses(int n) {
+    if (cas_uses[n]++ > 0) return;
+    if (cas_nodes[n].a >= 0) cas_count_uses(cas_nodes[n].a);
+    if (cas_nodes[n].b >= 0) cas_count_uses(cas_nodes[n].b);
+}
+
+// Print definitions for the labeled nodes under n, children first
+void cas_print_shared(int n, int* next_label, uint8_t* visited) {
+    if (visited[n]) return;
+    visited[n] = 1;
+    if (cas_nodes[n].a >= 0) cas_print_shared(cas_nodes[n].a, next_label, visited);
+    if (cas_nodes[n].b >= 0) cas_print_shared(cas_nodes[n].b, next_label, visited);
+    if (cas_label[n] != 0) return;
+    uint32_t kind = cas_nodes[n].kind;
+    if (cas_uses[n] > 1 && kind != CAS_NUM && kind != CAS_VAR) {
+        cas_label[n] = *next_label;
+        print("  #");
+        print_num((*next_label)++);
+        print(" = ");
+        cas_label[n] = -1;
+        cas_print(n, 0);
+        cas_label[n] = *next_label - 1;
+        print("\n");
+    }
+}
+
+void cas_print_result(const char* label, int n) {
+    static uint32_t sizes[CAS_MAX_NODES];
+    static uint8_t visited[CAS_MAX_NODES];
+    memset(cas_label, 0xFF, sizeof(cas_label));
+    memset(sizes, 0, sizeof(sizes));
+    if (cas_tree_size(n, sizes) > CAS_PRINT_NODES) {
+        memset(cas_uses, 0, sizeof(cas_uses));
+        memset(visited, 0, sizeof(visited));
+        memset(cas_label, 0, sizeof(cas_label));
+        cas_count_uses(n);
+        cas_uses[n] = 1;
+        int next_label = 1;
+        print("where\n");
+        cas_print_shared(n, &next_label, visited);
+        for (int i = 0; i < cas_count; i++) {
+            if (cas_label[i] == 0) cas_label[i] = -1;
+        }
+    }
+    print(label);
+    cas_print(n, 0);
+    print("\n");
+}
+
+// algebra simplify <expr> | algebra diff <expr>[, var]
+void cmd_algebra_symbolic(int is_diff, const char* expr) {
+    cas_reset();
+    eval_error = 0;
+    int n = cas_expr(&expr);
+    int var = -1;
+    while (is_space(*expr)) expr++;
+    if (is_diff && *expr == ',') {
+        expr++;
+        while (is_space(*expr)) expr++;
+        const char* name = expr;
+        while (is_ident_char(*expr)) expr++;
+        if (expr == name || !is_ident_start(*name)) eval_fail("Expected a variable after ','");
+        else var = cas_var(name, expr - name);
+        while (is_space(*expr)) expr++;
+    }
+    if (!eval_error && *expr) eval_fail("Unexpected text after expression");
+    if (eval_error) return;
+    if (is_diff && var < 0) var = cas_var("x", 1);
+    
+    n = cas_simplify(n);
+    if (is_diff) n = cas_simplify(cas_diff(n, var));
+    if (eval_error) return;
+    
+    char label[MAX_VARNAME + 8] = "Result: ";
+    if (is_diff) {
+        strcpy(label, "d/d");
+        strcat(label, cas_var_names[cas_nodes[var].value]);
+        strcat(label, ": ");
+    }
+    cas_print_result(label, n);
+}
+
+// Process escape sequences in strings
+void process_escape_sequences(char* str) {
+    int read = 0, write = 0;
+    while (str[read]) {
+        if (str[read] == '\\' && str[read + 1]) {
+            if (str[read + 1] == 'n') {
+                str[write++] = '\n';
+                read += 2;
+            } else if (str[read + 1] == 't') {
+                str[write++] = '\t';
+                read += 2;
+            } else if (str[read + 1] == '\\') {
+                str[write++] = '\\';
+                read += 2;
+            } else if (str[read + 1] == '"') {
+                str[write++] = '"';
+                read += 2;
+            } else {
+                str[write++] = str[read++];
+            }
+        } else {
+            str[write++] = str[read++];
+        }
+    }
+    str[write] = '\0';
+}
+
+void cmd_algebra_jit(const char* args);
+
+// Evaluate "let name = expr" into the shell variables; returns 0 on success
+int assign_variable(const char* name, const char* rhs, Value* result) {
+    eval_error = 0;
+    *result = eval_expr(rhs);
+    if (eval_error) return -1;
+    
+    Value stored = value_persist(*result);
+    if (!stored) {
+        print("Error: ");
+        print(value_error);
+        print("\n");
+        return -1;
+    }
+    
+    int len = strlen(name);
+    Symbol* s = symbol_lookup(&variables, name, len, symbol_hash(name, len), 1);
+    if (!s) {
+        print("Error: Too many variables\n");
+        return -1;
+    }
+    s->value = stored;
+    matrix_var_remove(name, len);
+    return 0;
+}
+
+void cmd_algebra(const char* expr) {
+    if (strlen(expr) == 0) {
+        print("Usage: algebra <expression> or algebra <equation>, e.g. 3x + 2 = x - 4\n");
+        print("       algebra let <name> = <expression>\n");
+        print("       algebra -jit [on | off | <expression>]\n");
+        print("       algebra -f <expression>  (floating point, sqrt(x))\n");
+        print("       algebra [1 2; 3 4] * B, A', det A, solve A b  (matrices)\n");
+        print("       algebra simplify <expr>, algebra diff <expr>[, var]\n");
+        print("Operators: + - * / ^ ! (integers of any size)\n");
+        return;
+    }
+    
+    if (strncmp(expr, "-jit", 4) == 0 && (expr[4] == '\0' || is_space(expr[4]))) {
+        expr += 4;
+        while (is_space(*expr)) expr++;
+        cmd_algebra_jit(expr);
+        return;
+    }
+    
+    if (strncmp(expr, "-f", 2) == 0 && (expr[2] == '\0' || is_space(expr[2]))) {
+        cmd_algebra_float(expr + 2);
+        return;
+    }
+    
+    int is_diff = strncmp(expr, "diff", 4) == 0 && is_space(expr[4]);
+    if (is_diff || (strncmp(expr, "simplify", 8) == 0 && is_space(expr[8]))) {
+        cmd_algebra_symbolic(is_diff, expr + (is_diff ? 4 : 8));
+        return;
+    }
+    
+    char name[MAX_VARNAME];
+    const char* rhs;
+    int is_assignment = parse_assignment(expr, name, &rhs);
+    if (matrix_syntax(is_assignment ? rhs : expr)) {
+        cmd_algebra_matrix(is_assignment ? name : 0, is_assignment ? rhs : expr);
+        return;
+    }
+    if (is_assignment) {
+        Value value;
+        if (assign_variable(name, rhs, &value) == 0) {
+            print(name);
+            print(" = ");
+            print_value(value);
+            print("\n");
+        }
+        return;
+    }
+    
+    int has_x = 0, has_eq = 0;
+    for (int i = 0; expr[i]; i++) {
+        if (expr[i] == 'x') has_x = 1;
+        if (expr[i] == '=') has_eq = 1;
+    }
+    
+    if (has_x && has_eq) {
+        solve_equation(expr);
+    } else {
+        eval_error = 0;
+        Value result = eval_expr(expr);
+        if (eval_error) return;
+        print("Result: ");
+        print_value(result);
+        print("\n");
+    }
+}
+
+void cmd_algebra_writeline(const char* args) {
+    char filename[MAX_FILENAME];
+    const char* expr = args;
+    int i = 0;
+    
+    while (*expr && !is_space(*expr) && i < MAX_FILENAME - 1) {
+        filename[i++] = *expr++;
+    }
+    filename[i] = '\0';
+    
+    while (is_space(*expr)) expr++;
+    
+    if (strlen(filename) == 0 || strlen(expr) == 0) {
+        print("Usage: algebra-writeline <filename> <expression>\n");
+        return;
+    }
+    
+    Value result;
+    int has_x = 0, has_eq = 0;
+    for (int j = 0; expr[j]; j++) {
+        if (expr[j] == 'x') has_x = 1;
+        if (expr[j] == '=') has_eq = 1;
+    }
+    
+    // The text to append, without its final newline
+    char* result_str = 0;
+    uint32_t len = 0;
+    char name[MAX_VARNAME];
+    const char* rhs;
+    if (parse_assignment(expr, name, &rhs)) {
+        if (assign_variable(name, rhs, &result) != 0) return;
+    } else if (has_x && has_eq) {
+        if (solve_equation_text(expr) != 0) return;
+        result_str = solve_text;
+        len = solve_len - 1;
+    } else {
+        eval_error = 0;
+        result = eval_expr(expr);
+        if (eval_error) return;
+    }
+    
+    if (!result_str) {
+        result_str = value_to_decimal(result, &len);
+        if (!result_str) {
+            print("Error: ");
+            print(value_error);
+            print("\n");
+            return;
+        }
+    }
+    
+    int idx = find_file(filename, current_dir_id);
+    if (idx < 0) idx = create_file(filename, current_dir_id);
+    
+    if (idx < 0) {
+        print("Error: Cannot create file\n");
+        return;
+    }
+    
+    if (file_append(idx, result_str, len) == 0 && file_append(idx, "\n", 1) == 0) {
+        print("Result written to ");
+        print(filename);
+        print("\n");
+    } else {
+        print("Error: ");
+        print(fs_error);
+        print("\n");
+    }
+}
+
+void cmd_cat(const char* filename) {
+    if (strlen(filename) == 0) {
+        print("Usage: cat <filename>\n");
+        return;
+    }
+    
+    int idx = find_file(filename, current_dir_id);
+    if (idx >= 0 && files[idx].inode) {
+        // Files on disk come through a block-sized buffer
+        char buf[AFS_BLOCK_SIZE];
+        uint32_t n = 0;
+        for (uint32_t pos = 0; pos < files[idx].size; pos += n) {
+            n = file_read(idx, pos, buf, sizeof(buf));
+            if (n == 0) break;
+            for (uint32_t i = 0; i < n; i++) {
+                putchar(buf[i]);
+            }
+        }
+        if (n > 0 && buf[n - 1] != '\n') {
+            putchar('\n');
+        }
+    } else if (idx >= 0) {
+        for (Extent* e = files[idx].head; e; e = e->next) {
+            for (uint32_t i = 0; i < e->used; i++) {
+                putchar(e->data[i]);
+            }
+        }
+        Extent* tail = files[idx].tail;
+        if (tail && tail->used > 0 && tail->data[tail->used - 1] != '\n') {
+            putchar('\n');
+        }
+    } else {
+        print("Error: File not found: ");
+        print(filename);
+        print("\n");
+    }
+}
+
+// Atom editor state
+//
+// The text is kept in a gap buffer from the kernel heap: the bytes before
+// gap_start, an unused gap up to gap_end, then the rest of the text. Edits
+// happen at the gap, which is moved to the cursor first, so typing costs
+// the distance the cursor moved rather than the size of the file.
+#define ATOM_MIN_GAP 1024
+
+typedef struct {
+    char filename[MAX_FILENAME];
+    char* buffer;
+    int capacity;
+    int gap_start;
+    int gap_end;
+    int buffer_size;            // Text length, capacity minus the gap
+    int* lines;                 // Line index (see atom_line_start)
+    int line_count;
+    int line_capacity;
+    int line_gap;               // Lines stored before the split
+    int cursor_pos;
+    int view_offset;            // First line on the screen
+    int view_segment;           // and its first row, for wrapped lines
+    int modified;
+    char* clipboard;
+    int clipboard_size;
+    int select_start;
+    int select_end;
+} AtomEditor;
+
+static AtomEditor atom_state;
+
+// Character i of the text
+char atom_char(int i) {
+    return atom_state.buffer[i < atom_state.gap_start ? i : i + atom_state.gap_end - atom_state.gap_start];
+}
+
+// Move the gap to the cursor
+void atom_move_gap() {
+    char* b = atom_state.buffer;
+    while (atom_state.gap_start > atom_state.cursor_pos) {
+        b[--atom_state.gap_end] = b[--atom_state.gap_start];
+    }
+    while (atom_state.gap_start < atom_state.cursor_pos) {
+        b[atom_state.gap_start++] = b[atom_state.gap_end++];
+    }
+}
+
+// Make the gap at least n bytes; -1 if out of memory
+int atom_reserve(int n) {
+    if (atom_state.gap_end - atom_state.gap_start >= n) return 0;
+    int tail = atom_state.capacity - atom_state.gap_end;
+    int capacity = atom_state.capacity * 2 + n + ATOM_MIN_GAP;
+    char* b = kmalloc(capacity);
+    if (!b) return -1;
+    if (atom_state.buffer) {
+        memcpy(b, atom_state.buffer, atom_state.gap_start);
+        memcpy(b + capacity - tail, atom_state.buffer + atom_state.gap_end, tail);
+        kfree(atom_state.buffer);
+    }
+    atom_state.buffer = b;
+    atom_state.gap_end = capacity - tail;
+    atom_state.capacity = capacity;
+    return 0;
+}
+
+// Line index, split at the edit point the same way the text is. Lines
+// before line_gap store their start offsets; the rest sit at the end of
+// the array and store their distance from the end of the text, so an edit
+// on line l leaves every entry alone once the split is after l (see
+// atom_index_split). Finding a line is a binary search.
+int atom_line_start(int l) {
+    if (l < atom_state.line_gap) return atom_state.lines[l];
+    return atom_state.buffer_size - atom_state.lines[l + atom_state.line_capacity - atom_state.line_count];
+}
+
+// Put lines 0 to l before the split; call before the text changes
+void atom_index_split(int l) {
+    int* lines = atom_state.lines;
+    int back = atom_state.line_capacity - atom_state.line_count;   // Index shift of the back half
+    while (atom_state.line_gap > l + 1) {
+        atom_state.line_gap--;
+        lines[atom_state.line_gap + back] = atom_state.buffer_size - lines[atom_state.line_gap];
+    }
+    while (atom_state.line_gap < l + 1 && atom_state.line_gap < atom_state.line_count) {
+        lines[atom_state.line_gap] = atom_state.buffer_size - lines[atom_state.line_gap + back];
+        atom_state.line_gap++;
+    }
+}
+
+// Add a line starting at start right after the split; -1 if out of memory
+int atom_index_insert(int start) {
+    if (atom_state.line_count == atom_state.line_capacity) {
+        int tail = atom_state.line_count - atom_state.line_gap;
+        int capacity = atom_state.line_capacity * 2 + 64;
+        int* lines = kmalloc(capacity * sizeof(int));
+        if (!lines) return -1;
+        if (atom_state.lines) {
+            memcpy(lines, atom_state.lines, atom_state.line_gap * sizeof(int));
+            memcpy(lines + capacity - tail, atom_state.lines + atom_state.line_capacity - tail, tail * sizeof(int));
+            kfree(atom_state.lines);
+        }
+        atom_state.lines = lines;
+        atom_state.line_capacity = capacity;
+    }
+    atom_state.lines[atom_state.line_gap++] = start;
+    atom_state.line_count++;
+    return 0;
+}
+
+// Drop the first line after the split
+void atom_index_remove() {
+    atom_state.line_count--;
+}
+
+int atom_index_build() {
+    atom_state.line_count = 0;
+    atom_state.line_gap = 0;
+    if (atom_index_insert(0) < 0) return -1;
+    for (int i = 0; i < atom_state.buffer_size; i++) {
+        if (atom_char(i) == '\n' && atom_index_insert(i + 1) < 0) return -1;
+    }
+    return 0;
+}
+
+// Line containing offset pos
+int atom_line_of(int pos) {
+    int lo = 0, hi = atom_state.line_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (atom_line_start(mid) <= pos) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+int atom_line_length(int l) {
+    int end = l + 1 < atom_state.line_count ? atom_line_start(l + 1) - 1 : atom_state.buffer_size;
+    return end - atom_line_start(l);
+}
+
+// Screen rows a line takes when wrapped
+int atom_line_rows(int l) {
+    return atom_line_length(l) / VGA_WIDTH + 1;
+}
+
+// Screen layout: title, separator, text rows, separator, status bar, and
+// the bottom row for prompts. Long lines wrap onto further rows.
+#define ATOM_TEXT_TOP 3
+#define ATOM_TEXT_ROWS (VGA_HEIGHT - 3 - ATOM_TEXT_TOP)
+
+void atom_cells_str(uint16_t* cells, int* x, const char* str) {
+    while (*str && *x < VGA_WIDTH) cells[(*x)++] = (WHITE_ON_BLACK << 8) | (uint8_t)*str++;
+}
+
+void atom_cells_num(uint16_t* cells, int* x, int num) {
+    char buf[12];
+    int i = sizeof(buf) - 1;
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + num % 10;
+        num /= 10;
+    } while (num > 0);
+    atom_cells_str(cells, x, &buf[i]);
+}
+
+// Put a row on the screen, writing only the cells that differ from the
+// frame already there, so unchanged rows are never flushed
+void atom_put_row(int y, const uint16_t* cells) {
+    uint16_t* row = console_row(y);
+    for (int x = 0; x < VGA_WIDTH; x++) {
+        if (row[x] != cells[x]) console_put(x, y, cells[x]);
+    }
+}
+
+void atom_draw_status() {
+    uint16_t cells[VGA_WIDTH];
+    int x;
+    for (x = 0; x < VGA_WIDTH; x++) cells[x] = (WHITE_ON_BLACK << 8) | ' ';
+    x = 0;
+    atom_cells_str(cells, &x, "^O Save  ^X Exit  ^K Cut  ^U Paste  ^F Find  Pos: ");
+    atom_cells_num(cells, &x, atom_state.cursor_pos);
+    atom_cells_str(cells, &x, "/");
+    atom_cells_num(cells, &x, atom_state.buffer_size);
+    atom_put_row(VGA_HEIGHT - 2, cells);
+}
+
+void atom_draw_screen() {
+    uint16_t cells[VGA_WIDTH];
+    int x;
+    
+    // Keep the cursor's row inside the text area: above the view it becomes
+    // the top row, below it the bottom row
+    int cursor_line = atom_line_of(atom_state.cursor_pos);
+    int cursor_col = atom_state.cursor_pos - atom_line_start(cursor_line);
+    int cursor_segment = cursor_col / VGA_WIDTH;
+    if (cursor_line < atom_state.view_offset ||
+        (cursor_line == atom_state.view_offset && cursor_segment < atom_state.view_segment)) {
+        atom_state.view_offset = cursor_line;
+        atom_state.view_segment = cursor_segment;
+    }
+    if (atom_state.view_segment >= atom_line_rows(atom_state.view_offset)) {
+        atom_state.view_segment = atom_line_rows(atom_state.view_offset) - 1;   // The line got shorter
+    }
+    int rows = cursor_segment + 1 - atom_state.view_segment;
+    for (int l = atom_state.view_offset; l < cursor_line && rows <= ATOM_TEXT_ROWS; l++) {
+        rows += atom_line_rows(l);
+    }
+    if (rows > ATOM_TEXT_ROWS) {
+        atom_state.view_offset = cursor_line;
+        atom_state.view_segment = cursor_segment;
+        for (int n = 1; n < ATOM_TEXT_ROWS; n++) {
+            if (atom_state.view_segment > 0) {
+                atom_state.view_segment--;
+            } else if (atom_state.view_offset > 0) {
+                atom_state.view_offset--;
+                atom_state.view_segment = atom_line_rows(atom_state.view_offset) - 1;
+            }
+        }
+    }
+    
+    for (x = 0; x < VGA_WIDTH; x++) cells[x] = (WHITE_ON_BLACK << 8) | ' ';
+    atom_put_row(0, cells);
+    atom_put_row(VGA_HEIGHT - 1, cells);
+    
+    // Title bar
+    x = 0;
+    atom_cells_str(cells, &x, "  Atom Editor - ");
+    atom_cells_str(cells, &x, atom_state.filename);
+    if (atom_state.modified) atom_cells_str(cells, &x, " [Modified]");
+    atom_put_row(1, cells);
+    
+    for (x = 0; x < VGA_WIDTH; x++) cells[x] = (WHITE_ON_BLACK << 8) | '-';
+    atom_put_row(2, cells);
+    atom_put_row(ATOM_TEXT_TOP + ATOM_TEXT_ROWS, cells);
+    
+    // File content
+    int line = atom_state.view_offset;
+    int segment = atom_state.view_segment;
+    int cursor_screen_x = 0;
+    int cursor_screen_y = ATOM_TEXT_TOP;
+    for (int y = ATOM_TEXT_TOP; y < ATOM_TEXT_TOP + ATOM_TEXT_ROWS; y++) {
+        for (x = 0; x < VGA_WIDTH; x++) cells[x] = (WHITE_ON_BLACK << 8) | ' ';
+        if (line < atom_state.line_count) {
+            int length = atom_line_length(line);
+            int start = atom_line_start(line) + segment * VGA_WIDTH;
+            int count = length - segment * VGA_WIDTH;
+            if (count > VGA_WIDTH) count = VGA_WIDTH;
+            for (x = 0; x < count; x++) {
+                cells[x] = (WHITE_ON_BLACK << 8) | (uint8_t)atom_char(start + x);
+            }
+            if (line == cursor_line && segment == cursor_col / VGA_WIDTH) {
+                cursor_screen_x = cursor_col % VGA_WIDTH;
+                cursor_screen_y = y;
+            }
+            if (++segment > length / VGA_WIDTH) {
+                segment = 0;
+                line++;
+            }
+        }
+        atom_put_row(y, cells);
+    }
+    
+    atom_draw_status();
+    
+    // Leave the hardware cursor on the character at cursor_pos
+    cursor_x = cursor_screen_x;
+    cursor_y = cursor_screen_y;
+    console_flush();
+}
+
+// Move the cursor one character left or right. Within a screen row only
+// the status bar and the hardware cursor change; crossing a row or a line
+// redraws, which also scrolls the view when needed.
+void atom_move_cursor(int delta) {
+    int pos = atom_state.cursor_pos + delta;
+    if (pos < 0 || pos > atom_state.buffer_size) return;
+    char crossed = atom_char(delta < 0 ? pos : pos - 1);
+    atom_state.cursor_pos = pos;
+    int x = cursor_x + delta;
+    if (crossed == '\n' || x < 0 || x >= VGA_WIDTH) {
+        atom_draw_screen();
+        return;
+    }
+    atom_draw_status();
+    cursor_x = x;
+    console_flush();                        // The status row, then cursor_update
+}
+
+void atom_cut() {
+    // Cut from cursor position to end of line
+    atom_move_gap();
+    int line_end = atom_state.gap_end;
+    while (line_end < atom_state.capacity && 
+           atom_state.buffer[line_end] != '\n') {
+        line_end++;
+    }
+    
+    int cut_length = line_end - atom_state.gap_end;
+    if (cut_length > 0) {
+        char* clipboard = kmalloc(cut_length);
+        if (!clipboard) return;
+        kfree(atom_state.clipboard);
+        atom_state.clipboard = clipboard;
+        memcpy(clipboard, &atom_state.buffer[atom_state.gap_end], cut_length);
+        atom_state.clipboard_size = cut_length;
+        
+        // Remove from buffer by widening the gap
+        atom_index_split(atom_line_of(atom_state.cursor_pos));
+        atom_state.gap_end += cut_length;
+        atom_state.buffer_size -= cut_length;
+        atom_state.modified = 1;
+    }
+}
+
+void atom_paste() {
+    // Paste from clipboard
+    if (atom_state.clipboard_size > 0 && atom_reserve(atom_state.clipboard_size) == 0) {
+        // A cut never takes a newline, so the pasted text stays on this line
+        atom_index_split(atom_line_of(atom_state.cursor_pos));
+        atom_move_gap();
+        memcpy(&atom_state.buffer[atom_state.gap_start],
+               atom_state.clipboard,
+               atom_state.clipboard_size);
+        
+        atom_state.gap_start += atom_state.clipboard_size;
+        atom_state.buffer_size += atom_state.clipboard_size;
+        atom_state.cursor_pos += atom_state.clipboard_size;
+        atom_state.modified = 1;
+    }
+}
+
+void atom_find() {
+    // Simple find - move cursor to next occurrence
+    cursor_x = 0;
+    cursor_y = VGA_HEIGHT - 2;
+    print("\nFind: ");
+    char search[256];
+    int search_len = 0;
+    
+    // Read search string
+    while (1) {
+        char c = get_key();
+        if (c == '\n') break;
+        if (c == '\b' && search_len > 0) search_len--;
+        else if (c >= 32 && c <= 126 && search_len < 255) {
+            search[search_len++] = c;
+            putchar(c);
+        }
+    }
+    search[search_len] = '\0';
+    
+    // Find from current position
+    if (search_len > 0) {
+        for (int i = atom_state.cursor_pos + 1; i < atom_state.buffer_size; i++) {
+            int match = 1;
+            if (i + search_len <= atom_state.buffer_size) {
+                for (int j = 0; j < search_len; j++) {
+                    if (atom_char(i + j) != search[j]) {
+                        match = 0;
+                        break;
+                    }
+                }
+                if (match) {
+                    atom_state.cursor_pos = i;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Write the text to a new file and swap it in only once it is complete,
+// so a failed save leaves the file on disk as it was
+void atom_save() {
+    char tmp[MAX_FILENAME];
+    file_temp_name(current_dir_id, tmp);
+    int idx = create_file(tmp, current_dir_id);
+    if (idx < 0) return;
+
+    // The text on each side of the gap goes out as it is
+    if (file_append(idx, atom_state.buffer, atom_state.gap_start) < 0 ||
+        file_append(idx, atom_state.buffer + atom_state.gap_end,
+                    atom_state.capacity - atom_state.gap_end) < 0) {
+        remove_file(idx);
+        return;
+    }
+    if (file_replace(idx, current_dir_id, atom_state.filename) == 0) {
+        atom_state.modified = 0;
+    }
+}
+
+void atom_insert_char(char c) {
+    if (atom_reserve(1) < 0) return;
+    atom_index_split(atom_line_of(atom_state.cursor_pos));
+    if (c == '\n' && atom_index_insert(atom_state.cursor_pos + 1) < 0) return;
+    atom_move_gap();
+    atom_state.buffer[atom_state.gap_start++] = c;
+    atom_state.cursor_pos++;
+    atom_state.buffer_size++;
+    atom_state.modified = 1;
+}
+
+void atom_delete_char() {
+    if (atom_state.cursor_pos > 0) {
+        // The character before the cursor joins the gap
+        atom_index_split(atom_line_of(atom_state.cursor_pos - 1));
+        if (atom_char(atom_state.cursor_pos - 1) == '\n') atom_index_remove();
+        atom_move_gap();
+        atom_state.gap_start--;
+        atom_state.cursor_pos--;
+        atom_state.buffer_size--;
+        atom_state.modified = 1;
+    }
+}
+
+void cmd_atom(const char* filename) {
+    if (strlen(filename) == 0) {
+        print("Usage: atom <filename>\n");
+        return;
+    }
+    
+    // Initialize atom state
+    memset(&atom_state, 0, sizeof(AtomEditor));
+    strcpy(atom_state.filename, filename);
+    
+    // Load file if exists, leaving the gap at the end
+    int idx = find_file(filename, current_dir_id);
+    int size = idx >= 0 ? (int)files[idx].size : 0;
+    if (atom_reserve(size) < 0) {
+        print("Error: Out of memory\n");
+        return;
+    }
+    if (idx >= 0) {
+        // A short read would leave heap garbage in the text, and a save
+        // would write it back
+        if (file_read(idx, 0, atom_state.buffer, size) != (uint32_t)size) {
+            kfree(atom_state.buffer);
+            print("Error: ");
+            print(fs_error);
+            print("\n");
+            return;
+        }
+        atom_state.gap_start = size;
+        atom_state.buffer_size = size;
+        atom_state.cursor_pos = size;
+    }
+    if (atom_index_build() < 0) {
+        kfree(atom_state.buffer);
+        kfree(atom_state.lines);
+        print("Error: Out of memory\n");
+        return;
+    }
+    
+    clear_screen();
+    atom_draw_screen();
+    
+    // Editor loop
+    while (1) {
+        char c = get_key();
+        if (c) {
+            // Handle Ctrl key sequences
+            if (c == 15) { // Ctrl+O (Save)
+                atom_save();
+                atom_draw_screen();
+            } else if (c == 24) { // Ctrl+X (Exit)
+                if (atom_state.modified) {
+                    atom_save();
+                }
+                kfree(atom_state.buffer);
+                kfree(atom_state.clipboard);
+                kfree(atom_state.lines);
+                clear_screen();
+                return;
+            } else if (c == 11) { // Ctrl+K (Cut)
+                atom_cut();
+                atom_draw_screen();
+            } else if (c == 21) { // Ctrl+U (Paste)
+                atom_paste();
+                atom_draw_screen();
+            } else if (c == 6) { // Ctrl+F (Find)
+                atom_find();
+                atom_draw_screen();
+            } else if (c == 28) { // Left arrow - move cursor left
+                atom_move_cursor(-1);
+            } else if (c == 29) { // Right arrow - move cursor right
+                atom_move_cursor(1);
+            } else if (c == '\n') {
+                atom_insert_char('\n');
+                atom_draw_screen();
+            } else if (c == '\b') {
+                atom_delete_char();
+                atom_draw_screen();
+            } else if (c >= 32 && c <= 126) {
+                atom_insert_char(c);
+                atom_draw_screen();
+            }
+        }
+    }
+}
+
+// Bytecode image for compiled .algebra programs
+//
+// Layout: AlgbHeader | constant pool | import table | line table | text
+// table | code | bignum table | string table. All multi-byte fields are
+// little-endian, as written by the compiler.
+//
+// The string table starts with the program's source, followed by the
+// unescaped print("...") strings. Text table entries and import names are
+// ranges of it, so a statement's label is its source text and needs no
+// copy of its own.
+//
+// Code is a sequence of 32-bit register machine instructions, encoded as
+// op | a << 8 | b << 16 | c << 24 (or op | a << 8 | bx << 16). Registers
+// below ALGB_TEMP_REGS hold temporaries. The first constants of the pool
+// are preloaded into the registers above them, and the first variables get
+// slots counting down from the top register, so most operands need no
+// separate load. Once those registers run out, further variables and
+// constants spill to the register file past ALGB_MAX_REGS, which only
+// OP_GETVAR, OP_SETVAR and OP_LOADK reach, through a 16-bit index:
+//     [256, 256 + spilled vars)   variables var_regs..
+//     [.., .. + spilled consts)   constants const_regs..
+// Variables read before the program assigns them are imports, bound by
+// name from the shell variables when the program starts.
+//
+// A constant pool entry is either a small Value (odd) or the byte offset
+// of a BigInt record { sign, len, limbs[len] } in the bignum table (even),
+// which the VM uses in place.
+#define ALGB_VERSION 7
+#define ALGB_TEMP_REGS 64
+#define ALGB_MAX_REGS 256       // Addressable by 8-bit operands
+#define ALGB_SHARED_REGS (ALGB_MAX_REGS - ALGB_TEMP_REGS)  // Preloaded constants and variable slots
+#define ALGB_MAX_CONSTS 65536   // Operand bx indexes the pool
+#define ALGB_MAX_SPILLS 65536   // Variables past the registers, also indexed by bx
+#define ALGB_MAX_TEXTS 65536    // Operand bx indexes the text table
+#define ALGB_MAX_CODE (1024 * 1024)
+#define ALGB_MAX_NODES 256
+
+typedef struct {
+    char magic[4];          // "ALGB"
+    uint16_t version;
+    uint16_t header_size;
+    uint16_t const_regs;    // Constants preloaded into registers
+    uint16_t var_regs;      // Variables with register slots
+    uint32_t const_count;   // Integer constants
+    uint32_t var_count;
+    uint32_t import_count;
+    uint32_t line_count;
+    uint32_t text_count;
+    uint32_t code_size;     // Instructions
+    uint32_t bignum_size;   // Bytes
+    uint32_t string_size;   // Bytes
+} __attribute__((packed)) AlgbHeader;
+
+typedef struct {
+    uint32_t reg;           // Variable slot to initialize
+    uint32_t name_len;
+    uint32_t name;          // String table offset
+    uint32_t line;          // First use, for error reports
+    uint32_t hash;          // symbol_hash of the name, computed at build time
+} __attribute__((packed)) AlgbImport;
+
+typedef struct {
+    uint32_t pc;            // First instruction of the source line
+    uint32_t line;
+} __attribute__((packed)) AlgbLine;
+
+typedef struct {
+    uint32_t start;         // String table offset
+    uint32_t len;
+} __attribute__((packed)) AlgbText;
+
+enum {
+    OP_HALT,
+    OP_MOV,                 // R[a] = R[b]
+    OP_ADD,                 // R[a] = R[b] + R[c]
+    OP_SUB,                 // R[a] = R[b] - R[c]
+    OP_MUL,                 // R[a] = R[b] * R[c]
+    OP_DIV,                 // R[a] = R[b] / R[c]
+    OP_NEG,                 // R[a] = -R[b]
+    OP_SHL,                 // R[a] = R[b] << c
+    OP_POW,                 // R[a] = R[b] ^ R[c]
+    OP_FACT,                // R[a] = R[b]!
+    OP_PRINT_STR,           // print text bx
+    OP_PRINT_RESULT,        // print "<text bx> = R[a]"
+    OP_SOLVE,               // solve the degree-a equation with den, c[0].. in R[b]..R[b+a+1]
+    OP_LOADK,               // R[a] = constant bx, for constants past const_regs
+    OP_GETVAR,              // R[a] = spilled variable bx
+    OP_SETVAR,              // spilled variable bx = R[a]
+    OP_COUNT
+};
+
+#define ALGB_INSN(op, a, b, c) ((uint32_t)(op) | (uint32_t)(a) << 8 | (uint32_t)(b) << 16 | (uint32_t)(c) << 24)
+#define ALGB_INSN_BX(op, a, bx) ((uint32_t)(op) | (uint32_t)(a) << 8 | (uint32_t)(bx) << 16)
+
+// Expression tree built by the parser before code generation
+// Nodes are hash-consed at -O2, so a statement's nodes form a DAG.
+enum { AST_NUM, AST_VAR, AST_ADD, AST_SUB, AST_MUL, AST_DIV, AST_NEG, AST_SHL, AST_POW, AST_FACT };
+
+typedef struct {
+    uint8_t kind;
+    uint32_t value;         // Number (a Value), variable slot, or shift count
+    int16_t left;
+    int16_t right;
+    int16_t reg;            // Register holding the value once generated, or -1
+    uint16_t uses;          // References not yet generated (see compile_count_uses)
+} AstNode;
+
+// Optimization levels for build -O<n>
+#define OPT_NONE 0          // Tree as parsed
+#define OPT_FOLD 1          // Constant folding, identities, strength reduction
+#define OPT_CSE 2           // + hash-consing of identical subexpressions
+#define OPT_DEFAULT OPT_FOLD
+#define OPT_FOLD_MAX_LIMBS 32   // Larger folded constants are computed at run time
+#define AST_HASH_SIZE (ALGB_MAX_NODES * 2)
+
+enum { TOK_EOF, TOK_END, TOK_NUM, TOK_IDENT, TOK_STR, TOK_PUNCT };
+
+typedef struct {
+    const char* src;
+    uint32_t len;
+    uint32_t pos;
+    int line;
+    int error;
+
+    // Current token
+    int tok;
+    int tok_line;
+    Value tok_num;
+    char tok_punct;
+    uint32_t tok_start;
+    uint32_t tok_len;
+    uint32_t prev_end;      // End of the previously consumed token
+
+    uint32_t* consts;       // Heap arrays, grown by compile_reserve
+    uint32_t const_count, const_capacity;   // Pool entries as written to the image
+    Value* const_values;
+    uint32_t const_values_capacity;
+    int32_t* const_hash;    // Pool indexes + 1 by value, twice const_capacity
+    uint32_t const_hash_size;
+    uint32_t const_regs;
+    uint32_t* bignums;
+    uint32_t bignum_size, bignum_capacity;  // Words
+    SymbolTable scope;      // Variable name -> slot register
+    uint32_t var_count;
+    uint32_t var_regs;
+    AlgbImport* imports;
+    uint32_t import_count, import_capacity;
+    AlgbLine* lines;
+    uint32_t line_count, line_capacity;
+    AlgbText* texts;
+    uint32_t text_count, text_capacity;
+    char* strings;          // Print strings; the image puts them after the source
+    uint32_t string_size, string_capacity;
+    uint32_t* code;
+    uint32_t code_size, code_capacity;
+    AstNode nodes[ALGB_MAX_NODES];
+    int node_count;
+    int16_t node_hash[AST_HASH_SIZE];   // Node ids + 1, for hash-consing
+    uint8_t temp_busy[ALGB_TEMP_REGS];
+    int opt_level;
+} AlgrCompiler;
+
+static AlgrCompiler compiler;
+
+void compile_error(AlgrCompiler* c, const char* msg) {
+    if (c->error) return;
+    c->error = 1;
+    print("Error: line ");
+    print_num(c->tok_line);
+    print(": ");
+    print(msg);
+    print("\n");
+}
+
+// Make room for needed elements of size bytes in one of the compiler's
+// heap arrays, doubling it as it fills; returns 0 when out of memory
+int compile_reserve(AlgrCompiler* c, void** array, uint32_t* capacity, uint32_t needed, uint32_t size) {
+    if (needed <= *capacity) return 1;
+    uint32_t n = *capacity ? *capacity : 16;
+    while (n < needed) n *= 2;
+    void* p = krealloc(*array, n * size);
+    if (!p) {
+        compile_error(c, "Out of memory");
+        return 0;
+    }
+    *array = p;
+    *capacity = n;
+    return 1;
+}
+
+void compile_next(AlgrCompiler* c) {
+    const char* s = c->src;
+    c->prev_end = c->tok_start + c->tok_len;
+
+    // Skip blanks and comments ('#' or '//' up to end of line)
+    while (c->pos < c->len) {
+        char ch = s[c->pos];
+        if (is_space(ch) || ch == '\r') {
+            c->pos++;
+        } else if (ch == '#' || (ch == '/' && c->pos + 1 < c->len && s[c->pos + 1] == '/')) {
+            while (c->pos < c->len && s[c->pos] != '\n') c->pos++;
+        } else {
+            break;
+        }
+    }
+
+    c->tok_start = c->pos;
+    c->tok_line = c->line;
+    if (c->pos >= c->len) {
+        c->tok = TOK_EOF;
+        c->tok_len = 0;
+        return;
+    }
+
+    char ch = s[c->pos];
+    if (ch == '\n' || ch == ';') {
+        if (ch == '\n') c->line++;
+        c->pos++;
+        c->tok = TOK_END;
+    } else if (is_digit(ch)) {
+        while (c->pos < c->len && is_digit(s[c->pos])) c->pos++;
+        c->tok = TOK_NUM;
+        c->tok_num = value_parse_decimal(s + c->tok_start, c->pos - c->tok_start);
+        if (!c->tok_num) {
+            compile_error(c, value_error);
+            c->tok_num = VALUE_SMALL(0);
+        }
+    } else if (is_ident_start(ch)) {
+        while (c->pos < c->len && is_ident_char(s[c->pos])) c->pos++;
+        c->tok = TOK_IDENT;
+    } else if (ch == '"') {
+        c->pos++;
+        while (c->pos < c->len && s[c->pos] != '"' && s[c->pos] != '\n') {
+            if (s[c->pos] == '\\' && c->pos + 1 < c->len) c->pos++;
+            c->pos++;
+        }
+        if (c->pos >= c->len || s[c->pos] != '"') {
+            compile_error(c, "Unterminated string");
+            c->tok = TOK_EOF;
+            return;
+        }
+        c->pos++;
+        c->tok = TOK_STR;
+    } else {
+        c->pos++;
+        c->tok = TOK_PUNCT;
+        c->tok_punct = ch;
+    }
+    c->tok_len = c->pos - c->tok_start;
+}
+
+int compile_accept(AlgrCompiler* c, char punct) {
+    if (c->tok == TOK_PUNCT && c->tok_punct == punct) {
+        compile_next(c);
+        return 1;
+    }
+    return 0;
+}
+
+int compile_ident_is(AlgrCompiler* c, const char* word) {
+    int n = strlen(word);
+    return c->tok == TOK_IDENT && (int)c->tok_len == n &&
+           strncmp(c->src + c->tok_start, word, n) == 0;
+}
+
+// Create a node; at OPT_CSE an identical existing node is returned instead
+int compile_node(AlgrCompiler* c, int kind, uint32_t value, int left, int right) {
+    uint32_t slot = 0;
+    if (c->opt_level >= OPT_CSE) {
+        uint32_t h = kind * 31 + value;
+        h = h * 31 + (uint32_t)left;
+        h = (h * 31 + (uint32_t)right) * 2654435761u;
+        slot = h & (AST_HASH_SIZE - 1);
+        while (c->node_hash[slot]) {
+            AstNode* n = &c->nodes[c->node_hash[slot] - 1];
+            if (n->kind == kind && n->value == value && n->left == left && n->right == right) {
+                return c->node_hash[slot] - 1;
+            }
+            slot = (slot + 1) & (AST_HASH_SIZE - 1);
+        }
+    }
+
+    if (c->node_count >= ALGB_MAX_NODES) {
+        compile_error(c, "Expression too complex");
+        return 0;
+    }
+    int id = c->node_count++;
+    AstNode* n = &c->nodes[id];
+    n->kind = kind;
+    n->value = value;
+    n->left = left;
+    n->right = right;
+    n->reg = -1;
+    n->uses = 0;
+    if (c->opt_level >= OPT_CSE) c->node_hash[slot] = id + 1;
+    return id;
+}
+
+int compile_is_num(AlgrCompiler* c, int node, int32_t value) {
+    return c->nodes[node].kind == AST_NUM && c->nodes[node].value == VALUE_SMALL(value);
+}
+
+// Constant node for a folded result, or -1 to leave the operation to run
+// time: failures (division by zero) become runtime errors there, and huge
+// results are cheaper to compute than to store in the image
+int compile_folded(AlgrCompiler* c, Value v) {
+    if (!v || (!VALUE_IS_SMALL(v) && VALUE_BIG(v)->len > OPT_FOLD_MAX_LIMBS)) return -1;
+    return compile_node(c, AST_NUM, v, -1, -1);
+}
+
+// Build an operator node, folding constants and applying algebraic
+// identities and strength reduction first when optimizing
+int compile_operator(AlgrCompiler* c, int kind, int left, int right) {
+    if (c->error || c->opt_level < OPT_FOLD) return compile_node(c, kind, 0, left, right);
+
+    AstNode* l = &c->nodes[left];
+    int folded;
+    if (kind == AST_FACT) {
+        if (l->kind == AST_NUM && (folded = compile_folded(c, value_factorial(l->value))) >= 0) return folded;
+        return compile_node(c, kind, 0, left, -1);
+    }
+    if (kind == AST_NEG) {
+        if (l->kind == AST_NUM && (folded = compile_folded(c, value_neg(l->value))) >= 0) return folded;
+        if (l->kind == AST_NEG) return l->left;      // -(-x)
+        return compile_node(c, kind, 0, left, -1);
+    }
+
+    AstNode* r = &c->nodes[right];
+    if (l->kind == AST_NUM && r->kind == AST_NUM) {
+        Value a = l->value, b = r->value, v = VALUE_ERROR;
+        switch (kind) {
+            case AST_ADD: v = value_add(a, b); break;
+            case AST_SUB: v = value_sub(a, b); break;
+            case AST_MUL: v = value_mul(a, b); break;
+            case AST_DIV: v = value_div(a, b); break;
+            case AST_POW: v = value_pow(a, b); break;
+        }
+        if ((folded = compile_folded(c, v)) >= 0) return folded;
+    }
+
+    // Canonical operand order for commutative operators, so a*b and b*a
+    // hash-cons to one node and constants end up on the right
+    if ((kind == AST_ADD || kind == AST_MUL) &&
+        (l->kind == AST_NUM || (r->kind != AST_NUM && left > right))) {
+        int t = left; left = right; right = t;
+        AstNode* tn = l; l = r; r = tn;
+    }
+
+    switch (kind) {
+        case AST_ADD:
+            if (compile_is_num(c, right, 0)) return left;
+            break;
+        case AST_SUB:
+            if (compile_is_num(c, right, 0)) return left;
+            if (compile_is_num(c, left, 0)) return compile_operator(c, AST_NEG, right, -1);
+            break;
+        case AST_MUL:
+            if (compile_is_num(c, right, 1)) return left;
+            if (compile_is_num(c, right, -1)) return compile_operator(c, AST_NEG, left, -1);
+            // x * 2^k -> x << k
+            if (r->kind == AST_NUM && VALUE_IS_SMALL(r->value)) {
+                int32_t n = VALUE_INT(r->value);
+                if (n > 1 && (n & (n - 1)) == 0) return compile_node(c, AST_SHL, __builtin_ctz(n), left, -1);
+            }
+            break;
+        case AST_DIV:
+            if (compile_is_num(c, right, 1)) return left;
+            break;
+        case AST_POW:
+            if (compile_is_num(c, right, 1)) return left;
+            // x^2 -> x*x, with both operands the same node
+            if (compile_is_num(c, right, 2)) return compile_node(c, AST_MUL, 0, left, left);
+            break;
+    }
+    return compile_node(c, kind, 0, left, right);
+}
+
+int compile_expr(AlgrCompiler* c);
+
+// Slot register for the variable named by the current token. A name read
+// before anything assigns it becomes an import from the shell variables.
+int compile_variable(AlgrCompiler* c, int is_read) {
+    const char* name = c->src + c->tok_start;
+    int len = c->tok_len;
+    uint32_t hash = symbol_hash(name, len);
+    Symbol* s = symbol_lookup(&c->scope, name, len, hash, 0);
+    if (s) return s->value;
+
+    // Registers are never given back, so once a variable spills so do
+    // all later ones
+    uint32_t slot = c->const_regs + c->var_regs < ALGB_SHARED_REGS ? ALGB_MAX_REGS - 1 - c->var_regs
+                                                                   : ALGB_MAX_REGS + c->var_count - c->var_regs;
+    if (len >= MAX_VARNAME || slot >= ALGB_MAX_REGS + ALGB_MAX_SPILLS) {
+        compile_error(c, len >= MAX_VARNAME ? "Variable name too long" : "Too many variables");
+        return ALGB_MAX_REGS - 1;
+    }
+    if (!(s = symbol_lookup(&c->scope, name, len, hash, 1))) {
+        compile_error(c, "Out of memory");
+        return ALGB_MAX_REGS - 1;
+    }
+    s->value = slot;
+    if (slot < ALGB_MAX_REGS) c->var_regs++;
+    c->var_count++;
+
+    if (is_read) {
+        if (!compile_reserve(c, (void**)&c->imports, &c->import_capacity, c->import_count + 1, sizeof(AlgbImport))) {
+            return slot;
+        }
+        AlgbImport* imp = &c->imports[c->import_count++];
+        memset(imp, 0, sizeof(AlgbImport));
+        imp->reg = s->value;
+        imp->name = c->tok_start;   // Names are read from the source text
+        imp->name_len = len;
+        imp->line = c->tok_line;
+        imp->hash = hash;
+    }
+    return s->value;
+}
+
+int compile_unary(AlgrCompiler* c);
+
+int compile_primary(AlgrCompiler* c) {
+    if (c->tok == TOK_NUM) {
+        int n = compile_node(c, AST_NUM, c->tok_num, -1, -1);
+        compile_next(c);
+        return n;
+    }
+    if (c->tok == TOK_IDENT) {
+        int n = compile_node(c, AST_VAR, compile_variable(c, 1), -1, -1);
+        compile_next(c);
+        return n;
+    }
+    if (compile_accept(c, '(')) {
+        int n = compile_expr(c);
+        if (!compile_accept(c, ')')) compile_error(c, "Expected ')'");
+        return n;
+    }
+    compile_error(c, "Expected number, variable or '('");
+    return 0;
+}
+
+// Postfix '!' binds tightest, then right-associative '^', then unary
+// minus, so -2^2 is -4 and 2^3^2 is 2^9
+int compile_power(AlgrCompiler* c) {
+    int base = compile_primary(c);
+    while (!c->error && compile_accept(c, '!')) {
+        base = compile_operator(c, AST_FACT, base, -1);
+    }
+    if (!c->error && compile_accept(c, '^')) {
+        return compile_operator(c, AST_POW, base, compile_unary(c));
+    }
+    return base;
+}
+
+int compile_unary(AlgrCompiler* c) {
+    if (compile_accept(c, '-')) {
+        return compile_operator(c, AST_NEG, compile_unary(c), -1);
+    }
+    if (compile_accept(c, '+')) {
+        return compile_unary(c);
+    }
+    return compile_power(c);
+}
+
+int compile_term(AlgrCompiler* c) {
+    int left = compile_unary(c);
+    while (!c->error && c->tok == TOK_PUNCT && (c->tok_punct == '*' || c->tok_punct == '/')) {
+        int kind = c->tok_punct == '*' ? AST_MUL : AST_DIV;
+        compile_next(c);
+        left = compile_operator(c, kind, left, compile_unary(c));
+    }
+    return left;
+}
+
+int compile_expr(AlgrCompiler* c) {
+    int left = compile_term(c);
+    while (!c->error && c->tok == TOK_PUNCT && (c->tok_punct == '+' || c->tok_punct == '-')) {
+        int kind = c->tok_punct == '+' ? AST_ADD : AST_SUB;
+        compile_next(c);
+        left = compile_operator(c, kind, left, compile_term(c));
+    }
+    return left;
+}
+
+void compile_emit(AlgrCompiler* c, uint32_t insn) {
+    if (c->code_size >= ALGB_MAX_CODE) {
+        compile_error(c, "Program too large");
+        return;
+    }
+    if (!compile_reserve(c, (void**)&c->code, &c->code_capacity, c->code_size + 1, sizeof(uint32_t))) return;
+    c->code[c->code_size++] = insn;
+}
+
+// Hash of a constant, equal for equal values
+uint32_t compile_const_hash(Value value) {
+    if (VALUE_IS_SMALL(value)) return value * 2654435761u;
+    const BigInt* big = VALUE_BIG(value);
+    return symbol_hash((const char*)big->limbs, big->len * sizeof(uint32_t)) ^ (uint32_t)big->sign;
+}
+
+// Rebuild the pool's hash index at twice the size; returns 0 when out of memory
+int compile_const_rehash(AlgrCompiler* c) {
+    uint32_t size = c->const_hash_size ? c->const_hash_size * 2 : 64;
+    int32_t* hash = kmalloc(size * sizeof(int32_t));
+    if (!hash) {
+        compile_error(c, "Out of memory");
+        return 0;
+    }
+    memset(hash, 0, size * sizeof(int32_t));
+    for (uint32_t i = 0; i < c->const_count; i++) {
+        uint32_t slot = compile_const_hash(c->const_values[i]) & (size - 1);
+        while (hash[slot]) slot = (slot + 1) & (size - 1);
+        hash[slot] = i + 1;
+    }
+    kfree(c->const_hash);
+    c->const_hash = hash;
+    c->const_hash_size = size;
+    return 1;
+}
+
+// Pool index of a constant, adding it if needed. New constants are
+// preloaded into registers until the shared registers run out.
+uint32_t compile_const(AlgrCompiler* c, Value value) {
+    if (c->const_count * 2 >= c->const_hash_size && !compile_const_rehash(c)) return 0;
+    uint32_t mask = c->const_hash_size - 1;
+    uint32_t slot = compile_const_hash(value) & mask;
+    while (c->const_hash[slot]) {
+        uint32_t i = c->const_hash[slot] - 1;
+        if (value_equal(c->const_values[i], value)) return i;
+        slot = (slot + 1) & mask;
+    }
+    if (c->const_count >= ALGB_MAX_CONSTS) {
+        compile_error(c, "Too many constants");
+        return 0;
+    }
+    if (!compile_reserve(c, (void**)&c->consts, &c->const_capacity, c->const_count + 1, sizeof(uint32_t)) ||
+        !compile_reserve(c, (void**)&c->const_values, &c->const_values_capacity, c->const_count + 1, sizeof(Value))) {
+        return 0;
+    }
+    uint32_t entry = value;
+    if (!VALUE_IS_SMALL(value)) {
+        uint32_t words = 2 + VALUE_BIG(value)->len;
+        if (!compile_reserve(c, (void**)&c->bignums, &c->bignum_capacity, c->bignum_size + words, sizeof(uint32_t))) {
+            return 0;
+        }
+        entry = c->bignum_size * sizeof(uint32_t);
+        memcpy(c->bignums + c->bignum_size, (const void*)value, words * sizeof(uint32_t));
+        c->bignum_size += words;
+    }
+    c->consts[c->const_count] = entry;
+    c->const_values[c->const_count] = value;
+    c->const_hash[slot] = c->const_count + 1;
+    if (c->const_regs == c->const_count && c->const_regs + c->var_regs < ALGB_SHARED_REGS) c->const_regs++;
+    return c->const_count++;
+}
+
+// Add a text table entry for len bytes at string table offset start
+int compile_text(AlgrCompiler* c, uint32_t start, uint32_t len) {
+    if (c->text_count >= ALGB_MAX_TEXTS) {
+        compile_error(c, "Too many statements");
+        return 0;
+    }
+    if (!compile_reserve(c, (void**)&c->texts, &c->text_capacity, c->text_count + 1, sizeof(AlgbText))) return 0;
+    c->texts[c->text_count].start = start;
+    c->texts[c->text_count].len = len;
+    return c->text_count++;
+}
+
+// Text entry for an unescaped string, stored after the source
+int compile_string(AlgrCompiler* c, const char* str, uint32_t len) {
+    if (!compile_reserve(c, (void**)&c->strings, &c->string_capacity, c->string_size + len, 1)) return 0;
+    memcpy(c->strings + c->string_size, str, len);
+    c->string_size += len;
+    return compile_text(c, c->len + c->string_size - len, len);
+}
+
+int compile_alloc_temp(AlgrCompiler* c) {
+    for (int i = 0; i < ALGB_TEMP_REGS; i++) {
+        if (!c->temp_busy[i]) {
+            c->temp_busy[i] = 1;
+            return i;
+        }
+    }
+    compile_error(c, "Expression too complex");
+    return 0;
+}
+
+// Register holding a constant: its preloaded register, or a temporary
+// loaded from the pool
+int compile_load_const(AlgrCompiler* c, Value value) {
+    uint32_t k = compile_const(c, value);
+    if (k < c->const_regs) return ALGB_TEMP_REGS + k;
+    int reg = compile_alloc_temp(c);
+    compile_emit(c, ALGB_INSN_BX(OP_LOADK, reg, k));
+    return reg;
+}
+
+// Count the references to each node of the statement's final DAG. Rewrites
+// leave nodes behind that nothing points to any more, so this runs once the
+// roots are known rather than as nodes are created; each root keeps one
+// extra reference, holding its register until the statement ends.
+void compile_add_use(AlgrCompiler* c, int node) {
+    AstNode* n = &c->nodes[node];
+    if (n->uses++ > 0) return;
+    if (n->left >= 0) compile_add_use(c, n->left);
+    if (n->right >= 0) compile_add_use(c, n->right);
+}
+
+void compile_count_uses(AlgrCompiler* c, const int* roots, int count) {
+    for (int i = 0; i < c->node_count; i++) c->nodes[i].uses = 0;
+    for (int i = 0; i < count; i++) {
+        if (roots[i] >= 0) compile_add_use(c, roots[i]);
+    }
+}
+
+// Drop one reference to a generated node, freeing its temporary after
+// the last one
+void compile_release(AlgrCompiler* c, int node) {
+    AstNode* n = &c->nodes[node];
+    if (n->uses > 0 && --n->uses == 0 && n->reg >= 0 && n->reg < ALGB_TEMP_REGS) {
+        c->temp_busy[n->reg] = 0;
+    }
+}
+
+// Emit code for a subtree and return the register that holds its value.
+// Shared nodes are generated once and kept until their last use.
+int compile_codegen(AlgrCompiler* c, int node) {
+    AstNode* n = &c->nodes[node];
+    if (n->reg >= 0) {
+        return n->reg;
+    }
+    if (n->kind == AST_NUM) {
+        n->reg = compile_load_const(c, n->value);
+        return n->reg;
+    }
+    if (n->kind == AST_VAR) {
+        if (n->value < ALGB_MAX_REGS) return n->value;
+        n->reg = compile_alloc_temp(c);
+        compile_emit(c, ALGB_INSN_BX(OP_GETVAR, n->reg, n->value - ALGB_MAX_REGS));
+        return n->reg;
+    }
+
+    int left = compile_codegen(c, n->left);
+    int right = n->right >= 0 ? compile_codegen(c, n->right) : 0;
+    compile_release(c, n->left);
+    if (n->right >= 0) compile_release(c, n->right);
+
+    // Operands are read before the result is written, so the result may
+    // reuse a register freed just above
+    int target = compile_alloc_temp(c);
+    static const uint8_t ops[] = { [AST_ADD] = OP_ADD, [AST_SUB] = OP_SUB, [AST_MUL] = OP_MUL,
+                                   [AST_DIV] = OP_DIV, [AST_NEG] = OP_NEG, [AST_SHL] = OP_SHL,
+                                   [AST_POW] = OP_POW, [AST_FACT] = OP_FACT };
+    if (n->kind == AST_SHL) right = n->value;
+    compile_emit(c, ALGB_INSN(ops[n->kind], target, left, right));
+    n->reg = target;
+    return target;
+}
+
+// Generate a statement-level value; its register stays reserved until the
+// statement ends
+int compile_value(AlgrCompiler* c, int node) {
+    if (c->error) return 0;
+    compile_count_uses(c, &node, 1);
+    return compile_codegen(c, node);
+}
+
+// print("text")
+void compile_print(AlgrCompiler* c) {
+    compile_next(c);
+    if (!compile_accept(c, '(') || c->tok != TOK_STR) {
+        compile_error(c, "Expected print(\"text\")");
+        return;
+    }
+
+    char buffer[512];
+    int len = c->tok_len - 2;
+    if (len > (int)sizeof(buffer) - 1) len = sizeof(buffer) - 1;
+    memcpy(buffer, c->src + c->tok_start + 1, len);
+    buffer[len] = '\0';
+    process_escape_sequences(buffer);
+    compile_next(c);
+
+    if (!compile_accept(c, ')')) {
+        compile_error(c, "Expected ')'");
+        return;
+    }
+    compile_emit(c, ALGB_INSN_BX(OP_PRINT_STR, 0, compile_string(c, buffer, strlen(buffer))));
+}
+
+// Equations compile to the coefficients of (left - right) in x over a
+// common denominator, each an ordinary expression tree, and one OP_SOLVE
+// over a block of consecutive temporaries
+typedef struct {
+    int16_t c[POLY_MAX_DEGREE + 1];     // Coefficient nodes, -1 for zero
+    int degree;
+    int den;                            // Denominator node, -1 for one
+} AstPoly;
+
+void compile_poly_expr(AlgrCompiler* c, AstPoly* r);
+void compile_poly_unary(AlgrCompiler* c, AstPoly* r);
+
+// Node for a coefficient, materializing zero
+int compile_poly_coef(AlgrCompiler* c, int node) {
+    return node >= 0 ? node : compile_node(c, AST_NUM, VALUE_SMALL(0), -1, -1);
+}
+
+// Product of two coefficients, where -1 stands for zero
+int compile_poly_mul(AlgrCompiler* c, int a, int b) {
+    if (a < 0 || b < 0) return -1;
+    return compile_operator(c, AST_MUL, a, b);
+}
+
+// Product of a coefficient and a denominator, or of two denominators
+// (is_den); -1 stands for one in a denominator
+int compile_poly_scale(AlgrCompiler* c, int a, int den, int is_den) {
+    if (den < 0) return a;
+    if (a < 0) return is_den ? den : -1;
+    return compile_operator(c, AST_MUL, a, den);
+}
+
+// a + b or a - b where -1 stands for zero
+int compile_poly_add(AlgrCompiler* c, int a, int b, int negate) {
+    if (b < 0) return a;
+    if (a < 0) return negate ? compile_operator(c, AST_NEG, b, -1) : b;
+    return compile_operator(c, negate ? AST_SUB : AST_ADD, a, b);
+}
+
+void compile_poly_addsub(AlgrCompiler* c, AstPoly* r, const AstPoly* b, int negate) {
+    int same = r->den == b->den;
+    int degree = r->degree > b->degree ? r->degree : b->degree;
+    for (int i = 0; i <= degree; i++) {
+        int x = i <= r->degree ? r->c[i] : -1;
+        int y = i <= b->degree ? b->c[i] : -1;
+        if (!same) {
+            x = compile_poly_scale(c, x, b->den, 0);
+            y = compile_poly_scale(c, y, r->den, 0);
+        }
+        r->c[i] = compile_poly_add(c, x, y, negate);
+    }
+    if (!same) r->den = compile_poly_scale(c, r->den, b->den, 1);
+    r->degree = degree;
+}
+
+void compile_poly_times(AlgrCompiler* c, AstPoly* r, const AstPoly* b) {
+    if (r->degree + b->degree > POLY_MAX_DEGREE) {
+        compile_error(c, "Degree too high");
+        return;
+    }
+    AstPoly t;
+    t.degree = r->degree + b->degree;
+    for (int i = 0; i <= t.degree; i++) t.c[i] = -1;
+    for (int i = 0; i <= r->degree; i++) {
+        for (int j = 0; j <= b->degree; j++) {
+            t.c[i + j] = compile_poly_add(c, t.c[i + j], compile_poly_mul(c, r->c[i], b->c[j]), 0);
+        }
+    }
+    t.den = compile_poly_scale(c, r->den, b->den, 1);
+    *r = t;
+}
+
+void compile_poly_primary(AlgrCompiler* c, AstPoly* r) {
+    r->degree = 0;
+    r->c[0] = -1;
+    r->den = -1;
+    if (c->tok == TOK_NUM) {
+        r->c[0] = compile_node(c, AST_NUM, c->tok_num, -1, -1);
+        compile_next(c);
+    } else if (compile_ident_is(c, "x")) {
+        r->c[1] = compile_node(c, AST_NUM, VALUE_SMALL(1), -1, -1);
+        r->degree = 1;
+        compile_next(c);
+    } else if (c->tok == TOK_IDENT) {
+        r->c[0] = compile_node(c, AST_VAR, compile_variable(c, 1), -1, -1);
+        compile_next(c);
+    } else if (compile_accept(c, '(')) {
+        compile_poly_expr(c, r);
+        if (!compile_accept(c, ')')) compile_error(c, "Expected ')'");
+    } else {
+        compile_error(c, "Expected number, variable or '('");
+    }
+}
+
+// Same precedence as compile_power; powers of x need a literal exponent
+void compile_poly_power(AlgrCompiler* c, AstPoly* r) {
+    compile_poly_primary(c, r);
+    int integer = r->degree == 0 && r->den < 0;
+    while (!c->error && compile_accept(c, '!')) {
+        if (!integer) {
+            compile_error(c, "Factorial needs an integer");
+            return;
+        }
+        r->c[0] = compile_operator(c, AST_FACT, compile_poly_coef(c, r->c[0]), -1);
+    }
+    if (c->error || !compile_accept(c, '^')) return;
+
+    AstPoly e;
+    compile_poly_unary(c, &e);
+    if (c->error) return;
+    if (e.degree > 0 || e.den >= 0) {
+        compile_error(c, "Exponent must be an integer constant");
+        return;
+    }
+    int exponent = compile_poly_coef(c, e.c[0]);
+    if (integer) {
+        r->c[0] = compile_operator(c, AST_POW, compile_poly_coef(c, r->c[0]), exponent);
+        return;
+    }
+    AstNode* n = &c->nodes[exponent];
+    if (n->kind != AST_NUM || !VALUE_IS_SMALL(n->value) || VALUE_INT(n->value) < 0) {
+        compile_error(c, "Exponent of x must be a constant");
+        return;
+    }
+    AstPoly base = *r;
+    r->degree = 0;
+    r->c[0] = compile_node(c, AST_NUM, VALUE_SMALL(1), -1, -1);
+    r->den = -1;
+    for (int32_t k = VALUE_INT(n->value); k > 0 && !c->error; k--) compile_poly_times(c, r, &base);
+}
+
+void compile_poly_unary(AlgrCompiler* c, AstPoly* r) {
+    if (compile_accept(c, '-')) {
+        compile_poly_unary(c, r);
+        for (int i = 0; i <= r->degree; i++) r->c[i] = compile_poly_add(c, -1, r->c[i], 1);
+        return;
+    }
+    if (compile_accept(c, '+')) {
+        compile_poly_unary(c, r);
+        return;
+    }
+    compile_poly_power(c, r);
+}
+
+// *, / and implicit multiplication, as in 3x or 2(x + 1)
+void compile_poly_term(AlgrCompiler* c, AstPoly* r) {
+    compile_poly_unary(c, r);
+    while (!c->error) {
+        AstPoly b;
+        if (c->tok == TOK_PUNCT && c->tok_punct == '*') {
+            compile_next(c);
+            compile_poly_unary(c, &b);
+            compile_poly_times(c, r, &b);
+        } else if (c->tok == TOK_PUNCT && c->tok_punct == '/') {
+            compile_next(c);
+            compile_poly_unary(c, &b);
+            if (c->error) return;
+            if (b.degree > 0) {
+                compile_error(c, "Cannot divide by an expression in x");
+                return;
+            }
+            for (int i = 0; i <= r->degree; i++) r->c[i] = compile_poly_scale(c, r->c[i], b.den, 0);
+            r->den = compile_poly_scale(c, compile_poly_coef(c, b.c[0]), r->den, 1);
+        } else if (c->tok == TOK_NUM || c->tok == TOK_IDENT || (c->tok == TOK_PUNCT && c->tok_punct == '(')) {
+            compile_poly_power(c, &b);
+            compile_poly_times(c, r, &b);
+        } else {
+            break;
+        }
+    }
+}
+
+void compile_poly_expr(AlgrCompiler* c, AstPoly* r) {
+    compile_poly_term(c, r);
+    while (!c->error && c->tok == TOK_PUNCT && (c->tok_punct == '+' || c->tok_punct == '-')) {
+        int negate = c->tok_punct == '-';
+        compile_next(c);
+        AstPoly b;
+        compile_poly_term(c, &b);
+        if (!c->error) compile_poly_addsub(c, r, &b, negate);
+    }
+}
+
+// n consecutive free temporaries
+int compile_alloc_block(AlgrCompiler* c, int n) {
+    for (int start = 0; start + n <= ALGB_TEMP_REGS; start++) {
+        int i = 0;
+        while (i < n && !c->temp_busy[start + i]) i++;
+        if (i == n) {
+            memset(c->temp_busy + start, 1, n);
+            return start;
+        }
+        start += i;
+    }
+    compile_error(c, "Expression too complex");
+    return 0;
+}
+
+// <expr in x> = <expr in x>
+void compile_equation(AlgrCompiler* c) {
+    AstPoly left, right;
+    compile_poly_expr(c, &left);
+    if (!c->error && !compile_accept(c, '=')) compile_error(c, "Missing '=' sign");
+    if (c->error) return;
+    compile_poly_expr(c, &right);
+    if (c->error) return;
+
+    // left * right.den - right * left.den = 0
+    int coef[POLY_MAX_DEGREE + 1];
+    int degree = left.degree > right.degree ? left.degree : right.degree;
+    for (int i = 0; i <= degree; i++) {
+        int a = compile_poly_scale(c, i <= left.degree ? left.c[i] : -1, right.den, 0);
+        int b = compile_poly_scale(c, i <= right.degree ? right.c[i] : -1, left.den, 0);
+        coef[i] = compile_poly_add(c, a, b, 1);
+    }
+    while (degree > 0 && coef[degree] < 0) degree--;
+    int den = compile_poly_scale(c, left.den, right.den, 1);
+
+    // The roots share nodes, so their uses are counted together
+    if (c->error) return;
+    int roots[POLY_MAX_DEGREE + 2];
+    roots[0] = den;
+    for (int i = 0; i <= degree; i++) roots[i + 1] = coef[i];
+    compile_count_uses(c, roots, degree + 2);
+    int regs[POLY_MAX_DEGREE + 2];
+    regs[0] = den >= 0 ? compile_codegen(c, den) : compile_load_const(c, VALUE_SMALL(1));
+    for (int i = 0; i <= degree; i++) {
+        regs[i + 1] = coef[i] >= 0 ? compile_codegen(c, coef[i]) : compile_load_const(c, VALUE_SMALL(0));
+    }
+    if (c->error) return;
+    int block = compile_alloc_block(c, degree + 2);
+    for (int i = 0; i < degree + 2; i++) {
+        if (regs[i] != block + i) compile_emit(c, ALGB_INSN(OP_MOV, block + i, regs[i], 0));
+    }
+    compile_emit(c, ALGB_INSN(OP_SOLVE, degree, block, 0));
+}
+
+// [let] name = expr
+void compile_assignment(AlgrCompiler* c) {
+    if (compile_ident_is(c, "let")) compile_next(c);
+    if (c->tok != TOK_IDENT) {
+        compile_error(c, "Expected variable name");
+        return;
+    }
+    uint32_t name_start = c->tok_start, name_len = c->tok_len;
+    int name_line = c->tok_line;
+    compile_next(c);
+    if (!compile_accept(c, '=')) {
+        compile_error(c, "Expected '='");
+        return;
+    }
+
+    int node = compile_expr(c);
+    int reg = compile_value(c, node);
+    if (c->error) return;
+
+    // Resolve the target after the right-hand side, so "a = a + 1" reads
+    // the shell's a when the program has not assigned it yet
+    uint32_t tok_start = c->tok_start, tok_len = c->tok_len;
+    int tok_line = c->tok_line;
+    c->tok_start = name_start;
+    c->tok_len = name_len;
+    c->tok_line = name_line;
+    int slot = compile_variable(c, 0);
+    c->tok_start = tok_start;
+    c->tok_len = tok_len;
+    c->tok_line = tok_line;
+
+    // A computed value is retargeted to write the slot directly
+    if (slot >= ALGB_MAX_REGS) {
+        compile_emit(c, ALGB_INSN_BX(OP_SETVAR, reg, slot - ALGB_MAX_REGS));
+    } else if (reg < ALGB_TEMP_REGS && c->code_size > 0) {
+        c->code[c->code_size - 1] = (c->code[c->code_size - 1] & ~0xFF00u) | (uint32_t)slot << 8;
+    } else {
+        compile_emit(c, ALGB_INSN(OP_MOV, slot, reg, 0));
+    }
+}
+
+// True if the current token is a name directly followed by '='
+int compile_at_assignment(AlgrCompiler* c) {
+    if (c->tok != TOK_IDENT) return 0;
+    if (compile_ident_is(c, "let")) return 1;
+    uint32_t i = c->pos;
+    while (i < c->len && is_space(c->src[i])) i++;
+    return i < c->len && c->src[i] == '=';
+}
+
+// Compile one statement; the token stream is positioned at its first token
+void compile_statement(AlgrCompiler* c) {
+    // Scan ahead for 'x' and '=' to tell equations from expressions, like the shell does
+    int has_x = 0, has_eq = 0;
+    for (uint32_t i = c->tok_start; i < c->len && c->src[i] != '\n' && c->src[i] != ';'; i++) {
+        if (c->src[i] == '"') break;
+        if (c->src[i] == 'x') has_x = 1;
+        if (c->src[i] == '=') has_eq = 1;
+    }
+
+    if (c->line_count == 0 || c->lines[c->line_count - 1].line != (uint32_t)c->tok_line) {
+        if (!compile_reserve(c, (void**)&c->lines, &c->line_capacity, c->line_count + 1, sizeof(AlgbLine))) return;
+        c->lines[c->line_count].pc = c->code_size;
+        c->lines[c->line_count].line = c->tok_line;
+        c->line_count++;
+    }
+
+    if (compile_at_assignment(c)) {
+        compile_assignment(c);
+    } else if (compile_ident_is(c, "print")) {
+        compile_print(c);
+    } else if (has_x && has_eq) {
+        compile_equation(c);
+    } else if (has_eq) {
+        compile_error(c, "Expected a variable before '='");
+    } else {
+        uint32_t start = c->tok_start;
+        int node = compile_expr(c);
+        // The label is the statement text, printed as "<text> = <value>"
+        int reg = compile_value(c, node);
+        int label = compile_text(c, start, c->prev_end - start);
+        compile_emit(c, ALGB_INSN_BX(OP_PRINT_RESULT, reg, label));
+    }
+
+    if (!c->error && c->tok != TOK_END && c->tok != TOK_EOF) {
+        compile_error(c, "Unexpected text after statement");
+    }
+}
+
+// Compile .algr source text into c's sections; returns 0 on success. The
+// source must stay in place until the image has been written.
+int compile_algr(AlgrCompiler* c, const char* src, uint32_t len, int opt_level) {
+    kfree(c->consts);
+    kfree(c->const_values);
+    kfree(c->const_hash);
+    kfree(c->bignums);
+    kfree(c->scope.entries);
+    kfree(c->imports);
+    kfree(c->lines);
+    kfree(c->texts);
+    kfree(c->strings);
+    kfree(c->code);
+    memset(c, 0, sizeof(AlgrCompiler));
+    c->src = src;
+    c->len = len;
+    c->line = 1;
+    c->opt_level = opt_level;
+
+    compile_next(c);
+    while (!c->error && c->tok != TOK_EOF) {
+        if (c->tok == TOK_END) {
+            compile_next(c);
+            continue;
+        }
+        c->node_count = 0;
+        memset(c->node_hash, 0, sizeof(c->node_hash));
+        memset(c->temp_busy, 0, sizeof(c->temp_busy));
+        compile_statement(c);
+    }
+    compile_emit(c, ALGB_INSN(OP_HALT, 0, 0, 0));
+    return c->error ? -1 : 0;
+}
+
+// Images built in memory (build, algebra -jit, algebra-bench) are written
+// to one scratch buffer, grown to the largest image so far
+static char* algb_scratch = 0;
+static uint32_t algb_scratch_size = 0;
+
+// Serialize the compiled sections into the scratch buffer; returns it, or
+// 0 when out of memory
+char* compile_write_image(AlgrCompiler* c, uint32_t* size) {
+    AlgbHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "ALGB", 4);
+    h.version = ALGB_VERSION;
+    h.header_size = sizeof(AlgbHeader);
+    h.const_regs = c->const_regs;
+    h.var_regs = c->var_regs;
+    h.const_count = c->const_count;
+    h.var_count = c->var_count;
+    h.import_count = c->import_count;
+    h.line_count = c->line_count;
+    h.text_count = c->text_count;
+    h.code_size = c->code_size;
+    h.bignum_size = c->bignum_size * sizeof(uint32_t);
+    h.string_size = c->len + c->string_size;
+
+    uint32_t consts_size = c->const_count * sizeof(uint32_t);
+    uint32_t imports_size = c->import_count * sizeof(AlgbImport);
+    uint32_t lines_size = c->line_count * sizeof(AlgbLine);
+    uint32_t texts_size = c->text_count * sizeof(AlgbText);
+    uint32_t code_size = c->code_size * sizeof(uint32_t);
+    uint32_t total = sizeof(AlgbHeader) + consts_size + imports_size + lines_size + texts_size +
+                     code_size + h.bignum_size + h.string_size;
+    if (total > algb_scratch_size) {
+        char* p = krealloc(algb_scratch, total);
+        if (!p) return 0;
+        algb_scratch = p;
+        algb_scratch_size = total;
+    }
+
+    char* p = algb_scratch;
+    memcpy(p, &h, sizeof(AlgbHeader)); p += sizeof(AlgbHeader);
+    memcpy(p, c->consts, consts_size); p += consts_size;
+    memcpy(p, c->imports, imports_size); p += imports_size;
+    memcpy(p, c->lines, lines_size); p += lines_size;
+    memcpy(p, c->texts, texts_size); p += texts_size;
+    memcpy(p, c->code, code_size); p += code_size;
+    memcpy(p, c->bignums, h.bignum_size); p += h.bignum_size;
+    memcpy(p, c->src, c->len); p += c->len;
+    memcpy(p, c->strings, c->string_size);
+    *size = total;
+    return algb_scratch;
+}
+
+// Register VM for .algebra images
+typedef struct {
+    const uint32_t* consts;
+    const AlgbImport* imports;
+    const AlgbLine* lines;
+    const AlgbText* texts;
+    const uint32_t* code;
+    const uint32_t* bignums;
+    const char* strings;
+    AlgbHeader header;
+    uint32_t const_base;    // Register of pool entry 0, as seen by spilled constants
+    uint32_t reg_count;     // Register file size, spills included
+} AlgbImage;
+
+// Check the header and section bounds, then verify every instruction's
+// operands so the interpreter loop can run without checks
+int algb_load(AlgbImage* img, const char* data, uint32_t size) {
+    if (size < sizeof(AlgbHeader)) return -1;
+    memcpy(&img->header, data, sizeof(AlgbHeader));
+    AlgbHeader* h = &img->header;
+    if (strncmp(h->magic, "ALGB", 4) != 0 || h->version != ALGB_VERSION ||
+        h->header_size != sizeof(AlgbHeader)) {
+        return -1;
+    }
+
+    // The per-section limits keep the sum below from overflowing
+    if (h->const_regs > h->const_count || h->var_regs > h->var_count ||
+        h->const_regs + h->var_regs > ALGB_SHARED_REGS || h->const_count > ALGB_MAX_CONSTS ||
+        h->var_count - h->var_regs > ALGB_MAX_SPILLS || h->import_count > h->var_count ||
+        h->code_size == 0 || h->code_size > ALGB_MAX_CODE || h->text_count > ALGB_MAX_TEXTS ||
+        h->line_count > size / sizeof(AlgbLine) || h->string_size > size ||
+        h->bignum_size > size || (h->bignum_size & 3)) {
+        return -1;
+    }
+    uint32_t spilled_vars = h->var_count - h->var_regs;
+    img->const_base = ALGB_MAX_REGS + spilled_vars - h->const_regs;
+    img->reg_count = img->const_base + h->const_count;
+    uint32_t consts_size = h->const_count * sizeof(uint32_t);
+    uint32_t imports_size = h->import_count * sizeof(AlgbImport);
+    uint32_t lines_size = h->line_count * sizeof(AlgbLine);
+    uint32_t texts_size = h->text_count * sizeof(AlgbText);
+    uint32_t code_size = h->code_size * sizeof(uint32_t);
+    if (sizeof(AlgbHeader) + consts_size + imports_size + lines_size + texts_size + code_size +
+            h->bignum_size + h->string_size > size) {
+        return -1;
+    }
+    img->consts = (const uint32_t*)(data + sizeof(AlgbHeader));
+    img->imports = (const AlgbImport*)((const char*)img->consts + consts_size);
+    img->lines = (const AlgbLine*)((const char*)img->imports + imports_size);
+    img->texts = (const AlgbText*)((const char*)img->lines + lines_size);
+    img->code = (const uint32_t*)((const char*)img->texts + texts_size);
+    img->bignums = (const uint32_t*)((const char*)img->code + code_size);
+    img->strings = (const char*)img->bignums + h->bignum_size;
+    for (uint32_t i = 0; i < h->text_count; i++) {
+        if (img->texts[i].start > h->string_size || img->texts[i].len > h->string_size - img->texts[i].start) return -1;
+    }
+
+    // BigInt constants become Values pointing into the image, so they must
+    // be word-aligned and canonical (outside the small range)
+    if ((uint32_t)img->bignums & 3) return -1;
+    for (uint32_t i = 0; i < h->const_count; i++) {
+        uint32_t entry = img->consts[i];
+        if (VALUE_IS_SMALL(entry)) continue;
+        if ((entry & 3) || h->bignum_size < 8 || entry > h->bignum_size - 8) return -1;
+        const BigInt* big = (const BigInt*)((const char*)img->bignums + entry);
+        if ((big->sign != 1 && big->sign != -1) || big->len == 0 ||
+            big->len > (h->bignum_size - entry - 8) / 4 || big->limbs[big->len - 1] == 0 ||
+            (big->len == 1 && (big->limbs[0] <= SMALL_MAX || (big->sign < 0 && big->limbs[0] == 1u << 30)))) {
+            return -1;
+        }
+    }
+
+    // Temporaries and variables are writable; constants are read-only
+    uint32_t const_limit = ALGB_TEMP_REGS + h->const_regs;
+    uint32_t var_base = ALGB_MAX_REGS - h->var_regs;
+#define READABLE(r) ((r) < const_limit || (r) >= var_base)
+#define WRITABLE(r) ((r) < ALGB_TEMP_REGS || (r) >= var_base)
+    for (uint32_t i = 0; i < h->import_count; i++) {
+        const AlgbImport* imp = &img->imports[i];
+        if (imp->reg < var_base || imp->reg >= ALGB_MAX_REGS + spilled_vars ||
+            imp->name > h->string_size || imp->name_len > h->string_size - imp->name) {
+            return -1;
+        }
+    }
+
+    for (uint32_t pc = 0; pc < h->code_size; pc++) {
+        uint32_t insn = img->code[pc];
+        uint32_t op = insn & 0xFF, a = (insn >> 8) & 0xFF, b = (insn >> 16) & 0xFF, c = insn >> 24;
+        switch (op) {
+            case OP_HALT:
+                break;
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_POW:
+                if (!WRITABLE(a) || !READABLE(b) || !READABLE(c)) return -1;
+                break;
+            case OP_MOV: case OP_NEG: case OP_FACT:
+                if (!WRITABLE(a) || !READABLE(b)) return -1;
+                break;
+            case OP_SHL:
+                if (!WRITABLE(a) || !READABLE(b) || c >= 32) return -1;
+                break;
+            case OP_PRINT_STR:
+                if ((insn >> 16) >= h->text_count) return -1;
+                break;
+            case OP_PRINT_RESULT:
+                if (!READABLE(a) || (insn >> 16) >= h->text_count) return -1;
+                break;
+            case OP_SOLVE:
+                if (a > POLY_MAX_DEGREE || b + a + 2 > ALGB_TEMP_REGS) return -1;
+                break;
+            case OP_LOADK:
+                if (!WRITABLE(a) || (insn >> 16) < h->const_regs || (insn >> 16) >= h->const_count) return -1;
+                break;
+            case OP_GETVAR:
+                if (!WRITABLE(a) || (insn >> 16) >= spilled_vars) return -1;
+                break;
+            case OP_SETVAR:
+                if (!READABLE(a) || (insn >> 16) >= spilled_vars) return -1;
+                break;
+            default:
+                return -1;
+        }
+    }
+#undef READABLE
+#undef WRITABLE
+    // Code is straight-line, so ending in OP_HALT guarantees termination
+    return (img->code[h->code_size - 1] & 0xFF) == OP_HALT ? 0 : -1;
+}
+
+int algb_line_for_pc(const AlgbImage* img, uint32_t pc) {
+    int line = 0;
+    for (uint32_t i = 0; i < img->header.line_count && img->lines[i].pc <= pc; i++) {
+        line = img->lines[i].line;
+    }
+    return line;
+}
+
+void algb_runtime_error(const AlgbImage* img, uint32_t pc, const char* msg) {
+    print("Runtime error at line ");
+    print_num(algb_line_for_pc(img, pc));
+    print(": ");
+    print(msg);
+    print("\n");
+}
+
+// Zero the variable slots and bind imports from the shell variables
+int algb_bind_variables(const AlgbImage* img, Value* regs) {
+    for (uint32_t i = 0; i < img->header.var_count; i++) {
+        regs[i < img->header.var_regs ? ALGB_MAX_REGS - 1 - i : ALGB_MAX_REGS + i - img->header.var_regs] = VALUE_SMALL(0);
+    }
+    for (uint32_t i = 0; i < img->header.import_count; i++) {
+        const AlgbImport* imp = &img->imports[i];
+        const char* name = img->strings + imp->name;
+        Symbol* s = symbol_lookup(&variables, name, imp->name_len, imp->hash, 0);
+        if (!s) {
+            print("Runtime error at line ");
+            print_num(imp->line);
+            print(": Undefined variable: ");
+            print_n(name, imp->name_len);
+            print("\n");
+            return -1;
+        }
+        regs[imp->reg] = s->value;
+    }
+    return 0;
+}
+
+// Load constants and bind variables into a fresh register file.
+// Temporaries are cleared too, so every register holds a valid Value.
+int algb_setup(const AlgbImage* img, Value* regs) {
+    for (int i = 0; i < ALGB_TEMP_REGS; i++) {
+        regs[i] = VALUE_SMALL(0);
+    }
+    for (uint32_t i = 0; i < img->header.const_count; i++) {
+        uint32_t entry = img->consts[i];
+        uint32_t reg = i < img->header.const_regs ? ALGB_TEMP_REGS + i : img->const_base + i;
+        regs[reg] = VALUE_IS_SMALL(entry) ? entry : (Value)((const char*)img->bignums + entry);
+    }
+    return algb_bind_variables(img, regs);
+}
+
+void algb_print_text(const AlgbImage* img, uint32_t text) {
+    print_n(img->strings + img->texts[text].start, img->texts[text].len);
+}
+
+void algb_print_result(const AlgbImage* img, uint32_t label, Value value) {
+    algb_print_text(img, label);
+    print(" = ");
+    print_value(value);
+    print("\n");
+}
+
+// Solve the equation laid out in block as { den, c[0], ..., c[degree] }
+void algb_solve(const Value* block, uint32_t degree) {
+    if (solve_polynomial(block, degree) == 0) print(solve_text);
+}
+
+// Execute arithmetic instruction pc with full BigInt semantics. This is
+// the slow path of both the interpreter and native code, taken when an
+// operand is a BigInt or the result leaves the small range. Returns -1 on
+// failure, with the reason in value_error.
+int algb_step(Value* regs, const AlgbImage* img, uint32_t pc) {
+    uint32_t insn = img->code[pc];
+    Value x = regs[(insn >> 16) & 0xFF], y = regs[insn >> 24], r = VALUE_ERROR;
+    switch (insn & 0xFF) {
+        case OP_ADD: r = value_add(x, y); break;
+        case OP_SUB: r = value_sub(x, y); break;
+        case OP_MUL: r = value_mul(x, y); break;
+        case OP_DIV: r = value_div(x, y); break;
+        case OP_NEG: r = value_neg(x); break;
+        case OP_SHL: r = value_shl(x, insn >> 24); break;
+        case OP_POW: r = value_pow(x, y); break;
+        case OP_FACT: r = value_factorial(x); break;
+    }
+    if (!r) return -1;
+    regs[(insn >> 8) & 0xFF] = r;
+    return 0;
+}
+
+// Threaded interpreter: each handler jumps straight to the next one
+// through the computed-goto table instead of returning to a switch.
+// Starts at instruction pc, so native code can hand over mid-program.
+// Arithmetic handlers only deal with small operands and results inline
+// and leave everything else to algb_step.
+void algb_interpret(const AlgbImage* img, Value* regs, uint32_t pc) {
+    static void* const dispatch[OP_COUNT] = {
+        [OP_HALT] = &&op_halt, [OP_MOV] = &&op_mov, [OP_ADD] = &&op_add, [OP_SUB] = &&op_sub,
+        [OP_MUL] = &&op_mul, [OP_DIV] = &&op_div, [OP_NEG] = &&op_neg, [OP_SHL] = &&op_shl,
+        [OP_POW] = &&slow, [OP_FACT] = &&slow, [OP_PRINT_STR] = &&op_print_str,
+        [OP_PRINT_RESULT] = &&op_print_result, [OP_SOLVE] = &&op_solve, [OP_LOADK] = &&op_loadk,
+        [OP_GETVAR] = &&op_getvar, [OP_SETVAR] = &&op_setvar,
+    };
+    const uint32_t* ip = img->code + pc;
+    uint32_t insn;
+    Value x, y;
+    int32_t r;
+
+#define VM_A ((insn >> 8) & 0xFF)
+#define VM_B ((insn >> 16) & 0xFF)
+#define VM_C (insn >> 24)
+#define VM_BX (insn >> 16)
+#define VM_DISPATCH() do { insn = *ip++; goto *dispatch[insn & 0xFF]; } while (0)
+
+    VM_DISPATCH();
+
+op_mov:
+    regs[VM_A] = regs[VM_B];
+    VM_DISPATCH();
+op_loadk:
+    regs[VM_A] = regs[img->const_base + VM_BX];
+    VM_DISPATCH();
+op_getvar:
+    regs[VM_A] = regs[ALGB_MAX_REGS + VM_BX];
+    VM_DISPATCH();
+op_setvar:
+    regs[ALGB_MAX_REGS + VM_BX] = regs[VM_A];
+    VM_DISPATCH();
+// Small values are n << 1 | 1, so the tagged words can be combined
+// directly: (2a+1) + 2b = 2(a+b)+1, and overflow of the 32-bit operation
+// is exactly overflow of the 31-bit range
+op_add:
+    x = regs[VM_B], y = regs[VM_C];
+    if (!(x & y & 1) || __builtin_add_overflow((int32_t)(x - 1), (int32_t)y, &r)) goto slow;
+    regs[VM_A] = r;
+    VM_DISPATCH();
+op_sub:
+    x = regs[VM_B], y = regs[VM_C];
+    if (!(x & y & 1) || __builtin_sub_overflow((int32_t)x, (int32_t)(y - 1), &r)) goto slow;
+    regs[VM_A] = r;
+    VM_DISPATCH();
+op_mul:
+    x = regs[VM_B], y = regs[VM_C];
+    if (!(x & y & 1) || __builtin_mul_overflow(VALUE_INT(x), (int32_t)(y - 1), &r)) goto slow;
+    regs[VM_A] = r + 1;
+    VM_DISPATCH();
+op_div:
+    // A divisor of 0 is an error and SMALL_MIN / -1 leaves the range
+    x = regs[VM_B], y = regs[VM_C];
+    if (!(x & y & 1) || y == VALUE_SMALL(0) || y == VALUE_SMALL(-1)) goto slow;
+    regs[VM_A] = VALUE_SMALL(VALUE_INT(x) / VALUE_INT(y));
+    VM_DISPATCH();
+op_neg:
+    x = regs[VM_B];
+    if (!(x & 1) || x == VALUE_SMALL(SMALL_MIN)) goto slow;
+    regs[VM_A] = 2 - x;
+    VM_DISPATCH();
+op_shl:
+    x = regs[VM_B];
+    y = (x - 1) << VM_C;
+    if (!(x & 1) || (int32_t)y >> VM_C != (int32_t)(x - 1)) goto slow;
+    regs[VM_A] = y | 1;
+    VM_DISPATCH();
+slow:
+    if (algb_step(regs, img, ip - 1 - img->code) != 0) {
+        algb_runtime_error(img, ip - 1 - img->code, value_error);
+        return;
+    }
+    VM_DISPATCH();
+op_print_str:
+    algb_print_text(img, VM_BX);
+    VM_DISPATCH();
+op_print_result:
+    algb_print_result(img, VM_BX, regs[VM_A]);
+    VM_DISPATCH();
+op_solve:
+    algb_solve(regs + VM_B, VM_A);
+    VM_DISPATCH();
+op_halt:
+    return;
+
+#undef VM_A
+#undef VM_B
+#undef VM_C
+#undef VM_BX
+#undef VM_DISPATCH
+}
+
+// Register file for a run of img: the caller's array of ALGB_MAX_REGS,
+// or one from the heap when the image spills past it
+Value* algb_alloc_regs(const AlgbImage* img, Value* small) {
+    if (img->reg_count <= ALGB_MAX_REGS) return small;
+    Value* regs = kmalloc(img->reg_count * sizeof(Value));
+    if (!regs) print("Error: Out of memory\n");
+    return regs;
+}
+
+void algb_execute(const AlgbImage* img) {
+    Value small[ALGB_MAX_REGS];
+    Value* regs = algb_alloc_regs(img, small);
+    if (regs && algb_setup(img, regs) == 0) algb_interpret(img, regs, 0);
+    if (regs != small) kfree(regs);
+}
+
+// Native code tier
+//
+// Programs that have run JIT_HOT_THRESHOLD times are translated into i386
+// code in jit_arena. Translated code has the signature
+//     int native(Value* regs, const AlgbImage* img)
+// keeps regs in ebx and img in esi, and returns -1 when it reaches
+// OP_HALT. Arithmetic on small values is done inline; BigInt operands and
+// overflow call algb_step. If that fails, native code returns the
+// instruction index instead, and the interpreter resumes from there with
+// the same register file and reports the error.
+#define JIT_ARENA_SIZE (64 * 1024)
+#define JIT_CACHE_SIZE 16
+#define JIT_HOT_THRESHOLD 3
+
+typedef int (*JitFunction)(Value* regs, const AlgbImage* img);
+
+typedef struct {
+    int file_idx;
+    uint32_t checksum;      // Of the image the code was built from
+    uint32_t runs;
+    JitFunction code;
+    uint32_t code_size;
+    uint32_t interp_cycles; // Last run in each tier
+    uint32_t native_cycles;
+    uint8_t failed;         // Untranslatable; stay in the interpreter
+    uint8_t used;
+} JitEntry;
+
+static uint8_t jit_arena[JIT_ARENA_SIZE] __attribute__((aligned(4096)));
+static uint32_t jit_arena_used = 0;
+static JitEntry jit_cache[JIT_CACHE_SIZE];
+static uint8_t jit_enabled = 1;
+
+typedef struct {
+    uint8_t* p;
+    uint8_t* end;
+    int overflow;
+} JitBuffer;
+
+void jit_byte(JitBuffer* b, uint8_t v) {
+    if (b->p >= b->end) {
+        b->overflow = 1;
+        return;
+    }
+    *b->p++ = v;
+}
+
+void jit_u32(JitBuffer* b, uint32_t v) {
+    for (int i = 0; i < 4; i++) jit_byte(b, (v >> (i * 8)) & 0xFF);
+}
+
+// <opcode> <reg>, [ebx + 4 * vreg]
+void jit_mem(JitBuffer* b, uint8_t opcode, int reg, int vreg) {
+    jit_byte(b, opcode);
+    jit_byte(b, 0x83 | (reg << 3));  // mod=10 (disp32), rm=ebx
+    jit_u32(b, vreg * 4);
+}
+
+// Helpers are called with esp 16-byte aligned, as the ABI requires: the
+// prologue aligns it for the body, and each call site pads it before
+// pushing arg_bytes of arguments
+#define JIT_CALL_PAD(arg_bytes) (-(arg_bytes) & 15)
+
+void jit_call_args(JitBuffer* b, int arg_bytes) {
+    if (JIT_CALL_PAD(arg_bytes)) {
+        jit_byte(b, 0x83); jit_byte(b, 0xEC); jit_byte(b, JIT_CALL_PAD(arg_bytes));  // sub esp, pad
     }
 }
 
-void atom_save() {
-    int idx = find_file(atom_state.filename, current_dir);
-    if (idx < 0) {
-        // Create new file
-        for (int i = 0; i < MAX_FILES; i++) {
-            if (!files[i].used) {
-                idx = i;
-                files[i].used = 1;
-                strcpy(files[i].name, atom_state.filename);
-                strcpy(files[i].path, current_dir);
-                files[i].is_dir = 0;
+// Call a cdecl helper with args already pushed after jit_call_args
+void jit_call(JitBuffer* b, void* fn, int arg_bytes) {
+    jit_byte(b, 0xB8); jit_u32(b, (uint32_t)fn);    // mov eax, fn
+    jit_byte(b, 0xFF); jit_byte(b, 0xD0);           // call eax
+    jit_byte(b, 0x83); jit_byte(b, 0xC4); jit_byte(b, arg_bytes + JIT_CALL_PAD(arg_bytes));  // add esp, n
+}
+
+// mov eax, value; add esp, 4; pop esi; pop ebx; ret
+void jit_return(JitBuffer* b, uint32_t value) {
+    jit_byte(b, 0xB8); jit_u32(b, value);
+    jit_byte(b, 0x83); jit_byte(b, 0xC4); jit_byte(b, 0x04);
+    jit_byte(b, 0x5E);
+    jit_byte(b, 0x5B);
+    jit_byte(b, 0xC3);
+}
+
+// Emit a forward jmp (cc < 0) or jcc rel32; returns the rel32 field for
+// jit_land to patch
+uint8_t* jit_jump(JitBuffer* b, int cc) {
+    if (cc < 0) {
+        jit_byte(b, 0xE9);
+    } else {
+        jit_byte(b, 0x0F);
+        jit_byte(b, cc);
+    }
+    uint8_t* field = b->p;
+    jit_u32(b, 0);
+    return field;
+}
+
+// Point a jit_jump at the current position
+void jit_land(JitBuffer* b, uint8_t* field) {
+    if (b->overflow) return;
+    uint32_t rel = b->p - (field + 4);
+    for (int i = 0; i < 4; i++) field[i] = (rel >> (i * 8)) & 0xFF;
+}
+
+// algb_step(regs, img, pc), and hand over to the interpreter if it fails
+void jit_slow_path(JitBuffer* b, uint32_t pc) {
+    jit_call_args(b, 12);
+    jit_byte(b, 0x68); jit_u32(b, pc);                  // push pc
+    jit_byte(b, 0x56);                                  // push esi
+    jit_byte(b, 0x53);                                  // push ebx
+    jit_call(b, (void*)algb_step, 12);
+    jit_byte(b, 0x85); jit_byte(b, 0xC0);               // test eax, eax
+    uint8_t* ok = jit_jump(b, 0x84);                    // jz past the return
+    jit_return(b, pc);
+    jit_land(b, ok);
+}
+
+// Translate img into b; returns 0 on success
+int jit_translate(JitBuffer* b, const AlgbImage* img) {
+    enum { EAX = 0, ECX = 1, EDX = 2 };
+    enum { JO = 0x80, JZ = 0x84, JNZ = 0x85, JBE = 0x86 };
+
+    jit_byte(b, 0x53);                                          // push ebx
+    jit_byte(b, 0x56);                                          // push esi
+    jit_byte(b, 0x8B); jit_byte(b, 0x5C); jit_byte(b, 0x24); jit_byte(b, 0x0C);  // mov ebx, [esp+12]
+    jit_byte(b, 0x8B); jit_byte(b, 0x74); jit_byte(b, 0x24); jit_byte(b, 0x10);  // mov esi, [esp+16]
+    jit_byte(b, 0x83); jit_byte(b, 0xEC); jit_byte(b, 0x04);    // sub esp, 4: the call pushed 4, ebx and esi 8
+
+    for (uint32_t pc = 0; pc < img->header.code_size; pc++) {
+        uint32_t insn = img->code[pc];
+        uint32_t op = insn & 0xFF;
+        int a = (insn >> 8) & 0xFF, rb = (insn >> 16) & 0xFF, rc = insn >> 24;
+        uint32_t bx = insn >> 16;
+        uint8_t* slow[3];
+        int slow_count = 0;
+
+        // Inline fast paths work on the tagged words like the interpreter
+        // (see op_add there) and branch to the slow path on a BigInt
+        // operand or overflow
+        switch (op) {
+            case OP_HALT:
+                jit_return(b, (uint32_t)-1);
+                continue;
+            case OP_MOV:
+                jit_mem(b, 0x8B, EAX, rb);                      // mov eax, [b]
+                jit_mem(b, 0x89, EAX, a);                       // mov [a], eax
+                continue;
+            case OP_LOADK:
+                jit_mem(b, 0x8B, EAX, img->const_base + bx);
+                jit_mem(b, 0x89, EAX, a);
+                continue;
+            case OP_GETVAR:
+                jit_mem(b, 0x8B, EAX, ALGB_MAX_REGS + bx);
+                jit_mem(b, 0x89, EAX, a);
+                continue;
+            case OP_SETVAR:
+                jit_mem(b, 0x8B, EAX, a);
+                jit_mem(b, 0x89, EAX, ALGB_MAX_REGS + bx);
+                continue;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+                jit_mem(b, 0x8B, EAX, rb);                      // mov eax, [b]
+                jit_mem(b, 0x8B, EDX, rc);                      // mov edx, [c]
+                jit_byte(b, 0x89); jit_byte(b, 0xC1);           // mov ecx, eax
+                jit_byte(b, 0x21); jit_byte(b, 0xD1);           // and ecx, edx
+                jit_byte(b, 0xF6); jit_byte(b, 0xC1); jit_byte(b, 0x01);  // test cl, 1
+                slow[slow_count++] = jit_jump(b, JZ);
+                if (op == OP_ADD) {
+                    jit_byte(b, 0x48);                          // dec eax
+                    jit_byte(b, 0x01); jit_byte(b, 0xD0);       // add eax, edx
+                    slow[slow_count++] = jit_jump(b, JO);
+                } else if (op == OP_SUB) {
+                    jit_byte(b, 0x4A);                          // dec edx
+                    jit_byte(b, 0x29); jit_byte(b, 0xD0);       // sub eax, edx
+                    slow[slow_count++] = jit_jump(b, JO);
+                } else if (op == OP_MUL) {
+                    jit_byte(b, 0xD1); jit_byte(b, 0xF8);       // sar eax, 1
+                    jit_byte(b, 0x4A);                          // dec edx
+                    jit_byte(b, 0x0F); jit_byte(b, 0xAF); jit_byte(b, 0xC2);  // imul eax, edx
+                    slow[slow_count++] = jit_jump(b, JO);
+                    jit_byte(b, 0x40);                          // inc eax
+                } else {
+                    jit_byte(b, 0xD1); jit_byte(b, 0xF8);       // sar eax, 1
+                    jit_byte(b, 0x89); jit_byte(b, 0xD1);       // mov ecx, edx
+                    jit_byte(b, 0xD1); jit_byte(b, 0xF9);       // sar ecx, 1
+                    jit_byte(b, 0x8D); jit_byte(b, 0x51); jit_byte(b, 0x01);  // lea edx, [ecx+1]
+                    jit_byte(b, 0x83); jit_byte(b, 0xFA); jit_byte(b, 0x01);  // cmp edx, 1
+                    slow[slow_count++] = jit_jump(b, JBE);      // divisor 0 or -1
+                    jit_byte(b, 0x99);                          // cdq
+                    jit_byte(b, 0xF7); jit_byte(b, 0xF9);       // idiv ecx
+                    jit_byte(b, 0x8D); jit_byte(b, 0x44); jit_byte(b, 0x00); jit_byte(b, 0x01);  // lea eax, [eax+eax+1]
+                }
+                jit_mem(b, 0x89, EAX, a);                       // mov [a], eax
                 break;
-            }
+            case OP_NEG:
+                jit_mem(b, 0x8B, EAX, rb);
+                jit_byte(b, 0xA8); jit_byte(b, 0x01);           // test al, 1
+                slow[slow_count++] = jit_jump(b, JZ);
+                jit_byte(b, 0xB9); jit_u32(b, 2);               // mov ecx, 2
+                jit_byte(b, 0x29); jit_byte(b, 0xC1);           // sub ecx, eax
+                slow[slow_count++] = jit_jump(b, JO);
+                jit_mem(b, 0x89, ECX, a);                       // mov [a], ecx
+                break;
+            case OP_SHL:
+                jit_mem(b, 0x8B, EAX, rb);
+                jit_byte(b, 0xA8); jit_byte(b, 0x01);           // test al, 1
+                slow[slow_count++] = jit_jump(b, JZ);
+                jit_byte(b, 0x48);                              // dec eax
+                jit_byte(b, 0x89); jit_byte(b, 0xC2);           // mov edx, eax
+                jit_byte(b, 0xC1); jit_byte(b, 0xE0); jit_byte(b, rc);  // shl eax, c
+                jit_byte(b, 0x89); jit_byte(b, 0xC1);           // mov ecx, eax
+                jit_byte(b, 0xC1); jit_byte(b, 0xF9); jit_byte(b, rc);  // sar ecx, c
+                jit_byte(b, 0x39); jit_byte(b, 0xD1);           // cmp ecx, edx
+                slow[slow_count++] = jit_jump(b, JNZ);          // bits shifted out
+                jit_byte(b, 0x40);                              // inc eax
+                jit_mem(b, 0x89, EAX, a);
+                break;
+            case OP_POW:
+            case OP_FACT:
+                jit_slow_path(b, pc);
+                continue;
+            case OP_PRINT_STR:
+                jit_call_args(b, 8);
+                jit_byte(b, 0x68); jit_u32(b, bx);              // push text
+                jit_byte(b, 0x56);                              // push esi
+                jit_call(b, (void*)algb_print_text, 8);
+                continue;
+            case OP_PRINT_RESULT:
+                jit_call_args(b, 12);
+                jit_mem(b, 0xFF, 6, a);                         // push dword [a]
+                jit_byte(b, 0x68); jit_u32(b, bx);
+                jit_byte(b, 0x56);
+                jit_call(b, (void*)algb_print_result, 12);
+                continue;
+            case OP_SOLVE:
+                jit_call_args(b, 8);
+                jit_byte(b, 0x68); jit_u32(b, a);              // push degree
+                jit_mem(b, 0x8D, 0, rb);                        // lea eax, [block]
+                jit_byte(b, 0x50);                              // push eax
+                jit_call(b, (void*)algb_solve, 8);
+                continue;
+            default:
+                return -1;
         }
+
+        // Out-of-line slow path for the arithmetic above
+        uint8_t* done = jit_jump(b, -1);
+        for (int i = 0; i < slow_count; i++) jit_land(b, slow[i]);
+        jit_slow_path(b, pc);
+        jit_land(b, done);
     }
-    
-    if (idx >= 0 && idx < MAX_FILES) {
-        memcpy(files[idx].data, atom_state.buffer, atom_state.buffer_size);
-        files[idx].size = atom_state.buffer_size;
-        if (atom_state.buffer_size < MAX_FILESIZE) {
-            files[idx].data[atom_state.buffer_size] = '\0';
+    return b->overflow ? -1 : 0;
+}
+
+// Translate img into the arena, discarding all translations if it is full
+JitFunction jit_compile(const AlgbImage* img, uint32_t* size) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        JitBuffer b;
+        b.p = jit_arena + jit_arena_used;
+        b.end = jit_arena + JIT_ARENA_SIZE;
+        b.overflow = 0;
+        uint8_t* start = b.p;
+
+        if (jit_translate(&b, img) == 0) {
+            *size = b.p - start;
+            jit_arena_used = (b.p - jit_arena + 15) & ~15;
+            return (JitFunction)start;
         }
-        atom_state.modified = 0;
+        if (!b.overflow) return 0;
+
+        jit_arena_used = 0;
+        for (int i = 0; i < JIT_CACHE_SIZE; i++) jit_cache[i].code = 0;
     }
+    return 0;
 }
 
-void atom_insert_char(char c) {
-    if (atom_state.buffer_size < MAX_FILESIZE - 1) {
-        // Shift content right from cursor position
-        for (int i = atom_state.buffer_size; i > atom_state.cursor_pos; i--) {
-            atom_state.buffer[i] = atom_state.buffer[i - 1];
-        }
-        atom_state.buffer[atom_state.cursor_pos] = c;
-        atom_state.cursor_pos++;
-        atom_state.buffer_size++;
-        atom_state.modified = 1;
-    }
+// Give back the arena space of a one-off translation that is not in the
+// cache. It must be the latest one, so the arena shrinks back to its start.
+void jit_release(JitFunction code) {
+    if (code) jit_arena_used = (uint8_t*)code - jit_arena;
 }
 
-void atom_delete_char() {
-    if (atom_state.cursor_pos > 0) {
-        // Shift content left from cursor position
-        for (int i = atom_state.cursor_pos - 1; i < atom_state.buffer_size - 1; i++) {
-            atom_state.buffer[i] = atom_state.buffer[i + 1];
+// Hotness entry for the program in files[file_idx], reset when the file's
+// contents change. Evicts the least-run entry when the cache is full.
+JitEntry* jit_lookup(int file_idx, const char* data, uint32_t size) {
+    uint32_t checksum = symbol_hash(data, size);
+    JitEntry* victim = &jit_cache[0];
+    for (int i = 0; i < JIT_CACHE_SIZE; i++) {
+        JitEntry* e = &jit_cache[i];
+        if (e->used && e->file_idx == file_idx) {
+            if (e->checksum == checksum) return e;
+            victim = e;
+            break;
         }
-        atom_state.cursor_pos--;
-        atom_state.buffer_size--;
-        atom_state.modified = 1;
+        if (!e->used || (victim->used && e->runs < victim->runs)) victim = e;
     }
+    memset(victim, 0, sizeof(JitEntry));
+    victim->used = 1;
+    victim->file_idx = file_idx;
+    victim->checksum = checksum;
+    return victim;
 }
 
-void cmd_atom(const char* filename) {
-    if (strlen(filename) == 0) {
-        print("Usage: atom <filename>\n");
+void algb_execute_native(const AlgbImage* img, JitFunction code) {
+    Value small[ALGB_MAX_REGS];
+    Value* regs = algb_alloc_regs(img, small);
+    if (regs && algb_setup(img, regs) == 0) {
+        int resume = code(regs, img);
+        if (resume >= 0) algb_interpret(img, regs, resume);
+    }
+    if (regs != small) kfree(regs);
+}
+
+// algebra -jit [on | off | <expression>]
+void cmd_algebra_jit(const char* args) {
+    if (strcmp(args, "on") == 0 || strcmp(args, "off") == 0) {
+        jit_enabled = strcmp(args, "on") == 0;
+        print(jit_enabled ? "JIT enabled\n" : "JIT disabled\n");
         return;
     }
     
-    // Initialize atom state
-    memset(&atom_state, 0, sizeof(AtomEditor));
-    strcpy(atom_state.filename, filename);
-    
-    // Load file if exists
-    int idx = find_file(filename, current_dir);
-    if (idx >= 0) {
-        memcpy(atom_state.buffer, files[idx].data, files[idx].size);
-        atom_state.buffer_size = files[idx].size;
-        atom_state.cursor_pos = files[idx].size;
+    if (strlen(args) > 0) {
+        // Compile the expression as a one-line program and run it natively
+        AlgbImage image;
+        uint32_t size;
+        if (compile_algr(&compiler, args, strlen(args), OPT_DEFAULT) != 0) return;
+        const char* data = compile_write_image(&compiler, &size);
+        if (!data || algb_load(&image, data, size) != 0) {
+            print("Error: Expression too large\n");
+            return;
+        }
+        JitFunction code = jit_compile(&image, &size);
+        if (!code) {
+            print("Error: JIT translation failed\n");
+            return;
+        }
+        uint64_t start = rdtsc();
+        algb_execute_native(&image, code);
+        uint32_t cycles = (uint32_t)(rdtsc() - start);
+        jit_release(code);
+        print("Native: ");
+        print_num(size);
+        print(" bytes of code, ");
+        print_num(cycles);
+        print(" cycles\n");
+        return;
     }
     
-    atom_draw_screen();
+    print("JIT: ");
+    print(jit_enabled ? "enabled" : "disabled");
+    print(", compiles after ");
+    print_num(JIT_HOT_THRESHOLD);
+    print(" runs, arena ");
+    print_num(jit_arena_used);
+    print("/");
+    print_num(JIT_ARENA_SIZE);
+    print(" bytes\n");
     
-    // Editor loop
-    while (1) {
-        char c = get_key();
-        if (c) {
-            // Handle Ctrl key sequences
-            if (c == 15) { // Ctrl+O (Save)
-                atom_save();
-                atom_draw_screen();
-            } else if (c == 24) { // Ctrl+X (Exit)
-                if (atom_state.modified) {
-                    atom_save();
-                }
-                clear_screen();
-                return;
-            } else if (c == 11) { // Ctrl+K (Cut)
-                atom_cut();
-                atom_draw_screen();
-            } else if (c == 21) { // Ctrl+U (Paste)
-                atom_paste();
-                atom_draw_screen();
-            } else if (c == 6) { // Ctrl+F (Find)
-                atom_find();
-                atom_draw_screen();
-            } else if (c == 28) { // Left arrow - move cursor left
-                if (atom_state.cursor_pos > 0) {
-                    atom_state.cursor_pos--;
-                }
-                atom_draw_screen();
-            } else if (c == 29) { // Right arrow - move cursor right
-                if (atom_state.cursor_pos < atom_state.buffer_size) {
-                    atom_state.cursor_pos++;
-                }
-                atom_draw_screen();
-            } else if (c == '\n') {
-                atom_insert_char('\n');
-                atom_draw_screen();
-            } else if (c == '\b') {
-                atom_delete_char();
-                atom_draw_screen();
-            } else if (c >= 32 && c <= 126) {
-                atom_insert_char(c);
-                atom_draw_screen();
-            }
+    int shown = 0;
+    for (int i = 0; i < JIT_CACHE_SIZE; i++) {
+        JitEntry* e = &jit_cache[i];
+        if (!e->used || !files[e->file_idx].used) continue;
+        print("  ");
+        print(files[e->file_idx].name);
+        print(": ");
+        print_num(e->runs);
+        print(" runs, ");
+        if (e->code) {
+            print("native (");
+            print_num(e->code_size);
+            print(" bytes)");
+        } else {
+            print(e->failed ? "interpreted (untranslatable)" : "interpreted");
+        }
+        if (e->interp_cycles) {
+            print(", interpreter ");
+            print_num(e->interp_cycles);
+            print(" cycles");
+        }
+        if (e->native_cycles) {
+            print(", native ");
+            print_num(e->native_cycles);
+            print(" cycles");
         }
+        print("\n");
+        shown = 1;
     }
+    if (!shown) print("  (no programs run yet)\n");
 }
 
 void cmd_build(const char* args) {
-    // Parse: build -algr -algebra input.algr -o output.algebra
+    // Parse: build -algr -algebra [-O<level>] input.algr -o output.algebra
     char input_file[MAX_FILENAME] = {0};
     char output_file[MAX_FILENAME] = {0};
     int is_algr = 0;
     int is_algebra = 0;
+    int opt_level = OPT_DEFAULT;
+    int show_opt = 0;
     
     // Simple tokenizer
     char tokens[10][MAX_FILENAME];
@@ -1171,6 +7966,16 @@ void cmd_build(const char* args) {
             is_algr = 1;
         } else if (strcmp(tokens[i], "-algebra") == 0) {
             is_algebra = 1;
+        } else if (tokens[i][0] == '-' && tokens[i][1] == 'O') {
+            // -O alone means -O1, like gcc
+            opt_level = tokens[i][2] ? tokens[i][2] - '0' : OPT_FOLD;
+            if (opt_level < OPT_NONE || opt_level > OPT_CSE || (tokens[i][2] && tokens[i][3])) {
+                print("Error: Unknown optimization level: ");
+                print(tokens[i]);
+                print("\n");
+                return;
+            }
+            show_opt = 1;
         } else if (strcmp(tokens[i], "-o") == 0) {
             if (i + 1 < token_count) {
                 strcpy(output_file, tokens[i + 1]);
@@ -1187,12 +7992,12 @@ void cmd_build(const char* args) {
     }
     
     if (!is_algr || !is_algebra || strlen(input_file) == 0 || strlen(output_file) == 0) {
-        print("Usage: build -algr -algebra <input.algr> -o <output.algebra>\n");
+        print("Usage: build -algr -algebra [-O0|-O1|-O2] <input.algr> -o <output.algebra>\n");
         return;
     }
     
     // Find input file
-    int idx = find_file(input_file, current_dir);
+    int idx = find_file(input_file, current_dir_id);
     if (idx < 0) {
         print("Error: Input file not found: ");
         print(input_file);
@@ -1200,46 +8005,67 @@ void cmd_build(const char* args) {
         return;
     }
     
-    // Create output file (compiled format)
-    int out_idx = find_file(output_file, current_dir);
-    if (out_idx < 0) {
-        for (int i = 0; i < MAX_FILES; i++) {
-            if (!files[i].used) {
-                out_idx = i;
-                files[i].used = 1;
-                strcpy(files[i].name, output_file);
-                strcpy(files[i].path, current_dir);
-                files[i].size = 0;
-                files[i].is_dir = 0;
-                break;
-            }
+    const char* source = file_data(idx);
+    if (!source) {
+        print("Error: Out of memory\n");
+        return;
+    }
+    
+    // Tokenize and parse once; the image needs no string parsing at run time.
+    // With an explicit -O, build unoptimized first to report the savings.
+    int unoptimized = 0;
+    if (show_opt && opt_level > OPT_NONE &&
+        compile_algr(&compiler, source, files[idx].size, OPT_NONE) == 0) {
+        unoptimized = compiler.code_size;
+    }
+    if (compile_algr(&compiler, source, files[idx].size, opt_level) != 0) {
+        print("Build failed: ");
+        print(input_file);
+        print("\n");
+        return;
+    }
+    if (show_opt) {
+        print("Optimizer -O");
+        print_num(opt_level);
+        print(": ");
+        if (opt_level > OPT_NONE) {
+            print_num(unoptimized);
+            print(" -> ");
         }
+        print_num(compiler.code_size);
+        print(" instructions\n");
     }
     
+    // Create output file (compiled format)
+    int out_idx = find_file(output_file, current_dir_id);
+    if (out_idx < 0) out_idx = create_file(output_file, current_dir_id);
+    
     if (out_idx < 0) {
         print("Error: Cannot create output file\n");
         return;
     }
     
-    // Copy and mark as compiled (add header)
-    const char* header = "[ALGR-COMPILED]\n";
-    int header_len = strlen(header);
-    
-    if (header_len + files[idx].size < MAX_FILESIZE) {
-        memcpy(files[out_idx].data, header, header_len);
-        memcpy(files[out_idx].data + header_len, files[idx].data, files[idx].size);
-        files[out_idx].size = header_len + files[idx].size;
-        if (files[out_idx].size < MAX_FILESIZE) {
-            files[out_idx].data[files[out_idx].size] = '\0';
+    // Images go through the scratch buffer so the file only holds what it needs
+    uint32_t image_size;
+    const char* image = compile_write_image(&compiler, &image_size);
+    if (image) {
+        file_truncate(out_idx);
+        if (file_append(out_idx, image, image_size) != 0) {
+            print("Error: ");
+            print(fs_error);
+            print("\n");
+            return;
         }
         
         print("Build successful: ");
         print(input_file);
         print(" -> ");
         print(output_file);
-        print("\n");
+        print(" (");
+        print_num(image_size);
+        print(" bytes)\n");
     } else {
-        print("Error: Output file too large\n");
+        print("Error: Out of memory\n");
     }
 }
 
@@ -1249,7 +8075,7 @@ void cmd_run_algebra(const char* filename) {
         return;
     }
     
-    int idx = find_file(filename, current_dir);
+    int idx = find_file(filename, current_dir_id);
     if (idx < 0) {
         print("Error: File not found: ");
         print(filename);
@@ -1257,12 +8083,15 @@ void cmd_run_algebra(const char* filename) {
         return;
     }
     
-    // Check if it's a compiled .algebra file
-    const char* header = "[ALGR-COMPILED]\n";
-    int header_len = strlen(header);
+    // Images are small and written in one go, so this rarely has to merge
+    const char* data = file_data(idx);
+    if (!data) {
+        print("Error: Out of memory\n");
+        return;
+    }
     
-    if (files[idx].size < (uint32_t)header_len || 
-        strncmp(files[idx].data, header, header_len) != 0) {
+    AlgbImage image;
+    if (algb_load(&image, data, files[idx].size) != 0) {
         print("Error: Not a valid .algebra executable\n");
         print("Use 'build -algr -algebra source.algr -o output.algebra' to compile\n");
         return;
@@ -1272,13 +8101,56 @@ void cmd_run_algebra(const char* filename) {
     print(filename);
     print(":\n");
     
-    // Execute the code (skip header)
+    JitEntry* jit = jit_lookup(idx, data, files[idx].size);
+    jit->runs++;
+    if (jit_enabled && !jit->code && !jit->failed && jit->runs >= JIT_HOT_THRESHOLD) {
+        jit->code = jit_compile(&image, &jit->code_size);
+        if (!jit->code) jit->failed = 1;
+    }
+    
+    uint64_t start = rdtsc();
+    if (jit_enabled && jit->code) {
+        algb_execute_native(&image, jit->code);
+        jit->native_cycles = (uint32_t)(rdtsc() - start);
+    } else {
+        algb_execute(&image);
+        jit->interp_cycles = (uint32_t)(rdtsc() - start);
+    }
+    
+    print("Program terminated.\n");
+}
+
+// Text-walking interpreter that ./<file.algebra> used before programs were
+// compiled; kept as the baseline for algebra-bench
+void execute_print_statement(const char* line) {
+    // Format: print("text");
+    const char* start = line;
+    while (*start && *start != '(') start++;
+    if (!*start) return;
+    
+    start++;  // Skip '('
+    while (*start && *start == ' ') start++;
+    
+    if (*start != '"') return;
+    start++;  // Skip opening quote
+    
+    char buffer[512];
+    int i = 0;
+    while (*start && *start != '"' && i < 510) {
+        buffer[i++] = *start++;
+    }
+    buffer[i] = '\0';
+    
+    process_escape_sequences(buffer);
+    print(buffer);
+}
+
+void interpret_algr_text(const char* data, uint32_t size) {
     char line[256];
     int line_pos = 0;
-    int line_num = 1;
     
-    for (uint32_t i = header_len; i <= files[idx].size; i++) {
-        char c = (i < files[idx].size) ? files[idx].data[i] : '\n';
+    for (uint32_t i = 0; i <= size; i++) {
+        char c = (i < size) ? data[i] : '\n';
         
         if (c == '\n' || c == ';') {
             if (line_pos > 0) {
@@ -1293,7 +8165,6 @@ void cmd_run_algebra(const char* filename) {
                 }
                 
                 if (!is_empty && line[0] != '#' && line[0] != '/') {
-                    // Check if it's a print statement
                     if (strncmp(line, "print", 5) == 0) {
                         execute_print_statement(line);
                     } else {
@@ -1308,24 +8179,135 @@ void cmd_run_algebra(const char* filename) {
                         } else if (has_eq) {
                             print("Error: Assignment not supported\n");
                         } else {
-                            int result = eval_expr(line);
+                            eval_error = 0;
+                            Value result = eval_expr(line);
                             print(line);
                             print(" = ");
-                            print_num(result);
+                            print_value(result);
                             print("\n");
                         }
                     }
                 }
                 
                 line_pos = 0;
-                line_num++;
             }
         } else if (line_pos < 255) {
             line[line_pos++] = c;
         }
     }
+}
+
+void cmd_algebra_bench(const char* args) {
+    // Parse: algebra-bench <file.algr> [runs]
+    char filename[MAX_FILENAME];
+    const char* p = args;
+    int i = 0;
+    while (*p && !is_space(*p) && i < MAX_FILENAME - 1) {
+        filename[i++] = *p++;
+    }
+    filename[i] = '\0';
+    Value runs_value = parse_number(&p);
+    int runs = VALUE_IS_SMALL(runs_value) ? VALUE_INT(runs_value) : 0;
+    if (runs <= 0) runs = 1000;
+    
+    if (strlen(filename) == 0) {
+        print("Usage: algebra-bench <file.algr> [runs]\n");
+        return;
+    }
+    
+    int idx = find_file(filename, current_dir_id);
+    if (idx < 0) {
+        print("Error: File not found: ");
+        print(filename);
+        print("\n");
+        return;
+    }
+    
+    const char* source = file_data(idx);
+    if (!source) {
+        print("Error: Out of memory\n");
+        return;
+    }
+    
+    uint64_t start = rdtsc();
+    int failed = compile_algr(&compiler, source, files[idx].size, OPT_DEFAULT);
+    uint32_t build_cycles = (uint32_t)(rdtsc() - start);
+    if (failed) return;
+    
+    AlgbImage image;
+    uint32_t image_size;
+    const char* data = compile_write_image(&compiler, &image_size);
+    if (!data || algb_load(&image, data, image_size) != 0) {
+        print("Error: Out of memory\n");
+        return;
+    }
+    
+    // Best-of-N cycle counts with console output dropped, so only parsing,
+    // dispatch and arithmetic are measured
+    uint32_t native_size = 0;
+    JitFunction native = jit_compile(&image, &native_size);
+    
+    // Each run's BigInts are dropped before the next one
+    uint32_t text_best = 0xFFFFFFFF, vm_best = 0xFFFFFFFF, native_best = 0xFFFFFFFF;
+    uint32_t mark = bn_mark();
+    console_muted = 1;
+    for (int r = 0; r < runs; r++) {
+        start = rdtsc();
+        interpret_algr_text(source, files[idx].size);
+        uint32_t cycles = (uint32_t)(rdtsc() - start);
+        if (cycles < text_best) text_best = cycles;
+        bn_release(mark);
+        
+        start = rdtsc();
+        algb_execute(&image);
+        cycles = (uint32_t)(rdtsc() - start);
+        if (cycles < vm_best) vm_best = cycles;
+        bn_release(mark);
+        
+        if (native) {
+            start = rdtsc();
+            algb_execute_native(&image, native);
+            cycles = (uint32_t)(rdtsc() - start);
+            if (cycles < native_best) native_best = cycles;
+            bn_release(mark);
+        }
+    }
+    console_muted = 0;
+    jit_release(native);
+    if (vm_best == 0) vm_best = 1;
     
-    print("Program terminated.\n");
+    print("Benchmark: ");
+    print(filename);
+    print(" (best of ");
+    print_num(runs);
+    print(" runs)\n");
+    print("  Build (once):          ");
+    print_num(build_cycles);
+    print(" cycles\n");
+    print("  Text interpreter:      ");
+    print_num(text_best);
+    print(" cycles/run\n");
+    print("  Register VM:           ");
+    print_num(vm_best);
+    print(" cycles/run\n");
+    print("  Speedup over text:     ");
+    print_num(text_best / vm_best);
+    print(".");
+    print_num((text_best % vm_best) * 10 / vm_best);
+    print("x\n");
+    if (native) {
+        if (native_best == 0) native_best = 1;
+        print("  Native (JIT):          ");
+        print_num(native_best);
+        print(" cycles/run (");
+        print_num(native_size);
+        print(" bytes of code)\n");
+        print("  Speedup over VM:       ");
+        print_num(vm_best / native_best);
+        print(".");
+        print_num((vm_best % native_best) * 10 / native_best);
+        print("x\n");
+    }
 }
 
 void cmd_echo(const char* args) {
@@ -1382,19 +8364,8 @@ void cmd_echo(const char* args) {
     }
     
     // Find or create file
-    int idx = find_file(filename, current_dir);
-    if (idx < 0) {
-        for (int j = 0; j < MAX_FILES; j++) {
-            if (!files[j].used) {
-                idx = j;
-                files[j].used = 1;
-                strcpy(files[j].name, filename);
-                strcpy(files[j].path, current_dir);
-                files[j].size = 0;
-                break;
-            }
-        }
-    }
+    int idx = find_file(filename, current_dir_id);
+    if (idx < 0) idx = create_file(filename, current_dir_id);
     
     if (idx < 0) {
         print("Error: Cannot create file\n");
@@ -1403,20 +8374,18 @@ void cmd_echo(const char* args) {
     
     // Write to file
     if (!append) {
-        files[idx].size = 0; // Overwrite
+        file_truncate(idx); // Overwrite
     }
     
     int len = strlen(text);
-    if (files[idx].size + len + 1 < MAX_FILESIZE) {
-        memcpy(files[idx].data + files[idx].size, text, len);
-        files[idx].size += len;
-        files[idx].data[files[idx].size++] = '\n';
-        files[idx].data[files[idx].size] = '\0';
+    if (file_append(idx, text, len) == 0 && file_append(idx, "\n", 1) == 0) {
         print("Written to ");
         print(filename);
         print("\n");
     } else {
-        print("Error: File size limit exceeded\n");
+        print("Error: ");
+        print(fs_error);
+        print("\n");
     }
 }
 
@@ -1426,7 +8395,7 @@ void cmd_touch(const char* filename) {
         return;
     }
     
-    int idx = find_file(filename, current_dir);
+    int idx = find_file(filename, current_dir_id);
     if (idx >= 0) {
         print("File already exists: ");
         print(filename);
@@ -1434,18 +8403,11 @@ void cmd_touch(const char* filename) {
         return;
     }
     
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (!files[i].used) {
-            files[i].used = 1;
-            strcpy(files[i].name, filename);
-            strcpy(files[i].path, current_dir);
-            files[i].size = 0;
-            files[i].data[0] = '\0';
-            print("File created: ");
-            print(filename);
-            print("\n");
-            return;
-        }
+    if (create_file(filename, current_dir_id) >= 0) {
+        print("File created: ");
+        print(filename);
+        print("\n");
+        return;
     }
     print("Error: Maximum files reached\n");
 }
@@ -1533,14 +8495,8 @@ void cmd_ping(const char* host) {
 
 void cmd_netstat() {
     // Calculate real network stats based on kernel state
-    int total_files = 0;
-    int total_bytes = 0;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used) {
-            total_files++;
-            total_bytes += files[i].size;
-        }
-    }
+    int total_files = fs_stats.files;
+    int total_bytes = fs_stats.bytes;
     
     int rx_packets = history_count * 100 + total_files * 50;
     int tx_packets = history_count * 80 + total_files * 40;
@@ -1606,14 +8562,8 @@ void cmd_ipconfig() {
 
 void cmd_fps() {
     // Calculate real metrics based on kernel state
-    int total_files = 0;
-    uint32_t total_memory = 0;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used) {
-            total_files++;
-            total_memory += files[i].size;
-        }
-    }
+    int total_files = fs_stats.files;
+    uint32_t total_memory = fs_stats.bytes;
     
     int cpu_usage = 15 + (history_count * 2);  // Increases with command history
     if (cpu_usage > 85) cpu_usage = 85;
@@ -1660,14 +8610,8 @@ void cmd_fps() {
 
 void cmd_systeminfo() {
     // Calculate real memory usage
-    int total_files = 0;
-    uint32_t total_memory = 0;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used) {
-            total_files++;
-            total_memory += files[i].size;
-        }
-    }
+    int total_files = fs_stats.files;
+    uint32_t total_memory = fs_stats.bytes;
     
     int available_memory = 512 - ((total_memory / 1024) + 50);
     if (available_memory < 0) available_memory = 0;
@@ -1686,7 +8630,7 @@ void cmd_systeminfo() {
     print_num(total_files);
     print("\n");
     print("Commands Executed: ");
-    print_num(history_count);
+    print_num(shell_stats.commands);
     print("\n");
     print("System Boot Time: 2025-12-20 10:45:32\n");
     print("Time Zone: UTC+0\n");
@@ -1701,6 +8645,208 @@ void cmd_systeminfo() {
     }
 }
 
+void print_hex(uint32_t value) {
+    static const char digits[] = "0123456789ABCDEF";
+    print("0x");
+    for (int shift = 28; shift >= 0; shift -= 4) putchar(digits[(value >> shift) & 15]);
+}
+
+// Tables that scale with the RAM we boot with: the file table, the block
+// cache and the big number arenas. tables_init takes them from the frame
+// allocator before anything uses them, each a fixed share of the free
+// memory within a floor and a ceiling; meminfo lists what they got. At
+// QEMU's default 128 MB this gives 16384 files and a 1 MB block cache.
+#define MAX_BOOT_TABLES 8
+
+typedef struct {
+    const char* name;
+    uint32_t count;
+    const char* unit;
+    uint32_t frames;
+} BootTable;
+
+static BootTable boot_tables[MAX_BOOT_TABLES];
+static int boot_table_count = 0;
+
+// One per kb_per_unit KB of free memory, within [min, max]; power2 rounds
+// down to a power of two for tables that are hashed with a mask
+uint32_t tables_scale(uint32_t free_kb, uint32_t kb_per_unit, uint32_t min, uint32_t max, int power2) {
+    uint32_t n = free_kb / kb_per_unit;
+    if (n < min) n = min;
+    if (n > max) n = max;
+    if (power2) {
+        while (n & (n - 1)) n &= n - 1;
+    }
+    return n;
+}
+
+void* tables_alloc(const char* name, uint32_t count, const char* unit, uint32_t bytes) {
+    uint32_t frames = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    void* p = pmm_alloc(frames);
+    if (!p || boot_table_count == MAX_BOOT_TABLES) {
+        print("Error: Not enough memory for the ");
+        print(name);
+        print(" table\n");
+        while (1) asm volatile("cli; hlt");
+    }
+    memset(p, 0, frames * PAGE_SIZE);
+    BootTable* t = &boot_tables[boot_table_count++];
+    t->name = name;
+    t->count = count;
+    t->unit = unit;
+    t->frames = frames;
+    return p;
+}
+
+void tables_init() {
+    uint32_t free_kb = (pmm_total - pmm_used) * (PAGE_SIZE / 1024);
+    
+    max_files = tables_scale(free_kb, 6, 256, 262144, 1);
+    files = tables_alloc("Files", max_files, "slots", max_files * sizeof(File));
+    file_buckets = tables_alloc("File hash", FILE_HASH_SIZE, "chains", FILE_HASH_SIZE * sizeof(int32_t));
+    
+    bcache_blocks = tables_scale(free_kb, 96, 64, 16384, 1);
+    bcache = tables_alloc("Block cache", bcache_blocks, "blocks",
+                          bcache_blocks * (sizeof(Buffer) + AFS_BLOCK_SIZE + sizeof(int32_t)));
+    bcache_data = (uint8_t (*)[AFS_BLOCK_SIZE])(bcache + bcache_blocks);
+    bcache_order = (int32_t*)(bcache_data + bcache_blocks);
+    bcache_buckets = tables_alloc("Cache hash", BCACHE_HASH, "chains", BCACHE_HASH * sizeof(int32_t));
+    
+    // The arena gets 1/32 of free memory, each variable semispace 1/16 of that
+    bn_arena_words = tables_scale(free_kb, 1, 32 * 1024, 2 * 1024 * 1024, 0) * 8;
+    bn_arena = tables_alloc("Big numbers", bn_arena_words, "words", bn_arena_words * sizeof(uint32_t));
+    var_heap_words = bn_arena_words / 16;
+    var_heap[0] = tables_alloc("Variables", var_heap_words * 2, "words", var_heap_words * 2 * sizeof(uint32_t));
+    var_heap[1] = var_heap[0] + var_heap_words;
+}
+
+void print_kb_frames(const char* label, uint32_t frames) {
+    print(label);
+    print_num(frames * (PAGE_SIZE / 1024));
+    print(" KB (");
+    print_num(frames);
+    print(" frames)\n");
+}
+
+void cmd_meminfo() {
+    static const char* const types[] = { "unknown", "available", "reserved", "ACPI reclaimable", "ACPI NVS", "bad" };
+    if (!pmm_bitmap) {
+        print("No memory map from the boot loader\n");
+        return;
+    }
+    print("Physical memory (4 KB frames)\n");
+    print_kb_frames("  Total: ", pmm_total);
+    print_kb_frames("  Used:  ", pmm_used);
+    print_kb_frames("  Free:  ", pmm_total - pmm_used);
+    print("Kernel heap: ");
+    print_num(kheap_bytes);
+    print(" bytes allocated\n");
+    for (int c = 0; c < KHEAP_CLASSES; c++) {
+        if (!kheap_caches[c].slabs) continue;
+        print("  ");
+        print_num(1 << (KHEAP_MIN_SHIFT + c));
+        print("-byte objects: ");
+        print_num(kheap_caches[c].objects);
+        print(" in ");
+        print_num(kheap_caches[c].slabs);
+        print(" slabs\n");
+    }
+    if (kheap_large_frames) print_kb_frames("  Large objects: ", kheap_large_frames);
+    print("Kernel tables (sized at boot):\n");
+    for (int i = 0; i < boot_table_count; i++) {
+        BootTable* t = &boot_tables[i];
+        print("  ");
+        print(t->name);
+        print(": ");
+        print_num(t->count);
+        print(" ");
+        print(t->unit);
+        print(", ");
+        print_kb_frames("", t->frames);
+    }
+    print("Memory map:\n");
+    for (int i = 0; i < pmm_region_count; i++) {
+        MemRegion* r = &pmm_regions[i];
+        if (r->base >> 32) continue;
+        uint64_t end = r->base + r->length - 1;
+        print("  ");
+        print_hex(r->base);
+        print(" - ");
+        print_hex(end >> 32 ? 0xFFFFFFFF : (uint32_t)end);
+        print("  ");
+        print(types[r->type < 6 ? r->type : 0]);
+        print("\n");
+    }
+}
+
+// Everything the stats commands report, from running counters
+void cmd_stat() {
+    print("File system\n");
+    print("  Files:        ");
+    print_num(fs_stats.files);
+    print(" (");
+    print_num(max_files - fs_stats.files);
+    print(" free slots)\n");
+    print("  Directories:  ");
+    print_num(fs_stats.dirs);
+    print(" (");
+    print_num(MAX_DIRS - fs_stats.dirs);
+    print(" free slots)\n");
+    print("  Bytes stored: ");
+    print_num(fs_stats.bytes);
+    print(" in ");
+    print_num(fs_stats.extents);
+    print(" extents\n");
+    print("  Disk:         ");
+    if (afs_mounted) {
+        print_num((afs_super.block_count - afs_super.free_blocks) * (AFS_BLOCK_SIZE / 1024));
+        print(" KB used of ");
+        print_num(afs_super.block_count * (AFS_BLOCK_SIZE / 1024));
+        print(" KB on /mnt/c, ");
+        print_num(afs_super.free_inodes);
+        print(" free inodes\n");
+        print("  Cache:        ");
+        print_num(bcache_hits);
+        print(" hits, ");
+        print_num(bcache_misses);
+        print(" misses, ");
+        print_num(bcache_dirty);
+        print(" dirty, ");
+        print_num(bcache_writes);
+        print(" blocks written\n");
+    } else {
+        print("not mounted\n");
+    }
+    print("Memory\n");
+    print("  Frames:       ");
+    print_num(pmm_used);
+    print(" used of ");
+    print_num(pmm_total);
+    print("\n");
+    print("  Heap:         ");
+    print_num(kheap_bytes);
+    print(" bytes allocated\n");
+    print("Shell\n");
+    print("  Commands:     ");
+    print_num(shell_stats.commands);
+    print("\n");
+}
+
+void cmd_sync() {
+    if (!afs_mounted) {
+        print("Nothing to sync: no disk mounted\n");
+        return;
+    }
+    int written = bcache_flush();
+    if (written < 0) {
+        print("Error: Disk I/O error\n");
+        return;
+    }
+    print("Synced ");
+    print_num(written);
+    print(" blocks to disk\n");
+}
+
 void init_wifi_networks() {
     wifi_networks_count = 0;
     
@@ -1905,14 +9051,8 @@ void cmd_wifi(const char* args) {
 
 void cmd_pcinfo() {
     // Calculate real stats
-    int total_files = 0;
-    uint32_t total_memory = 0;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used) {
-            total_files++;
-            total_memory += files[i].size;
-        }
-    }
+    int total_files = fs_stats.files;
+    uint32_t total_memory = fs_stats.bytes;
     
     int memory_used = (total_memory / 1024) + 50;
     if (memory_used > 500) memory_used = 500;
@@ -2005,13 +9145,15 @@ void cmd_pcinfo() {
     print("Total Files: ");
     print_num(total_files);
     print("\n");
-    print("Total Directories: 6\n");
+    print("Total Directories: ");
+    print_num(fs_stats.dirs);
+    print("\n");
     print("Storage Used: ");
     print_num(total_memory);
     print(" bytes\n");
     print("Storage Capacity: ");
-    print_num(MAX_FILES * MAX_FILESIZE);
-    print(" bytes\n");
+    print_num((pmm_total - pmm_used) * (PAGE_SIZE / 1024));
+    print(" KB free\n");
     print("\n");
     
     print("========================================\n");
@@ -2049,6 +9191,7 @@ void cmd_reboot() {
     print("Shutting down services...\n");
     print("Clearing memory...\n");
     print("Syncing filesystem...\n");
+    bcache_flush();
     print("\n");
     print("System halted. Restarting...\n");
     print("\n\n");
@@ -2057,9 +9200,11 @@ void cmd_reboot() {
     clear_screen();
     history_count = 0;
     history_index = -1;
+    memset(&shell_stats, 0, sizeof(shell_stats));
     memset(connected_ssid, 0, sizeof(connected_ssid));
     is_connected = 0;
     strcpy(current_dir, "/");
+    current_dir_id = 0;
     
     // Show boot message
     print("Algebra OS v3.6 - System Boot\n");
@@ -2074,6 +9219,11 @@ void cmd_reboot() {
 void process_command(char* cmd) {
     while (*cmd == ' ') cmd++;
     if (*cmd == '\0') return;
+    shell_stats.commands++;
+    
+    // BigInts from the previous command are dead; shell variables keep
+    // their own copies (see value_persist)
+    bn_release(0);
     
     char* args = cmd;
     while (*args && *args != ' ') args++;
@@ -2086,12 +9236,14 @@ void process_command(char* cmd) {
     if (strcmp(cmd, "help") == 0) {
         print("Available commands:\n");
         print("  ls/dir        cd <dir>           mkdir <name>       touch <file>\n");
-        print("  echo > <file> cat <file>         rm <file>          ping <host>\n");
+        print("  echo > <file> cat <file>         rm [-r] <path>     ping <host>\n");
+        print("  cp <src> <dst> mv <src> <dst>\n");
         print("  netstat       ipconfig           wifi -list         wifi -connect\n");
         print("  wifi -status  wifi -disconnect   fps                systeminfo\n");
         print("  pcinfo        algebra <expr>     algebra-writeline  atom <file>\n");
         print("  build -algr   -algebra <input>   -o <output>        ./<file.algebra>\n");
-        print("  clear         reboot             help\n");
+        print("  algebra-bench <file.algr> [runs]   meminfo            stat\n");
+        print("  sync          clear              reboot             help\n");
     } else if (strcmp(cmd, "ls") == 0 || strcmp(cmd, "dir") == 0) {
         cmd_ls();
     } else if (strcmp(cmd, "cd") == 0) {
@@ -2104,6 +9256,10 @@ void process_command(char* cmd) {
         cmd_echo(args);
     } else if (strcmp(cmd, "rm") == 0) {
         cmd_rm(args);
+    } else if (strcmp(cmd, "cp") == 0) {
+        cmd_cp(args);
+    } else if (strcmp(cmd, "mv") == 0) {
+        cmd_mv(args);
     } else if (strcmp(cmd, "cat") == 0) {
         cmd_cat(args);
     } else if (strcmp(cmd, "ping") == 0) {
@@ -2120,10 +9276,18 @@ void process_command(char* cmd) {
         cmd_systeminfo();
     } else if (strcmp(cmd, "pcinfo") == 0) {
         cmd_pcinfo();
+    } else if (strcmp(cmd, "meminfo") == 0) {
+        cmd_meminfo();
+    } else if (strcmp(cmd, "stat") == 0) {
+        cmd_stat();
+    } else if (strcmp(cmd, "sync") == 0) {
+        cmd_sync();
     } else if (strcmp(cmd, "algebra") == 0) {
         cmd_algebra(args);
     } else if (strcmp(cmd, "algebra-writeline") == 0) {
         cmd_algebra_writeline(args);
+    } else if (strcmp(cmd, "algebra-bench") == 0) {
+        cmd_algebra_bench(args);
     } else if (strcmp(cmd, "atom") == 0) {
         cmd_atom(args);
     } else if (strcmp(cmd, "build") == 0) {
@@ -2206,7 +9370,7 @@ void shell() {
                         // Clear current line
                         int prompt_x = cursor_x - input_pos;
                         for (int i = 0; i < input_pos; i++) {
-                            vga[cursor_y * VGA_WIDTH + prompt_x + i] = (WHITE_ON_BLACK << 8) | ' ';
+                            console_put(prompt_x + i, cursor_y, (WHITE_ON_BLACK << 8) | ' ');
                         }
                         cursor_x = prompt_x;
                         
@@ -2220,7 +9384,7 @@ void shell() {
                     // Clear current line
                     int prompt_x = cursor_x - input_pos;
                     for (int i = 0; i < input_pos; i++) {
-                        vga[cursor_y * VGA_WIDTH + prompt_x + i] = (WHITE_ON_BLACK << 8) | ' ';
+                        console_put(prompt_x + i, cursor_y, (WHITE_ON_BLACK << 8) | ' ');
                     }
                     cursor_x = prompt_x;
                     
@@ -2258,7 +9422,7 @@ void shell() {
                     if (input_pos > 0) {
                         input_pos--;
                         // Erase character on screen
-                        vga[cursor_y * VGA_WIDTH + cursor_x] = (WHITE_ON_BLACK << 8) | ' ';
+                        console_put(cursor_x, cursor_y, (WHITE_ON_BLACK << 8) | ' ');
                         if (cursor_x > 0) {
                             cursor_x--;
                         }
@@ -2272,9 +9436,18 @@ void shell() {
     }
 }
 
-void kernel_main() {
+void kernel_main(uint32_t magic, const MultibootInfo* mbi) {
+    fpu_init();
+    if (magic == MULTIBOOT_BOOTLOADER_MAGIC) pmm_init(mbi);
     clear_screen();
+    cursor_enable();
+    tables_init();
     init_fs();
+    bcache_init();
+    if (ata_init() && afs_mount(find_dir("/mnt/c", 0)) < 0) {
+        print("Warning: No AFS file system on the disk, /mnt/c is in memory only\n");
+    }
+    preload_modules();
     shell();
 }
 
@@ -2287,11 +9460,27 @@ struct multiboot_header {
 __attribute__((section(".multiboot")))
 struct multiboot_header mb_header = {
     .magic = 0x1BADB002,
-    .flags = 0x00000000,
-    .checksum = -(0x1BADB002 + 0x00000000)
+    .flags = 0x00000003,                // Page-aligned modules, memory map
+    .checksum = -(0x1BADB002 + 0x00000003)
 };
 
-__attribute__((section(".text.boot")))
-void _start() {
-    kernel_main();
-}
+// The boot loader leaves ESP undefined, so set up our own stack before
+// entering C, and hand over the multiboot magic and info pointer
+asm(".section .bss\n"
+    ".align 16\n"
+    "boot_stack:\n"
+    ".skip 16384\n"
+    "boot_stack_top:\n"
+    ".section .text.boot, \"ax\"\n"
+    ".global _start\n"
+    "_start:\n"
+    "    mov $boot_stack_top, %esp\n"
+    "    and $-16, %esp\n"           // 16-byte aligned at the call, as
+    "    sub $8, %esp\n"             // the SysV ABI expects for SSE spills
+    "    push %ebx\n"
+    "    push %eax\n"
+    "    call kernel_main\n"
+    "1:  cli\n"
+    "    hlt\n"
+    "    jmp 1b\n"
+    ".text\n");
@@ -0,0 +1,297 @@
+// fsck-afs.c - Check an AFS disk image, and optionally repair it
+//
+// Usage: fsck-afs [-f] <image>
+//
+// Walks the tree from the root, checking that every entry names a live
+// inode of the right type, that each inode is reached exactly once and
+// that no block is claimed twice or lies outside the data area. The
+// bitmaps and free counts are then compared with what the walk found.
+// With -f, orphaned inodes are freed and the bitmaps and counts rewritten
+// from the walk. Exit status: 0 clean, 1 errors fixed, 4 errors left,
+// 8 if the image could not be checked at all.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../afs.h"
+
+static FILE* image;
+static AfsSuper sb;
+static uint8_t* inode_map;          // Bitmaps as stored on disk
+static uint8_t* block_map;
+static uint8_t* inode_seen;         // Bitmaps rebuilt by the walk
+static uint8_t* block_seen;
+static int errors = 0;
+
+static int test_bit(const uint8_t* map, uint32_t n) {
+    return map[n >> 3] >> (n & 7) & 1;
+}
+
+static void set_bit(uint8_t* map, uint32_t n, int value) {
+    if (value) map[n >> 3] |= 1 << (n & 7);
+    else map[n >> 3] &= ~(1 << (n & 7));
+}
+
+static void io_block(uint32_t block, void* buf, int write) {
+    size_t done;
+    if (fseek(image, (long)block * AFS_BLOCK_SIZE, SEEK_SET) != 0) done = 0;
+    else if (write) done = fwrite(buf, AFS_BLOCK_SIZE, 1, image);
+    else done = fread(buf, AFS_BLOCK_SIZE, 1, image);
+    if (done != 1) {
+        fprintf(stderr, "fsck-afs: cannot %s block %u\n", write ? "write" : "read", block);
+        exit(4);
+    }
+}
+
+static void problem(const char* fmt, uint32_t a, uint32_t b) {
+    printf("  ");
+    printf(fmt, a, b);
+    printf("\n");
+    errors++;
+}
+
+static void inode_io(uint32_t ino, AfsInode* inode, int write) {
+    uint8_t buf[AFS_BLOCK_SIZE];
+    uint32_t block = sb.inode_table + ino / AFS_INODES_PER_BLOCK;
+    io_block(block, buf, 0);
+    AfsInode* slot = (AfsInode*)buf + ino % AFS_INODES_PER_BLOCK;
+    if (!write) {
+        *inode = *slot;
+        return;
+    }
+    *slot = *inode;
+    io_block(block, buf, 1);
+}
+
+// Claim block for ino; 0 if it cannot be used
+static int claim(uint32_t ino, uint32_t block) {
+    if (block < sb.data_start || block >= sb.block_count) {
+        problem("inode %u points outside the data area (block %u)", ino, block);
+        return 0;
+    }
+    if (test_bit(block_seen, block)) {
+        problem("inode %u shares block %u with another inode", ino, block);
+        return 0;
+    }
+    set_bit(block_seen, block, 1);
+    return 1;
+}
+
+// Claim a pointer tree of the given depth; returns the data blocks in it
+static uint32_t claim_tree(uint32_t ino, uint32_t block, int depth) {
+    if (!block) return 0;
+    if (!claim(ino, block)) return 0;
+    if (depth == 0) return 1;
+    uint32_t ptrs[AFS_PTRS_PER_BLOCK];
+    uint32_t data = 0;
+    io_block(block, ptrs, 0);
+    for (uint32_t i = 0; i < AFS_PTRS_PER_BLOCK; i++) data += claim_tree(ino, ptrs[i], depth - 1);
+    return data;
+}
+
+static uint32_t claim_inode(uint32_t ino, const AfsInode* inode) {
+    uint32_t data = 0;
+    for (int i = 0; i < AFS_DIRECT; i++) data += claim_tree(ino, inode->direct[i], 0);
+    data += claim_tree(ino, inode->indirect, 1);
+    data += claim_tree(ino, inode->double_indirect, 2);
+    uint32_t needed = (inode->size + AFS_BLOCK_SIZE - 1) / AFS_BLOCK_SIZE;
+    if (data > needed) problem("inode %u has %u blocks beyond its size", ino, data - needed);
+    return data;
+}
+
+// Disk block holding block n of a file, 0 for a hole
+static uint32_t bmap(const AfsInode* inode, uint32_t n) {
+    uint32_t ptrs[AFS_PTRS_PER_BLOCK];
+    if (n < AFS_DIRECT) return inode->direct[n];
+    n -= AFS_DIRECT;
+    uint32_t block = inode->indirect;
+    if (n >= AFS_PTRS_PER_BLOCK) {
+        n -= AFS_PTRS_PER_BLOCK;
+        if (!inode->double_indirect || n >= AFS_PTRS_PER_BLOCK * AFS_PTRS_PER_BLOCK) return 0;
+        io_block(inode->double_indirect, ptrs, 0);
+        block = ptrs[n / AFS_PTRS_PER_BLOCK];
+        n %= AFS_PTRS_PER_BLOCK;
+    }
+    if (!block || block >= sb.block_count) return 0;
+    io_block(block, ptrs, 0);
+    return ptrs[n];
+}
+
+// Check every entry of directory ino, queueing the subdirectories
+static void check_dir(uint32_t ino, const AfsInode* dir, uint32_t* queue, uint32_t* tail, int fix) {
+    if (dir->size % sizeof(AfsDirent)) problem("directory %u has a partial entry (size %u)", ino, dir->size);
+    for (uint32_t pos = 0; pos < dir->size; pos += AFS_BLOCK_SIZE) {
+        uint32_t block = bmap(dir, pos / AFS_BLOCK_SIZE);
+        if (block < sb.data_start || block >= sb.block_count) continue;
+        AfsDirent entries[AFS_DIRENTS_PER_BLOCK];
+        io_block(block, entries, 0);
+        int changed = 0;
+        uint32_t count = (dir->size - pos) / sizeof(AfsDirent);
+        if (count > AFS_DIRENTS_PER_BLOCK) count = AFS_DIRENTS_PER_BLOCK;
+        for (uint32_t i = 0; i < count; i++) {
+            AfsDirent* e = &entries[i];
+            if (!e->inode) continue;
+            AfsInode child;
+            int bad = 1;
+            if (e->inode >= sb.inode_count || e->inode == AFS_ROOT_INODE) {
+                problem("directory %u has an entry for invalid inode %u", ino, e->inode);
+            } else if (memchr(e->name, 0, AFS_NAME_MAX) == 0 || e->name[0] == 0) {
+                problem("directory %u has a bad name for inode %u", ino, e->inode);
+            } else if (test_bit(inode_seen, e->inode)) {
+                problem("inode %u is linked again from directory %u", e->inode, ino);
+            } else {
+                inode_io(e->inode, &child, 0);
+                if (child.type != e->type || (child.type != AFS_TYPE_FILE && child.type != AFS_TYPE_DIR)) {
+                    problem("directory %u has an entry of the wrong type for inode %u", ino, e->inode);
+                } else {
+                    bad = 0;
+                }
+            }
+            if (bad) {
+                if (fix) {
+                    memset(e, 0, sizeof(*e));
+                    changed = 1;
+                }
+                continue;
+            }
+            set_bit(inode_seen, e->inode, 1);
+            if (!test_bit(inode_map, e->inode)) problem("inode %u is in use but free in the bitmap", e->inode, 0);
+            if (child.parent != ino) {
+                problem("inode %u names %u as its parent", e->inode, child.parent);
+                if (fix) {
+                    child.parent = ino;
+                    inode_io(e->inode, &child, 1);
+                }
+            }
+            claim_inode(e->inode, &child);
+            if (child.type == AFS_TYPE_DIR) queue[(*tail)++] = e->inode;
+        }
+        if (changed) io_block(block, entries, 1);
+    }
+}
+
+int main(int argc, char** argv) {
+    int fix = argc == 3 && strcmp(argv[1], "-f") == 0;
+    if (argc != 2 + fix) {
+        fprintf(stderr, "Usage: fsck-afs [-f] <image>\n");
+        return 8;
+    }
+    const char* path = argv[1 + fix];
+    image = fopen(path, fix ? "r+b" : "rb");
+    if (!image) {
+        perror(path);
+        return 8;
+    }
+    uint8_t block[AFS_BLOCK_SIZE];
+    io_block(AFS_SUPER_BLOCK, block, 0);
+    memcpy(&sb, block, sizeof(sb));
+    fseek(image, 0, SEEK_END);
+    long blocks = ftell(image) / AFS_BLOCK_SIZE;
+    if (sb.magic != AFS_MAGIC || sb.version != AFS_VERSION || sb.block_size != AFS_BLOCK_SIZE) {
+        fprintf(stderr, "%s: no AFS file system\n", path);
+        return 8;
+    }
+    if (sb.block_count > (uint32_t)blocks || sb.inode_count > AFS_MAX_INODES ||
+        sb.inode_table_blocks * AFS_INODES_PER_BLOCK < sb.inode_count ||
+        sb.block_bitmap_blocks * AFS_BLOCK_SIZE * 8 < sb.block_count ||
+        sb.data_start != sb.inode_table + sb.inode_table_blocks || sb.data_start >= sb.block_count) {
+        fprintf(stderr, "%s: superblock geometry is inconsistent\n", path);
+        return 8;
+    }
+
+    uint32_t map_bytes = sb.block_bitmap_blocks * AFS_BLOCK_SIZE;
+    inode_map = malloc(AFS_BLOCK_SIZE);
+    inode_seen = calloc(1, AFS_BLOCK_SIZE);
+    block_map = malloc(map_bytes);
+    block_seen = calloc(1, map_bytes);
+    uint32_t* queue = malloc(sb.inode_count * sizeof(uint32_t));
+    if (!inode_map || !inode_seen || !block_map || !block_seen || !queue) {
+        fprintf(stderr, "fsck-afs: out of memory\n");
+        return 8;
+    }
+    io_block(sb.inode_bitmap, inode_map, 0);
+    for (uint32_t i = 0; i < sb.block_bitmap_blocks; i++) io_block(sb.block_bitmap + i, block_map + i * AFS_BLOCK_SIZE, 0);
+
+    // Metadata, and everything past the end of the disk, is always in use
+    for (uint32_t b = 0; b < map_bytes * 8; b++) {
+        if (b < sb.data_start || b >= sb.block_count) set_bit(block_seen, b, 1);
+    }
+    set_bit(inode_seen, 0, 1);
+
+    printf("Checking %s\n", path);
+    AfsInode root;
+    inode_io(AFS_ROOT_INODE, &root, 0);
+    if (root.type != AFS_TYPE_DIR) {
+        fprintf(stderr, "%s: root inode is not a directory\n", path);
+        return 8;
+    }
+    set_bit(inode_seen, AFS_ROOT_INODE, 1);
+    claim_inode(AFS_ROOT_INODE, &root);
+    uint32_t head = 0, tail = 0;
+    queue[tail++] = AFS_ROOT_INODE;
+    uint32_t dirs = 0, files = 0;
+    while (head < tail) {
+        uint32_t ino = queue[head++];
+        AfsInode dir;
+        inode_io(ino, &dir, 0);
+        check_dir(ino, &dir, queue, &tail, fix);
+        dirs++;
+    }
+
+    // Inodes the bitmap holds that no directory reaches
+    uint32_t used_inodes = 0;
+    for (uint32_t i = 1; i < sb.inode_count; i++) {
+        if (!test_bit(inode_map, i) || test_bit(inode_seen, i)) {
+            if (test_bit(inode_seen, i)) used_inodes++;
+            continue;
+        }
+        problem("inode %u is allocated but not in any directory", i, 0);
+        if (fix) {
+            AfsInode orphan;
+            memset(&orphan, 0, sizeof(orphan));
+            inode_io(i, &orphan, 1);
+        }
+    }
+    files = used_inodes - dirs;
+
+    uint32_t used_blocks = 0, leaked = 0, unmarked = 0;
+    for (uint32_t b = 0; b < sb.block_count; b++) {
+        int seen = test_bit(block_seen, b);
+        used_blocks += seen;
+        if (seen && !test_bit(block_map, b)) unmarked++;
+        if (!seen && test_bit(block_map, b)) leaked++;
+    }
+    if (unmarked) problem("%u blocks in use are free in the bitmap", unmarked, 0);
+    if (leaked) problem("%u blocks are allocated but unused", leaked, 0);
+    if (sb.free_blocks != sb.block_count - used_blocks) {
+        problem("superblock counts %u free blocks, found %u", sb.free_blocks, sb.block_count - used_blocks);
+    }
+    if (sb.free_inodes != sb.inode_count - 1 - used_inodes) {
+        problem("superblock counts %u free inodes, found %u", sb.free_inodes, sb.inode_count - 1 - used_inodes);
+    }
+    for (uint32_t b = sb.block_count; b < map_bytes * 8; b++) {
+        if (!test_bit(block_map, b)) {
+            problem("block bitmap leaves blocks past the end free (from %u)", b, 0);
+            break;
+        }
+    }
+
+    if (fix && errors) {
+        sb.free_blocks = sb.block_count - used_blocks;
+        sb.free_inodes = sb.inode_count - 1 - used_inodes;
+        memset(block, 0, sizeof(block));
+        memcpy(block, &sb, sizeof(sb));
+        io_block(AFS_SUPER_BLOCK, block, 1);
+        io_block(sb.inode_bitmap, inode_seen, 1);
+        for (uint32_t i = 0; i < sb.block_bitmap_blocks; i++) io_block(sb.block_bitmap + i, block_seen + i * AFS_BLOCK_SIZE, 1);
+    }
+    printf("%s: %u files, %u directories, %u of %u blocks used, %d problem%s%s\n",
+           path, files, dirs, used_blocks, sb.block_count, errors, errors == 1 ? "" : "s",
+           errors && fix ? " fixed" : "");
+    if (fclose(image) != 0) {
+        perror(path);
+        return 4;
+    }
+    if (!errors) return 0;
+    return fix ? 1 : 4;
+}
@@ -0,0 +1,113 @@
+// mkfs-afs.c - Create an empty AFS file system in a disk image
+//
+// Usage: mkfs-afs <image> [size-KB]
+//
+// With a size the image is created or resized to it first; otherwise the
+// existing image is formatted as it is. One inode is set aside for every
+// eight blocks, up to the AFS_MAX_INODES one bitmap block can track.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "../afs.h"
+
+static FILE* image;
+
+static void write_block(uint32_t block, const void* buf) {
+    if (fseek(image, (long)block * AFS_BLOCK_SIZE, SEEK_SET) != 0 ||
+        fwrite(buf, AFS_BLOCK_SIZE, 1, image) != 1) {
+        perror("mkfs-afs: write");
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: mkfs-afs <image> [size-KB]\n");
+        return 2;
+    }
+    const char* path = argv[1];
+    image = fopen(path, argc == 3 ? "a+b" : "r+b");
+    if (image) {
+        fclose(image);
+        image = fopen(path, "r+b");
+    }
+    if (!image) {
+        perror(path);
+        return 1;
+    }
+    if (argc == 3) {
+        long kb = strtol(argv[2], 0, 10);
+        if (kb <= 0 || ftruncate(fileno(image), (off_t)kb * 1024) != 0) {
+            fprintf(stderr, "mkfs-afs: cannot size %s to %s KB\n", path, argv[2]);
+            return 1;
+        }
+    }
+    struct stat st;
+    if (fstat(fileno(image), &st) != 0) {
+        perror(path);
+        return 1;
+    }
+
+    AfsSuper sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = AFS_MAGIC;
+    sb.version = AFS_VERSION;
+    sb.block_size = AFS_BLOCK_SIZE;
+    sb.block_count = st.st_size / AFS_BLOCK_SIZE;
+    sb.inode_count = sb.block_count / 8;
+    if (sb.inode_count > AFS_MAX_INODES) sb.inode_count = AFS_MAX_INODES;
+    sb.inode_count -= sb.inode_count % AFS_INODES_PER_BLOCK;
+    sb.inode_bitmap = AFS_SUPER_BLOCK + 1;
+    sb.block_bitmap = sb.inode_bitmap + 1;
+    sb.block_bitmap_blocks = (sb.block_count + AFS_BLOCK_SIZE * 8 - 1) / (AFS_BLOCK_SIZE * 8);
+    sb.inode_table = sb.block_bitmap + sb.block_bitmap_blocks;
+    sb.inode_table_blocks = sb.inode_count / AFS_INODES_PER_BLOCK;
+    sb.data_start = sb.inode_table + sb.inode_table_blocks;
+    if (sb.inode_count < 2 * AFS_INODES_PER_BLOCK || sb.data_start >= sb.block_count) {
+        fprintf(stderr, "mkfs-afs: %s is too small\n", path);
+        return 1;
+    }
+    sb.free_blocks = sb.block_count - sb.data_start;
+    sb.free_inodes = sb.inode_count - 2;    // Inode 0 and the root
+
+    uint8_t block[AFS_BLOCK_SIZE];
+    memset(block, 0, sizeof(block));
+    write_block(0, block);
+    memcpy(block, &sb, sizeof(sb));
+    write_block(AFS_SUPER_BLOCK, block);
+
+    memset(block, 0, sizeof(block));
+    block[0] = 0x03;                        // Inode 0 and the root
+    write_block(sb.inode_bitmap, block);
+
+    // Metadata blocks and the bits past the end of the disk are in use
+    for (uint32_t i = 0; i < sb.block_bitmap_blocks; i++) {
+        memset(block, 0, sizeof(block));
+        for (uint32_t bit = 0; bit < AFS_BLOCK_SIZE * 8; bit++) {
+            uint32_t b = i * AFS_BLOCK_SIZE * 8 + bit;
+            if (b < sb.data_start || b >= sb.block_count) block[bit >> 3] |= 1 << (bit & 7);
+        }
+        write_block(sb.block_bitmap + i, block);
+    }
+
+    for (uint32_t i = 0; i < sb.inode_table_blocks; i++) {
+        memset(block, 0, sizeof(block));
+        if (i == AFS_ROOT_INODE / AFS_INODES_PER_BLOCK) {
+            AfsInode* root = (AfsInode*)block + AFS_ROOT_INODE % AFS_INODES_PER_BLOCK;
+            root->type = AFS_TYPE_DIR;
+            root->parent = AFS_ROOT_INODE;
+        }
+        write_block(sb.inode_table + i, block);
+    }
+
+    if (fclose(image) != 0) {
+        perror(path);
+        return 1;
+    }
+    printf("%s: %u blocks of %u bytes, %u inodes, %u blocks free\n",
+           path, sb.block_count, AFS_BLOCK_SIZE, sb.inode_count, sb.free_blocks);
+    return 0;
+}
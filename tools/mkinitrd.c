@@ -0,0 +1,104 @@
+// mkinitrd.c - Pack a host directory into a cpio "newc" archive for the
+// kernel to preload at boot as a multiboot module
+//
+// Usage: mkinitrd <directory> <archive>
+//
+// Names in the archive are relative to the directory. Only directories
+// and regular files are packed; anything else is skipped with a warning.
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static FILE* archive;
+static uint32_t ino = 1;
+
+static void pad(long size) {
+    while (size++ % 4) fputc(0, archive);
+}
+
+static void entry(const char* name, uint32_t mode, uint32_t size) {
+    uint32_t name_size = strlen(name) + 1;
+    fprintf(archive, "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+            ino++, mode, 0, 0, 1, 0, size, 0, 0, 0, 0, name_size, 0);
+    fwrite(name, name_size, 1, archive);
+    pad(110 + name_size);
+}
+
+// Pack the tree at path, which is called name in the archive
+static int pack(const char* path, const char* name) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        perror(path);
+        return -1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        FILE* f = fopen(path, "rb");
+        if (!f) {
+            perror(path);
+            return -1;
+        }
+        entry(name, 0100644, st.st_size);
+        char buf[65536];
+        size_t n;
+        long total = 0;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            fwrite(buf, 1, n, archive);
+            total += n;
+        }
+        fclose(f);
+        if (total != st.st_size) {
+            fprintf(stderr, "mkinitrd: %s changed while packing\n", path);
+            return -1;
+        }
+        pad(total);
+        return 0;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "mkinitrd: skipping %s (not a file or directory)\n", path);
+        return 0;
+    }
+    if (name[0]) entry(name, 0040755, 0);
+    DIR* d = opendir(path);
+    if (!d) {
+        perror(path);
+        return -1;
+    }
+    int status = 0;
+    struct dirent* de;
+    while (status == 0 && (de = readdir(d)) != 0) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        size_t path_len = strlen(path) + strlen(de->d_name) + 2;
+        size_t name_len = strlen(name) + strlen(de->d_name) + 2;
+        char* child_path = malloc(path_len);
+        char* child_name = malloc(name_len);
+        snprintf(child_path, path_len, "%s/%s", path, de->d_name);
+        snprintf(child_name, name_len, "%s%s%s", name, name[0] ? "/" : "", de->d_name);
+        status = pack(child_path, child_name);
+        free(child_path);
+        free(child_name);
+    }
+    closedir(d);
+    return status;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: mkinitrd <directory> <archive>\n");
+        return 2;
+    }
+    archive = fopen(argv[2], "wb");
+    if (!archive) {
+        perror(argv[2]);
+        return 1;
+    }
+    int status = pack(argv[1], "");
+    entry("TRAILER!!!", 0, 0);
+    if (fclose(archive) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    return status == 0 ? 0 : 1;
+}